@@ -26,6 +26,47 @@ typedef struct ConfigStoreFileHeader {
     uint32_t crc;                // The CRC of the portion of the file after this field.
 } __attribute__((packed)) ConfigStoreFileHeader;
 
+/// <summary> Types of extension KVPs. </summary>
+typedef enum ConfigStoreExtensionType {
+    ConfigStoreExtension_Attributes = 1,
+    ConfigStoreExtension_Reference = 2,
+    ConfigStoreExtension_SharedValue = 3,
+} ConfigStoreExtensionType;
+
+/// <summary> Flags of ConfigStoreValueAttributes. </summary>
+typedef enum ConfigStoreValueFlags {
+    /// <summary> The value is compressed; raw_size is the size once decompressed. </summary>
+    ConfigStoreValue_Compressed = 0x01,
+} ConfigStoreValueFlags;
+
+/// <summary> Extension KVP that follows a value stored in another form than it was put. </summary>
+typedef struct ConfigStoreValueAttributes {
+    ConfigStoreKvpHeader header; // Header, with ConfigStoreExtensionKey.
+    uint8_t type;                // ConfigStoreExtension_Attributes.
+    uint8_t flags;               // ConfigStoreValueFlags.
+    uint32_t raw_size;           // The size of the value as it was put.
+} __attribute__((packed)) ConfigStoreValueAttributes;
+
+/// <summary> Extension KVP that follows an empty value that stands for a shared value. </summary>
+typedef struct ConfigStoreValueReference {
+    ConfigStoreKvpHeader header; // Header, with ConfigStoreExtensionKey.
+    uint8_t type;                // ConfigStoreExtension_Reference.
+    uint8_t flags;               // Reserved, 0.
+    uint32_t hash;               // The hash of the ConfigStoreSharedValue.
+} __attribute__((packed)) ConfigStoreValueReference;
+
+/// <summary>
+/// Extension KVP that holds a value shared by several keys, followed by the value. Shared values
+/// trail the file header.
+/// </summary>
+typedef struct ConfigStoreSharedValue {
+    ConfigStoreKvpHeader header; // Header, with ConfigStoreExtensionKey.
+    uint8_t type;                // ConfigStoreExtension_SharedValue.
+    uint8_t flags;               // Reserved, 0.
+    uint32_t hash;               // The CRC of the value, unique among the shared values.
+    uint32_t refs;               // The number of ConfigStoreValueReference to the value.
+} __attribute__((packed)) ConfigStoreSharedValue;
+
 /// <summary> Range of keys reserved for the store itself. </summary>
 static const uint16_t ConfigStoreMinKey = 0x0000;
 static const uint16_t ConfigStoreMaxKey = 0xFFFA;
@@ -33,10 +74,28 @@ static const uint16_t ConfigStoreMinReservedKey = 0xFFFB;
 static const uint16_t ConfigStoreMaxReservedKey = 0xFFFF;
 static const uint16_t ConfigStoreInvalidKey = 0xFFFF;
 static const uint16_t ConfigStoreFileHeaderKey = 0xFFFB;
+/// <summary> Key of KVPs that only hold free space. Iteration skips them. </summary>
+static const uint16_t ConfigStorePaddingKey = 0xFFFC;
+/// <summary>
+/// Key of KVPs that hold the rest of a chunked value, right after the KVP that holds its first
+/// chunk. Iteration skips them.
+/// </summary>
+static const uint16_t ConfigStoreContinuationKey = 0xFFFD;
+/// <summary>
+/// Key of KVPs that describe the value before them (and its continuations), such as
+/// ConfigStoreValueAttributes. Iteration skips them.
+/// </summary>
+static const uint16_t ConfigStoreExtensionKey = 0xFFFE;
 static const uint32_t ConfigStoreCrcInitValue = 0xFFFFFFFF;
 
 static const uint8_t ConfigStoreFileSignature = 0xC6;
 static const uint8_t ConfigStoreFileVersion = 0;
+/// <summary>
+/// File version with variable-length KVP headers: after the file header, each KVP is written as
+/// its key and value size in LEB128 followed by the value, so small KVPs take 3 bytes of header
+/// less. Stores always use version 0 in memory; version 1 is decoded on open and encoded on commit.
+/// </summary>
+static const uint8_t ConfigStoreFileVersionCompact = 1;
 
 /// <summary>
 /// This adjusts the file system overhead for each storage block.
@@ -67,6 +126,166 @@ bool ConfigStore_CanDereferenceKvp(const ConfigStoreKvpHeader *p, const ConfigSt
 ConfigStoreKvpHeader *ConfigStore_GetNextKvp(const ConfigStoreKvpHeader *p,
                                              const ConfigStoreKvpHeader *pEnd);
 
+/// <summary> Flash wear accounting of a store. </summary>
+typedef struct ConfigStoreWearInfo {
+    uint64_t logical_bytes_written;   // Bytes written by commits.
+    uint64_t physical_blocks_written; // Estimated storage blocks rewritten by commits.
+    uint64_t commits;                 // Commits that reached storage.
+    uint64_t deferred_commits;        // Commits deferred, and coalesced into a later one.
+    uint32_t commits_last_hour;       // Commits that reached storage in the last hour.
+} ConfigStoreWearInfo;
+
+/// <summary>
+/// Decides whether a commit of <paramref name="commit_size" /> bytes may be written now.
+/// Returning false defers the commit.
+/// </summary>
+typedef bool (*ConfigStoreWearBudgetCallback)(void *context, const ConfigStoreWearInfo *info,
+                                              size_t commit_size);
+
+/// <summary> Wear bookkeeping of a store. Private. </summary>
+typedef struct ConfigStoreWear {
+    ConfigStoreWearInfo info;
+    uint16_t commits_per_minute[60];
+    uint64_t last_minute;
+} ConfigStoreWear;
+
+/// <summary>
+/// Optional behaviors of a store. Set with ConfigStore_SetOptions before opening the store.
+/// A zero-initialized structure selects the defaults.
+/// </summary>
+typedef struct ConfigStoreOptions {
+    /// <summary>
+    /// Publishes an immutable snapshot of the committed buffer on open and on every commit, which
+    /// other threads can acquire with ConfigStore_Snapshot.
+    /// </summary>
+    bool publish_snapshots;
+
+    /// <summary>
+    /// If not NULL, the name of a POSIX shared memory object (as in shm_open) into which a writer
+    /// publishes its committed image on open and on every commit. Other processes of the same user
+    /// can map it with ConfigStore_SharedViewOpen: the object is created with mode 0600, and an
+    /// existing one is only reused if the user owns it with no group or other access. The string
+    /// must outlive the store.
+    /// </summary>
+    const char *shared_view_name;
+
+    /// <summary>
+    /// If not zero, commits beyond this many in the last hour are deferred instead of written.
+    /// </summary>
+    uint32_t max_commits_per_hour;
+
+    /// <summary> If not NULL, consulted before every commit; see ConfigStoreWearBudgetCallback. </summary>
+    ConfigStoreWearBudgetCallback wear_budget;
+    void *wear_budget_context;
+
+    /// <summary>
+    /// If not zero, ConfigStore_PutValue compresses values of at least this many bytes, and keeps
+    /// them compressed if that saves space. The store then keeps a work area of 16 KB plus the
+    /// largest value it compressed until it's closed, rather than allocating it on every put.
+    /// </summary>
+    size_t compress_threshold;
+
+    /// <summary>
+    /// The file version of new stores: ConfigStoreFileVersion or ConfigStoreFileVersionCompact.
+    /// Existing stores keep the version of their file; see ConfigStore_SetFileVersion.
+    /// </summary>
+    uint8_t file_version;
+
+    /// <summary>
+    /// If not zero, opens validate files of at least this many bytes in parallel; see
+    /// ConfigStore_ValidateFormatParallel. Smaller files are validated serially.
+    /// </summary>
+    size_t parallel_validation_threshold;
+
+    /// <summary>
+    /// Threads that hash the file for parallel validation. 0 means
+    /// CONFIG_STORE_DEFAULT_VALIDATION_THREADS.
+    /// </summary>
+    unsigned validation_threads;
+} ConfigStoreOptions;
+
+/// <summary> Threads that hash the file for parallel validation, unless set in the options. </summary>
+#define CONFIG_STORE_DEFAULT_VALIDATION_THREADS 4
+
+/// <summary> Layout of the shared memory object of a shared view. Private. </summary>
+struct ConfigStoreSharedImage;
+
+/// <summary> Number of buckets of the latency histograms of ConfigStoreStats. </summary>
+#define CONFIG_STORE_LATENCY_BUCKETS 24
+
+/// <summary>
+/// Operation counters of a store. Only collected when the library is built with
+/// CONFIG_STORE_ENABLE_STATS; otherwise the bookkeeping compiles away.
+/// Latency histograms are log-bucketed: bucket i counts operations that took [2^i, 2^(i+1))
+/// microseconds, bucket 0 also counts anything faster and the last bucket anything slower.
+/// </summary>
+typedef struct ConfigStoreStats {
+    uint64_t opens;         // Successful opens.
+    uint64_t commits;       // Successful commits that wrote the file.
+    uint64_t bytes_read;    // Bytes read from the store file.
+    uint64_t bytes_written; // Bytes written to the store file.
+    uint64_t fsyncs;        // Calls to fsync.
+    uint64_t fsync_ns;      // Time spent in fsync.
+    uint64_t crc_bytes;     // Bytes hashed for CRC on open and commit.
+    uint64_t lookup_hops;   // Keys examined by lookups.
+    uint64_t reallocs;      // Reallocations of the buffer.
+    uint64_t bytes_moved;   // Bytes moved by memmove to insert or erase KVPs.
+    uint64_t commits_skipped;     // Commits with nothing to write.
+    uint64_t bytes_write_avoided; // Bytes not written by the skipped commits.
+    uint64_t compactions;         // Compactions of the padding out of the buffer.
+    uint64_t open_latency[CONFIG_STORE_LATENCY_BUCKETS];
+    uint64_t commit_latency[CONFIG_STORE_LATENCY_BUCKETS];
+} ConfigStoreStats;
+
+/// <summary> Points of the store traced by ConfigStore_SetTracer and by USDT probes. </summary>
+typedef enum ConfigStoreTraceEvent {
+    /// <summary> read() of the store file on open. </summary>
+    ConfigStoreTrace_OpenRead = 0,
+    /// <summary> Format validation (CRC and KVP walk) on open. </summary>
+    ConfigStoreTrace_Validate = 1,
+    /// <summary> CRC of the buffer on commit. </summary>
+    ConfigStoreTrace_CommitCrc = 2,
+    /// <summary> write() of the store file. </summary>
+    ConfigStoreTrace_Write = 3,
+    /// <summary> ftruncate() of the store file. </summary>
+    ConfigStoreTrace_Truncate = 4,
+    /// <summary> fsync() of the store file. </summary>
+    ConfigStoreTrace_Fsync = 5,
+    /// <summary> rename() of the swap file over the primary file. </summary>
+    ConfigStoreTrace_Rename = 6,
+    /// <summary> realloc() of the buffer. </summary>
+    ConfigStoreTrace_Realloc = 7,
+} ConfigStoreTraceEvent;
+
+/// <summary> Receives a trace event with the bytes involved and the time it took. </summary>
+typedef void (*ConfigStoreTraceCallback)(void *context, ConfigStoreTraceEvent event, size_t size,
+                                         uint64_t duration_ns);
+
+/// <summary>
+/// Registers a process-wide tracer, or unregisters it if <paramref name="callback" /> is NULL.
+/// A call already tracing keeps the callback and context it started with; if the registration
+/// can't be allocated, tracing is turned off. Without a tracer or an attached probe, events aren't
+/// timed.
+/// Independently of the tracer, when sys/sdt.h is available at build time each event is also a
+/// USDT probe of provider "azscfgsto" (open_read, validate, commit_crc, write, truncate, fsync,
+/// rename, realloc) with the size and duration as arguments, for perf and bpftrace.
+/// </summary>
+void ConfigStore_SetTracer(ConfigStoreTraceCallback callback, void *context);
+
+/// <summary> Immutable, reference-counted view of the committed buffer of a store. </summary>
+typedef struct ConfigStoreSnapshot ConfigStoreSnapshot;
+
+/// <summary>
+/// Contiguous index of the keys in the store, kept in KVP order alongside the buffer so lookups
+/// can scan keys without chasing the size of each KVP. Private to the implementation.
+/// </summary>
+struct ConfigStoreKeyIndex;
+
+/// <summary>
+/// Undo log of the open savepoints of a store. Private to the implementation.
+/// </summary>
+struct ConfigStoreUndoLog;
+
 /// <summary> The Config Store State. </summary>
 typedef struct ConfigStore {
     int _fd;
@@ -77,6 +296,24 @@ typedef struct ConfigStore {
     ConfigStoreReplicaType _replica_type;
     char *_primary_path;
     char *_replica_path;
+    struct ConfigStoreKeyIndex *_index;
+    size_t _padding_size;
+    struct ConfigStoreUndoLog *_undo;
+    uint8_t *_work;
+    size_t _work_size;
+    ConfigStoreOptions _options;
+    uint64_t _snapshot; // Published ConfigStoreSnapshot, tagged with the readers acquiring it.
+    struct ConfigStoreSharedImage *_shared_image;
+    size_t _shared_image_size;
+#ifdef CONFIG_STORE_ENABLE_STATS
+    ConfigStoreStats _stats;
+#endif
+    ConfigStoreWear _wear;
+    size_t _block_size;
+    bool _commit_deferred;
+    bool _committed;
+    size_t _committed_size;
+    uint32_t _committed_crc;
 } ConfigStore;
 
 /// <summary>
@@ -93,10 +330,27 @@ void ConfigStore_Init(ConfigStore *p);
 
 /// <summary>
 /// Resets the memory of a ConfigStore. Disposes of any allocated resources. Equivalent to a
-/// destructor, but puts the store back into an initialized state.
+/// destructor, but puts the store back into an initialized state. The options, the statistics
+/// and the wear accounting of the store are kept. Nothing is written: a commit deferred by the
+/// wear throttle is discarded like uncommitted changes, so call ConfigStore_Flush first to keep it.
 /// </summary>
 void ConfigStore_Close(ConfigStore *p);
 
+/// <summary>
+/// Gets the operation counters accumulated by the store since ConfigStore_Init.
+/// </summary>
+/// <returns>
+/// 0 on success; -1 with errno set to ENOTSUP if the library was built without
+/// CONFIG_STORE_ENABLE_STATS.
+/// </returns>
+int ConfigStore_GetStats(const ConfigStore *p, ConfigStoreStats *stats);
+
+/// <summary>
+/// Sets the options of the store. Options affect the next open; set them after ConfigStore_Init
+/// and before ConfigStore_Open.
+/// </summary>
+void ConfigStore_SetOptions(ConfigStore *p, const ConfigStoreOptions *options);
+
 /// <summary>
 /// Transfers the resources of a ConfigStore to another.
 /// </summary>
@@ -119,15 +373,119 @@ int ConfigStore_Open(ConfigStore *p, const char *base_filepath, size_t max_size,
 
 /// <summary>
 /// Commits the in-memory changes back to persistent storage.
+/// Padding left by erased or shrunk KVPs is left out of the file, but not moved out of the buffer,
+/// so pointers to KVPs stay valid.
 /// Note:
 /// If the file was opened in ConfigStoreReplica_Swap replica mode, this call will also close the
 /// object. This is because the object can't re-acquire its lock on the file without re-opening it,
 /// which temporarily allows for other objects to open and lock it. In this case the object may as
 /// well close the file on commit.
+/// If the size and CRC of the content match what was last opened or committed, there's nothing to
+/// write and the call returns without I/O.
+/// When the store is throttled (see max_commits_per_hour and wear_budget in ConfigStoreOptions),
+/// the commit may instead be deferred: the call succeeds without I/O and the changes are written by
+/// a later commit or by ConfigStore_Flush. ConfigStore_Close never writes, so it discards them like
+/// uncommitted changes. Commits in ConfigStoreReplica_Swap mode are never deferred.
 /// </summary>
 /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
 int ConfigStore_Commit(ConfigStore *p);
 
+/// <summary>
+/// Selects the file version written by commits. The file is migrated by the next commit, which
+/// writes even if the content didn't change.
+/// </summary>
+/// <param name="version"> ConfigStoreFileVersion or ConfigStoreFileVersionCompact. </param>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_SetFileVersion(ConfigStore *p, uint8_t version);
+
+/// <summary> Gets the file version written by commits, or by the next open if closed. </summary>
+uint8_t ConfigStore_GetFileVersion(const ConfigStore *p);
+
+/// <summary>
+/// Opens a savepoint, nested in the savepoints already open. From then on, the store records the
+/// bytes that its changes overwrite (InsertKvp, EraseKvp, PutUniqueKey, value writers, ...) so they
+/// can be rolled back at a cost proportional to the changes rather than to the size of the store.
+/// Writes that don't go through the store aren't recorded: ConfigStore_WriteValue and writes
+/// through pointers to a KVP are only undone if the store changed the KVP since the savepoint
+/// (for instance, because it was inserted or put after it).
+/// A commit releases all the savepoints.
+/// </summary>
+/// <returns> The savepoint (its depth, from 1) on success; -1 on failure with error indication in
+/// errno. </returns>
+int ConfigStore_Savepoint(ConfigStore *p);
+
+/// <summary>
+/// Undoes the changes made since a savepoint, and releases the savepoints nested in it. The
+/// savepoint itself stays open. Invalidates pointers to KVPs.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (EINVAL if the savepoint
+/// isn't open, ENOMEM if recording a change ran out of memory: the savepoints stay open, but the
+/// changes can't be undone). </returns>
+int ConfigStore_RollbackTo(ConfigStore *p, int savepoint);
+
+/// <summary>
+/// Releases a savepoint and the savepoints nested in it, keeping their changes. The changes are
+/// still undone by a rollback to an enclosing savepoint.
+/// </summary>
+/// <returns> 0 on success; -1 with errno set to EINVAL if the savepoint isn't open. </returns>
+int ConfigStore_Release(ConfigStore *p, int savepoint);
+
+/// <summary>
+/// Writes a commit deferred by the wear throttle, if any, bypassing the throttle. Like a commit, it
+/// writes the current content, including changes made since the deferred commit. Call it before
+/// ConfigStore_Close to keep deferred commits.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_Flush(ConfigStore *p);
+
+/// <summary>
+/// Commit of several stores whose changes reach their files all or none, even across a crash.
+/// When more than one store changed, or a store in ConfigStoreReplica_None mode (which is written in
+/// place) did, their file images are first written to a journal, which is itself a store file, and
+/// the journal is removed once every store is written. That takes one fsync for the journal and one
+/// per store. A single changed store in ConfigStoreReplica_Swap mode is committed without a journal.
+/// </summary>
+typedef struct ConfigStoreTransaction {
+    char *_journal_path;
+    ConfigStore **_stores;
+    size_t _count;
+    size_t _capacity;
+} ConfigStoreTransaction;
+
+/// <summary> Initializes the memory of a ConfigStoreTransaction for usage. </summary>
+void ConfigStore_TransactionInit(ConfigStoreTransaction *t);
+
+/// <summary> Starts a transaction that journals to a given file. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_TransactionBegin(ConfigStoreTransaction *t, const char *journal_path);
+
+/// <summary> Adds an open store to the transaction. The store must outlive the transaction. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_TransactionAdd(ConfigStoreTransaction *t, ConfigStore *p);
+
+/// <summary>
+/// Commits the stores of the transaction as ConfigStore_Commit would, bypassing the wear throttle.
+/// Stores whose content didn't change aren't written. If the call fails after the journal was
+/// written, the transaction is committed nonetheless: ConfigStore_TransactionRecover completes it.
+/// The directory of the journal is synced after the journal is written and after it's removed.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_TransactionCommit(ConfigStoreTransaction *t);
+
+/// <summary> Ends the transaction and disposes of any allocated resources. </summary>
+void ConfigStore_TransactionClose(ConfigStoreTransaction *t);
+
+/// <summary>
+/// Completes the transaction left by a crash in a journal, if any: writes the file images of a
+/// complete journal to their stores, or discards a torn one, and removes the journal. Call it
+/// before opening the stores of the transaction, which must not be locked.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_TransactionRecover(const char *journal_path);
+
+/// <summary> Gets the wear accounting of the store. </summary>
+void ConfigStore_GetWearInfo(const ConfigStore *p, ConfigStoreWearInfo *info);
+
 /// <summary> Gets a pointer to the first KVP in the store. </summary>
 /// <param name="p"> Required pointer to the store. </param>
 /// <returns> A pointer for the KVP. </returns>
@@ -137,12 +495,20 @@ ConfigStoreKvpHeader *ConfigStore_BeginKvp(const ConfigStore *p);
 /// <returns> A pointer for the guard KVP. </returns>
 ConfigStoreKvpHeader *ConfigStore_EndKvp(const ConfigStore *p);
 
-/// <summary> Inserts a KVP of a given size and at a given position. </summary>
+/// <summary>
+/// Inserts a KVP of a given size and at a given position. If the KVP fits in the padding right
+/// before the position, it takes over the padding; otherwise the KVPs after it are moved.
+/// When the store is full, the padding is compacted first, which invalidates pointers to KVPs.
+/// </summary>
 /// <returns> A pointer for the inserted KVP or the guard KVP on memory exhaustion. </returns>
 ConfigStoreKvpHeader *ConfigStore_InsertKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos,
                                             ConfigStoreKey key, size_t size);
 
-/// <summary> Erases a KVP in a given position. </summary>
+/// <summary>
+/// Erases a KVP in a given position. The KVP becomes padding, so the KVPs after it don't move,
+/// unless the padding in the buffer passes a threshold: then it's compacted, which invalidates
+/// pointers to KVPs other than the returned one.
+/// </summary>
 /// <returns> A pointer for the KVP following the one that was removed. </returns>
 ConfigStoreKvpHeader *ConfigStore_EraseKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos);
 
@@ -196,25 +562,420 @@ ConfigStoreKvpHeader *ConfigStore_GetNextKvpInRange(ConfigStore *p, const Config
                                                     ConfigStoreKey last_key,
                                                     ConfigStoreKey key_increment);
 
-/// <summary> Attempts to get the first match of a key. </summary>
+/// <summary>
+/// Gets the keys of the visible KVPs, in the order of the KVPs in the buffer. Lets callers scan
+/// keys without walking the buffer; the array is invalidated by any change to the store.
+/// </summary>
+/// <param name="keys"> Receives the array of keys. </param>
+/// <returns> The number of keys. </returns>
+size_t ConfigStore_GetIndexedKeys(const ConfigStore *p, const ConfigStoreKey **keys);
+
+/// <summary> Gets the KVP of the i-th key returned by ConfigStore_GetIndexedKeys. </summary>
+ConfigStoreKvpHeader *ConfigStore_GetIndexedKvp(const ConfigStore *p, size_t i);
+
+/// <summary>
+/// Attempts to get the first match of a key. The value of the KVP is the value of the key only if
+/// ConfigStore_IsPlainValue says so: values put with ConfigStore_PutValue may be compressed, and
+/// those put with ConfigStore_PutSharedValue are stored elsewhere. Read those with
+/// ConfigStore_ReadValue.
+/// </summary>
 /// <returns> Pointer to the KVP or null if the key is not found. </returns>
 ConfigStoreKvpHeader *ConfigStore_TryGetKey(const ConfigStore *p, ConfigStoreKey key);
 
+/// <summary>
+/// Counters of the Bloom filter that short-circuits key lookups.
+/// The false-positive rate is false_positives / (filtered + false_positives).
+/// </summary>
+typedef struct ConfigStoreLookupFilterStats {
+    uint64_t lookups;         // Lookups that consulted the filter.
+    uint64_t filtered;        // Lookups the filter answered as definite misses.
+    uint64_t false_positives; // Lookups the filter let through but found no key.
+} ConfigStoreLookupFilterStats;
+
+/// <summary> Gets the counters of the lookup filter of the store. </summary>
+void ConfigStore_GetLookupFilterStats(const ConfigStore *p, ConfigStoreLookupFilterStats *stats);
+
 /// <summary>
 /// Puts a KVP in the store and ensures its key is unique by erasing any other KVP of same key.
 /// Optionally the function also copies a value to the KVP's value.
+/// An existing KVP of the key is reused in place when possible: a smaller value leaves padding
+/// behind, and a larger one takes over padding (or free capacity) that follows the KVP.
+/// Otherwise the KVP goes to the first padding it fits in, or to the end of the store.
 /// </summary>
+/// <returns> Pointer to the KVP on success; NULL on failure with error indication in errno.
+/// </returns>
 ConfigStoreKvpHeader *ConfigStore_PutUniqueKey(ConfigStore *p, ConfigStoreKey key,
                                                const uint8_t *optional_data, size_t value_size);
 
-/// <summary> Helper to write to a value of a KVP. </summary>
+/// <summary>
+/// Acquires the latest snapshot published by a store opened with the publish_snapshots option.
+/// This may be called from any thread while the writer keeps mutating the store: the snapshot
+/// never changes and stays valid until it's released, regardless of later commits.
+/// The store itself must stay open while other threads acquire snapshots. Note that commits in
+/// ConfigStoreReplica_Swap mode close the store.
+/// </summary>
+/// <returns> The snapshot on success; NULL with errno set to ENOENT if nothing is published. </returns>
+ConfigStoreSnapshot *ConfigStore_Snapshot(ConfigStore *p);
+
+/// <summary> Releases a snapshot acquired with ConfigStore_Snapshot. </summary>
+void ConfigStore_SnapshotRelease(ConfigStoreSnapshot *s);
+
+/// <summary> Gets a pointer to the first KVP in the snapshot. </summary>
+const ConfigStoreKvpHeader *ConfigStore_SnapshotBeginKvp(const ConfigStoreSnapshot *s);
+
+/// <summary> Gets a pointer to the "guard" KVP of the snapshot. </summary>
+const ConfigStoreKvpHeader *ConfigStore_SnapshotEndKvp(const ConfigStoreSnapshot *s);
+
+/// <summary> Attempts to get the first match of a key in the snapshot. </summary>
+/// <returns> Pointer to the KVP or null if the key is not found. </returns>
+const ConfigStoreKvpHeader *ConfigStore_SnapshotTryGetKey(const ConfigStoreSnapshot *s,
+                                                          ConfigStoreKey key);
+
+/// <summary>
+/// Watches a store file for commits from other processes. The watch exposes a file descriptor
+/// that becomes readable (for poll/select/epoll) when the file may have changed.
+/// </summary>
+typedef struct ConfigStoreWatch {
+    int _fd;
+    char *_dir_path;
+    char *_file_name;
+    uint32_t _file_size;
+    uint32_t _crc;
+} ConfigStoreWatch;
+
+/// <summary> Initializes the memory of a ConfigStoreWatch for usage. </summary>
+void ConfigStore_WatchInit(ConfigStoreWatch *w);
+
+/// <summary>
+/// Starts watching a store file. The file doesn't need to exist yet. Commits in both replica modes
+/// are detected: in-place writes as they're written, even while the writer keeps the file open,
+/// and swaps when the replica is renamed over the primary file.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_WatchOpen(ConfigStoreWatch *w, const char *base_filepath);
+
+/// <summary> Gets the pollable file descriptor of the watch. </summary>
+int ConfigStore_WatchGetFd(const ConfigStoreWatch *w);
+
+/// <summary>
+/// Drains the pending notifications of the watch without blocking and checks whether the committed
+/// content changed since the last call, by comparing the size and CRC in the file header. A file
+/// that doesn't match its header, such as one in the middle of an in-place commit, doesn't count
+/// as changed until the commit completes.
+/// </summary>
+/// <returns> 1 if the store changed; 0 if it didn't; -1 on failure with error indication in errno.
+/// </returns>
+int ConfigStore_WatchConsume(ConfigStoreWatch *w);
+
+/// <summary> Stops watching and disposes of any allocated resources. </summary>
+void ConfigStore_WatchClose(ConfigStoreWatch *w);
+
+/// <summary>
+/// Read-only mapping of the image a writer publishes with the shared_view_name option.
+/// Reads are lock-free and zero-copy, and follow the seqlock protocol: take a sequence with
+/// ConfigStore_SharedViewBegin, read the KVPs in place (copying out what's needed), then call
+/// ConfigStore_SharedViewRetry and start over if it returns true.
+/// </summary>
+typedef struct ConfigStoreSharedView {
+    int _fd;
+    const struct ConfigStoreSharedImage *_image;
+    size_t _map_size;
+} ConfigStoreSharedView;
+
+/// <summary> Initializes the memory of a ConfigStoreSharedView for usage. </summary>
+void ConfigStore_SharedViewInit(ConfigStoreSharedView *v);
+
+/// <summary> Maps the shared view published under a given name. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_SharedViewOpen(ConfigStoreSharedView *v, const char *name);
+
+/// <summary>
+/// Begins reading the shared view. Waits for an in-progress publication to complete, for up to
+/// about 100 ms: a writer that died mid-publication leaves it incomplete until the next writer
+/// publishes. If the writer was reopened with a larger max size than when the view was mapped,
+/// the image reads as empty and the view must be reopened.
+/// </summary>
+/// <param name="pSeq"> Receives the sequence to pass to ConfigStore_SharedViewRetry. </param>
+/// <param name="pFirst"> Receives the first KVP of the image. </param>
+/// <param name="pLast"> Receives the "guard" KVP of the image. </param>
+/// <returns> 0 on success; -1 with errno set to ETIMEDOUT if the publication didn't complete.
+/// </returns>
+int ConfigStore_SharedViewBegin(const ConfigStoreSharedView *v, uint32_t *pSeq,
+                                const ConfigStoreKvpHeader **pFirst,
+                                const ConfigStoreKvpHeader **pLast);
+
+/// <summary> Checks whether the image was republished since ConfigStore_SharedViewBegin. </summary>
+/// <returns> true if whatever was read must be discarded and read again; false otherwise. </returns>
+bool ConfigStore_SharedViewRetry(const ConfigStoreSharedView *v, uint32_t seq);
+
+/// <summary> Unmaps the shared view and disposes of any allocated resources. </summary>
+void ConfigStore_SharedViewClose(ConfigStoreSharedView *v);
+
+/// <summary>
+/// Helper to write to a value of a KVP. The rest of the value after the written bytes is zeroed;
+/// see ConfigStoreValueWriter to write a value in pieces.
+/// </summary>
 /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
 int ConfigStore_WriteValue(ConfigStoreKvpHeader *pos, size_t offset, const void *data, size_t size);
 
-/// <summary> Checks if the contents of a buffer are a valid configuration store. </summary>
+/// <summary> Largest value a single KVP can hold. Larger values must be chunked. </summary>
+static const size_t ConfigStoreMaxKvpValueSize = UINT16_MAX - sizeof(ConfigStoreKvpHeader);
+
+/// <summary>
+/// Like ConfigStore_PutUniqueKey, but for values of any size: values larger than
+/// ConfigStoreMaxKvpValueSize are split across the returned KVP and continuation KVPs that follow
+/// it. Use the chunked value functions below to access them; iteration and lookups only see the
+/// returned KVP. Erasing it erases its continuations too.
+/// If <paramref name="optional_data" /> is NULL, the value is left to be written.
+/// </summary>
+/// <returns> Pointer to the first KVP on success; NULL on failure with error indication in errno.
+/// </returns>
+ConfigStoreKvpHeader *ConfigStore_PutUniqueChunkedKey(ConfigStore *p, ConfigStoreKey key,
+                                                      const uint8_t *optional_data,
+                                                      size_t value_size);
+
+/// <summary> Gets the size of a value across its chunks. Works for any KVP. </summary>
+size_t ConfigStore_GetChunkedValueSize(const ConfigStore *p, const ConfigStoreKvpHeader *pos);
+
+/// <summary>
+/// Writes to part of a value across its chunks, in place. Unlike ConfigStore_WriteValue, the rest
+/// of the value is left as is.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (E2BIG if the range is past
+/// the end of the value). </returns>
+int ConfigStore_WriteChunkedValue(ConfigStore *p, ConfigStoreKvpHeader *pos, size_t offset,
+                                  const void *data, size_t size);
+
+/// <summary> Reads part of a value across its chunks, without copying the rest. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (E2BIG if the range is past
+/// the end of the value). </returns>
+int ConfigStore_ReadChunkedValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos,
+                                 size_t offset, void *data, size_t size);
+
+/// <summary>
+/// Puts a value of any size under a unique key, like ConfigStore_PutUniqueChunkedKey, compressing it
+/// when it reaches the compress_threshold of ConfigStoreOptions. Compressed values are described by
+/// a ConfigStoreValueAttributes KVP after their chunks, and must be read with ConfigStore_ReadValue.
+/// </summary>
+/// <returns> Pointer to the first KVP on success; NULL on failure with error indication in errno.
+/// </returns>
+ConfigStoreKvpHeader *ConfigStore_PutValue(ConfigStore *p, ConfigStoreKey key, const uint8_t *data,
+                                           size_t size);
+
+/// <summary>
+/// Gets whether a value is stored as is, so that its chunks hold its bytes: it's neither compressed
+/// by ConfigStore_PutValue nor shared by ConfigStore_PutSharedValue.
+/// </summary>
+bool ConfigStore_IsPlainValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos);
+
+/// <summary> Largest value ConfigStore_PutSharedValue shares. </summary>
+static const size_t ConfigStoreMaxSharedValueSize = UINT16_MAX - sizeof(ConfigStoreSharedValue);
+
+/// <summary>
+/// Puts a value under a unique key, storing it once for all the keys it's put under this way, such
+/// as a certificate used by several network profiles. The KVP of the key is left empty and is
+/// followed by a ConfigStoreValueReference; read it with ConfigStore_ReadValue. Shared values are
+/// reference counted, and freed when the last KVP that references them is erased or replaced; like
+/// an erased KVP, a freed value becomes padding, so the KVPs don't move. Values larger than ConfigStoreMaxSharedValueSize, or whose hash is taken by another shared value,
+/// are put with ConfigStore_PutValue instead.
+/// </summary>
+/// <returns> Pointer to the KVP on success; NULL on failure with error indication in errno. </returns>
+ConfigStoreKvpHeader *ConfigStore_PutSharedValue(ConfigStore *p, ConfigStoreKey key,
+                                                 const uint8_t *data, size_t size);
+
+/// <summary> Gets the size of a value as it was put, that is, once decompressed. </summary>
+size_t ConfigStore_GetValueSize(const ConfigStore *p, const ConfigStoreKvpHeader *pos);
+
+/// <summary>
+/// Reads a whole value, across its chunks, decompressing it if it's compressed or reading the shared
+/// value it references.
+/// <paramref name="size" /> must be at least ConfigStore_GetValueSize.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (E2BIG if the buffer is too
+/// small, EBADMSG if the compressed value is corrupt). </returns>
+int ConfigStore_ReadValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos, void *data,
+                          size_t size);
+
+/// <summary> Position in a value across its chunks. Private to the implementation. </summary>
+typedef struct ConfigStoreValueCursor {
+    const ConfigStoreKvpHeader *_head;
+    const ConfigStoreKvpHeader *_chunk;
+    const ConfigStoreKvpHeader *_end;
+    size_t _chunk_offset;
+} ConfigStoreValueCursor;
+
+/// <summary>
+/// Cursor that reads a value in pieces, across its chunks if it has any. Like pointers to KVPs, it
+/// is invalidated by changes to the store.
+/// </summary>
+typedef struct ConfigStoreValueReader {
+    ConfigStoreValueCursor _cursor;
+} ConfigStoreValueReader;
+
+/// <summary>
+/// Cursor that writes a value in pieces, across its chunks if it has any, leaving the bytes it
+/// doesn't write as they are. Like pointers to KVPs, it is invalidated by changes to the store.
+/// </summary>
+typedef struct ConfigStoreValueWriter {
+    ConfigStoreValueCursor _cursor;
+} ConfigStoreValueWriter;
+
+/// <summary>
+/// Initializes a reader at the beginning of the value of a KVP. The reader reads the bytes stored
+/// in the KVP and its chunks: a value that isn't plain (see ConfigStore_IsPlainValue) reads as its
+/// compressed bytes, or as empty if it's shared.
+/// </summary>
+void ConfigStore_ValueReaderInit(ConfigStoreValueReader *r, const ConfigStore *p,
+                                 const ConfigStoreKvpHeader *pos);
+
+/// <summary> Moves a reader to an offset from the beginning of the value. </summary>
+/// <returns> 0 on success; -1 with errno set to E2BIG if the offset is past the end. </returns>
+int ConfigStore_ValueReaderSeek(ConfigStoreValueReader *r, size_t offset);
+
+/// <summary> Copies bytes from the value and moves the reader past them. </summary>
+/// <returns> The number of bytes read; less than asked at the end of the value. </returns>
+size_t ConfigStore_ValueReaderRead(ConfigStoreValueReader *r, void *data, size_t size);
+
+/// <summary>
+/// Gets the bytes of the value at the reader that are contiguous in the store, without copying
+/// them. Call ConfigStore_ValueReaderAdvance to move past them.
+/// </summary>
+/// <returns> The number of bytes at <paramref name="data" />; 0 at the end of the value. </returns>
+size_t ConfigStore_ValueReaderPeek(ConfigStoreValueReader *r, const uint8_t **data);
+
+/// <summary> Moves a reader forward. </summary>
+/// <returns> The number of bytes moved; less than asked at the end of the value. </returns>
+size_t ConfigStore_ValueReaderAdvance(ConfigStoreValueReader *r, size_t size);
+
+/// <summary> Initializes a writer at the beginning of the value of a KVP. </summary>
+void ConfigStore_ValueWriterInit(ConfigStoreValueWriter *w, ConfigStore *p,
+                                 ConfigStoreKvpHeader *pos);
+
+/// <summary> Moves a writer to an offset from the beginning of the value. </summary>
+/// <returns> 0 on success; -1 with errno set to E2BIG if the offset is past the end. </returns>
+int ConfigStore_ValueWriterSeek(ConfigStoreValueWriter *w, size_t offset);
+
+/// <summary> Copies bytes to the value and moves the writer past them. </summary>
+/// <returns> The number of bytes written; less than asked at the end of the value. </returns>
+size_t ConfigStore_ValueWriterWrite(ConfigStoreValueWriter *w, const void *data, size_t size);
+
+/// <summary>
+/// Gets the bytes of the value at the writer that are contiguous in the store, so they can be
+/// filled directly (for instance by recv). Call ConfigStore_ValueWriterAdvance to move past them.
+/// </summary>
+/// <returns> The number of bytes at <paramref name="data" />; 0 at the end of the value. </returns>
+size_t ConfigStore_ValueWriterPeek(ConfigStoreValueWriter *w, uint8_t **data);
+
+/// <summary> Moves a writer forward. </summary>
+/// <returns> The number of bytes moved; less than asked at the end of the value. </returns>
+size_t ConfigStore_ValueWriterAdvance(ConfigStoreValueWriter *w, size_t size);
+
+/// <summary>
+/// Checks if the contents of a buffer are a valid configuration store file, of any version.
+/// </summary>
 /// <returns> 0 if the contents are invalid; the valid size if the contents are valid. </returns>
 size_t ConfigStore_ValidateFormat(const uint8_t *data, size_t size);
 
+/// <summary>
+/// Validates a configuration store file as it's read, in a single pass: each piece updates the CRC
+/// and the KVP-chain check together, so invalid content is rejected as soon as it's seen (for
+/// instance, a bad file header with the first bytes) rather than once the whole file is in memory.
+/// Private fields; see ConfigStore_ValidatorInit.
+/// </summary>
+typedef struct ConfigStoreValidator {
+    ConfigStoreFileHeader _header;
+    size_t _offset;
+    uint32_t _crc;
+    size_t _skip;
+    uint8_t _field[sizeof(ConfigStoreKvpHeader)];
+    uint8_t _field_size;
+    uint32_t _varint;
+    uint8_t _shift;
+    uint8_t _state;
+    bool _failed;
+} ConfigStoreValidator;
+
+/// <summary> Initializes a validator at the beginning of a file. </summary>
+void ConfigStore_ValidatorInit(ConfigStoreValidator *v);
+
+/// <summary>
+/// Validates the next bytes of a file, of any size. Bytes past the file size given by the file
+/// header are ignored, as by ConfigStore_ValidateFormat.
+/// </summary>
+/// <returns> 0 if the file may still be valid; -1 with errno set to EINVAL once it can't be.
+/// </returns>
+int ConfigStore_ValidatorUpdate(ConfigStoreValidator *v, const void *data, size_t size);
+
+/// <summary> Completes the validation of the bytes given to a validator. </summary>
+/// <returns> 0 if the file is invalid or incomplete; the valid size if the file is valid. </returns>
+size_t ConfigStore_ValidatorFinish(const ConfigStoreValidator *v);
+
+/// <summary>
+/// Same as ConfigStore_ValidateFormat, for large buffers: the CRC is split into chunks hashed on
+/// up to <paramref name="threads" /> threads created for the call and merged by CRC combination,
+/// while the calling thread checks the KVP chain. If threads can't be created, the calling thread
+/// hashes their chunks itself.
+/// </summary>
+/// <returns> 0 if the contents are invalid; the valid size if the contents are valid. </returns>
+size_t ConfigStore_ValidateFormatParallel(const uint8_t *data, size_t size, unsigned threads);
+
+/// <summary>
+/// Bulk import of a stream into an empty store. The stream is a version 0 store file whose KVPs
+/// are sorted by key (duplicate keys allowed), such as ConfigStore_ExportBegin produces. It's
+/// copied into the buffer in a single pass that also checks its CRC and KVP chain, without the
+/// lookups and moves of putting the KVPs one by one. Private fields.
+/// </summary>
+typedef struct ConfigStoreImporter {
+    ConfigStore *_store;
+    ConfigStoreValidator _validator;
+} ConfigStoreImporter;
+
+/// <summary> Starts importing into an open store that holds no KVP. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (ENOTEMPTY if the store
+/// holds KVPs). </returns>
+int ConfigStore_ImportBegin(ConfigStoreImporter *im, ConfigStore *p);
+
+/// <summary> Imports the next bytes of the stream, of any size. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (EINVAL for an invalid or
+/// compact stream, E2BIG if it doesn't fit in the store). On failure the store is left empty.
+/// </returns>
+int ConfigStore_ImportUpdate(ConfigStoreImporter *im, const void *data, size_t size);
+
+/// <summary>
+/// Completes an import once the whole stream was given, and indexes the imported KVPs.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno (EINVAL if the stream was
+/// incomplete, invalid or unsorted). On failure the store is left empty. </returns>
+int ConfigStore_ImportEnd(ConfigStoreImporter *im);
+
+/// <summary>
+/// Zero-copy export of a store as a stream for ConfigStore_ImportBegin: a version 0 file whose
+/// KVPs (each with its continuation and extension KVPs) are sorted by key, without padding.
+/// The stream is handed out as spans of the buffer of the store, which must not change until the
+/// export ends. Private fields.
+/// </summary>
+typedef struct ConfigStoreExporter {
+    const ConfigStore *_store;
+    ConfigStoreFileHeader _header;
+    uint32_t *_offsets;
+    size_t _count;
+    size_t _next;
+} ConfigStoreExporter;
+
+/// <summary>
+/// Starts exporting a store, sorting its KVPs and computing the CRC of the stream.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_ExportBegin(ConfigStoreExporter *ex, const ConfigStore *p);
+
+/// <summary> Gets the next span of the stream, starting with the file header. </summary>
+/// <returns> The size of the span at <paramref name="data" />; 0 at the end of the stream.
+/// </returns>
+size_t ConfigStore_ExportNext(ConfigStoreExporter *ex, const uint8_t **data);
+
+/// <summary> Disposes of the resources of an export. </summary>
+void ConfigStore_ExportEnd(ConfigStoreExporter *ex);
+
 /// <summary> Helper to compute CRC. </summary>
 /// <returns> The CRC value. </returns>
 uint32_t ConfigStore_AddCrc(uint32_t init, const uint8_t *data, size_t size);
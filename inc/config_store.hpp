@@ -0,0 +1,526 @@
+#pragma once
+
+#include <config_store.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <type_traits>
+
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
+/// <summary>
+/// Header-only C++17 wrapper of the configuration store. Everything is inline over the C API and
+/// reports errors the same way (NULL or -1 with errno), so it adds no overhead.
+/// </summary>
+namespace config
+{
+
+#if __cplusplus >= 202002L
+/// <summary> Read-only view of the value of a KVP. </summary>
+using ValueView = std::span<const std::byte>;
+#else
+/// <summary> Read-only view of the value of a KVP; the subset of std::span used by the store. </summary>
+class ValueView
+{
+public:
+    using element_type = const std::byte;
+    using value_type = std::byte;
+    using size_type = std::size_t;
+    using iterator = const std::byte *;
+
+    constexpr ValueView() noexcept = default;
+    constexpr ValueView(const std::byte *data, std::size_t size) noexcept : _data(data), _size(size)
+    {
+    }
+
+    constexpr const std::byte *data() const noexcept { return _data; }
+    constexpr std::size_t size() const noexcept { return _size; }
+    constexpr std::size_t size_bytes() const noexcept { return _size; }
+    constexpr bool empty() const noexcept { return _size == 0; }
+    constexpr iterator begin() const noexcept { return _data; }
+    constexpr iterator end() const noexcept { return _data + _size; }
+    constexpr const std::byte &operator[](std::size_t i) const noexcept { return _data[i]; }
+
+    constexpr ValueView subspan(std::size_t offset, std::size_t count) const noexcept
+    {
+        return ValueView(_data + offset, count);
+    }
+
+private:
+    const std::byte *_data = nullptr;
+    std::size_t _size = 0;
+};
+#endif
+
+/// <summary> Gets the value of a KVP (its first chunk, if the value is chunked). </summary>
+inline ValueView ValueOf(const ConfigStoreKvpHeader *kvp) noexcept
+{
+    return ValueView(reinterpret_cast<const std::byte *>(kvp + 1), kvp->size - sizeof(*kvp));
+}
+
+/// <summary>
+/// Forward iterator over the KVPs of a store, in KVP order. Like pointers to KVPs, it is invalidated
+/// by changes to the store.
+/// </summary>
+class KvpIterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ConfigStoreKvpHeader;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ConfigStoreKvpHeader *;
+    using reference = ConfigStoreKvpHeader &;
+
+    KvpIterator() noexcept = default;
+    KvpIterator(ConfigStoreKvpHeader *pos, ConfigStoreKvpHeader *end) noexcept
+        : _pos(pos), _end(end)
+    {
+    }
+
+    reference operator*() const noexcept { return *_pos; }
+    pointer operator->() const noexcept { return _pos; }
+    pointer get() const noexcept { return _pos; }
+
+    ConfigStoreKey key() const noexcept { return _pos->key; }
+    ValueView value() const noexcept { return ValueOf(_pos); }
+
+    KvpIterator &operator++() noexcept
+    {
+        _pos = ConfigStore_GetNextKvp(_pos, _end);
+        return *this;
+    }
+
+    KvpIterator operator++(int) noexcept
+    {
+        KvpIterator it = *this;
+        ++*this;
+        return it;
+    }
+
+    friend bool operator==(const KvpIterator &a, const KvpIterator &b) noexcept
+    {
+        return a._pos == b._pos;
+    }
+    friend bool operator!=(const KvpIterator &a, const KvpIterator &b) noexcept
+    {
+        return a._pos != b._pos;
+    }
+
+private:
+    ConfigStoreKvpHeader *_pos = nullptr;
+    ConfigStoreKvpHeader *_end = nullptr;
+};
+
+/// <summary>
+/// Forward iterator over the KVPs whose keys are in [first_key, last_key) and a multiple of
+/// key_increment away from first_key, as ConfigStore_GetNextKvpInRange.
+/// </summary>
+class KeyRangeIterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ConfigStoreKvpHeader;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ConfigStoreKvpHeader *;
+    using reference = ConfigStoreKvpHeader &;
+
+    KeyRangeIterator() noexcept = default;
+    KeyRangeIterator(ConfigStore *store, ConfigStoreKvpHeader *pos, ConfigStoreKey first_key,
+                     ConfigStoreKey last_key, ConfigStoreKey key_increment) noexcept
+        : _store(store), _pos(pos), _first_key(first_key), _last_key(last_key),
+          _key_increment(key_increment)
+    {
+    }
+
+    reference operator*() const noexcept { return *_pos; }
+    pointer operator->() const noexcept { return _pos; }
+    pointer get() const noexcept { return _pos; }
+
+    ConfigStoreKey key() const noexcept { return _pos->key; }
+    ValueView value() const noexcept { return ValueOf(_pos); }
+
+    KeyRangeIterator &operator++() noexcept
+    {
+        _pos = ConfigStore_GetNextKvpInRange(_store, _pos, _first_key, _last_key, _key_increment);
+        return *this;
+    }
+
+    KeyRangeIterator operator++(int) noexcept
+    {
+        KeyRangeIterator it = *this;
+        ++*this;
+        return it;
+    }
+
+    friend bool operator==(const KeyRangeIterator &a, const KeyRangeIterator &b) noexcept
+    {
+        return a._pos == b._pos;
+    }
+    friend bool operator!=(const KeyRangeIterator &a, const KeyRangeIterator &b) noexcept
+    {
+        return a._pos != b._pos;
+    }
+
+private:
+    ConfigStore *_store = nullptr;
+    ConfigStoreKvpHeader *_pos = nullptr;
+    ConfigStoreKey _first_key = 0;
+    ConfigStoreKey _last_key = 0;
+    ConfigStoreKey _key_increment = 1;
+};
+
+/// <summary> A pair of iterators, for range-based for loops. </summary>
+template <typename Iterator>
+class IteratorRange
+{
+public:
+    IteratorRange(Iterator first, Iterator last) noexcept : _first(first), _last(last) {}
+
+    Iterator begin() const noexcept { return _first; }
+    Iterator end() const noexcept { return _last; }
+
+private:
+    Iterator _first;
+    Iterator _last;
+};
+
+/// <summary>
+/// Compile-time description of the keys [First, Last) that are a multiple of Stride away from
+/// First, holding values of type T (void if they vary). For instance, a field at offset 3 of
+/// profiles of 16 keys starting at key 0x100 is KeyRange<0x103, 0x200, 16, T>.
+/// </summary>
+template <ConfigStoreKey First, ConfigStoreKey Last, ConfigStoreKey Stride = 1, typename T = void>
+struct KeyRange {
+    static_assert(First < Last, "key ranges can't be empty");
+    static_assert(Last <= ConfigStoreMaxKey + 1, "key ranges can't include reserved keys");
+    static_assert(Stride >= 1, "key ranges need a positive stride");
+    static_assert(std::is_void_v<T> || std::is_trivially_copyable_v<T>,
+                  "values are copied as bytes");
+
+    using value_type = T;
+
+    static constexpr ConfigStoreKey first = First;
+    static constexpr ConfigStoreKey last = Last;
+    static constexpr ConfigStoreKey stride = Stride;
+    static constexpr size_t count = (Last - First + Stride - 1) / Stride;
+
+    static constexpr bool contains(ConfigStoreKey key) noexcept
+    {
+        return (key >= First) && (key < Last) && ((key - First) % Stride == 0);
+    }
+
+    /// <summary> Gets the key of the i-th element of the range. </summary>
+    static constexpr ConfigStoreKey key(size_t i) noexcept
+    {
+        return static_cast<ConfigStoreKey>(First + i * Stride);
+    }
+};
+
+/// <summary> Checks whether two key ranges have a key in common. </summary>
+template <typename A, typename B>
+constexpr bool RangesOverlap() noexcept
+{
+    size_t lo = (A::first > B::first) ? A::first : B::first;
+    size_t hi = (A::last < B::last) ? A::last : B::last;
+    if (lo >= hi) {
+        return false;
+    }
+
+    // Keys of A from lo on; whether one of them is in B repeats every B::stride keys of A.
+    size_t key = A::first + (lo - A::first + A::stride - 1) / A::stride * A::stride;
+    for (size_t i = 0; (i < B::stride) && (key < hi); ++i, key += A::stride) {
+        if ((key - B::first) % B::stride == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+template <typename A, typename... Others>
+constexpr bool AnyRangesOverlap() noexcept
+{
+    if constexpr (sizeof...(Others) == 0) {
+        return false;
+    } else {
+        return (RangesOverlap<A, Others>() || ...) || AnyRangesOverlap<Others...>();
+    }
+}
+
+/// <summary>
+/// Set of key ranges that make up the layout of a store. Rejects ranges that overlap at compile
+/// time.
+/// </summary>
+template <typename... Ranges>
+struct Schema {
+    static_assert(!AnyRangesOverlap<Ranges...>(), "the key ranges of a schema must not overlap");
+
+    static constexpr bool contains(ConfigStoreKey key) noexcept
+    {
+        return (Ranges::contains(key) || ...);
+    }
+};
+
+/// <summary>
+/// Forward iterator over the KVPs of a KeyRange. It scans the keys of the store index with the
+/// range known at compile time, so testing a key is a couple of compares and a modulo by a
+/// constant, and advancing doesn't need to look up the current KVP again.
+/// </summary>
+template <typename Range>
+class RangeIterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = ConfigStoreKvpHeader;
+    using difference_type = std::ptrdiff_t;
+    using pointer = ConfigStoreKvpHeader *;
+    using reference = ConfigStoreKvpHeader &;
+
+    RangeIterator() noexcept = default;
+    RangeIterator(const ConfigStore *store, size_t i) noexcept : _store(store), _i(i)
+    {
+        _count = ConfigStore_GetIndexedKeys(store, &_keys);
+        Skip();
+    }
+
+    reference operator*() const noexcept { return *get(); }
+    pointer operator->() const noexcept { return get(); }
+    pointer get() const noexcept { return ConfigStore_GetIndexedKvp(_store, _i); }
+
+    ConfigStoreKey key() const noexcept { return _keys[_i]; }
+    ValueView value() const noexcept { return ValueOf(get()); }
+
+    /// <summary> Gets the index of the KVP in the range. </summary>
+    size_t index() const noexcept { return (_keys[_i] - Range::first) / Range::stride; }
+
+    RangeIterator &operator++() noexcept
+    {
+        ++_i;
+        Skip();
+        return *this;
+    }
+
+    RangeIterator operator++(int) noexcept
+    {
+        RangeIterator it = *this;
+        ++*this;
+        return it;
+    }
+
+    friend bool operator==(const RangeIterator &a, const RangeIterator &b) noexcept
+    {
+        return a._i == b._i;
+    }
+    friend bool operator!=(const RangeIterator &a, const RangeIterator &b) noexcept
+    {
+        return a._i != b._i;
+    }
+
+private:
+    void Skip() noexcept
+    {
+        while ((_i < _count) && !Range::contains(_keys[_i])) {
+            ++_i;
+        }
+    }
+
+    const ConfigStore *_store = nullptr;
+    const ConfigStoreKey *_keys = nullptr;
+    size_t _i = 0;
+    size_t _count = 0;
+};
+
+/// <summary> Move-only owner of a ConfigStore, which it closes on destruction. </summary>
+class Store
+{
+public:
+    Store() noexcept { ConfigStore_Init(&_store); }
+    ~Store() { ConfigStore_Close(&_store); }
+
+    Store(const Store &) = delete;
+    Store &operator=(const Store &) = delete;
+
+    Store(Store &&other) noexcept
+    {
+        ConfigStore_Init(&_store);
+        ConfigStore_Move(&_store, &other._store);
+    }
+
+    Store &operator=(Store &&other) noexcept
+    {
+        ConfigStore_Move(&_store, &other._store);
+        return *this;
+    }
+
+    /// <summary> Gets the underlying store, for the parts of the C API not wrapped here. </summary>
+    ConfigStore *native() noexcept { return &_store; }
+    const ConfigStore *native() const noexcept { return &_store; }
+
+    void set_options(const ConfigStoreOptions &options) noexcept
+    {
+        ConfigStore_SetOptions(&_store, &options);
+    }
+
+    /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+    int open(const char *base_filepath, size_t max_size, int flags,
+             ConfigStoreReplicaType rtype) noexcept
+    {
+        return ConfigStore_Open(&_store, base_filepath, max_size, flags, rtype);
+    }
+
+    /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+    int commit() noexcept { return ConfigStore_Commit(&_store); }
+
+    /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+    int flush() noexcept { return ConfigStore_Flush(&_store); }
+
+    void close() noexcept { ConfigStore_Close(&_store); }
+
+    KvpIterator begin() const noexcept
+    {
+        return KvpIterator(ConfigStore_BeginKvp(&_store), ConfigStore_EndKvp(&_store));
+    }
+
+    KvpIterator end() const noexcept
+    {
+        return KvpIterator(ConfigStore_EndKvp(&_store), ConfigStore_EndKvp(&_store));
+    }
+
+    /// <summary> Finds the first KVP of a key. </summary>
+    /// <returns> An iterator to the KVP; or end() if there is none. </returns>
+    KvpIterator find(ConfigStoreKey key) const noexcept
+    {
+        ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&_store, key);
+        ConfigStoreKvpHeader *kvp_end = ConfigStore_EndKvp(&_store);
+        return KvpIterator(kvp ? kvp : kvp_end, kvp_end);
+    }
+
+    bool contains(ConfigStoreKey key) const noexcept
+    {
+        return ConfigStore_TryGetKey(&_store, key) != nullptr;
+    }
+
+    /// <summary> Iterates the KVPs of a key range; see ConfigStore_GetNextKvpInRange. </summary>
+    IteratorRange<KeyRangeIterator> range(ConfigStoreKey first_key, ConfigStoreKey last_key,
+                                          ConfigStoreKey key_increment = 1) noexcept
+    {
+        ConfigStoreKvpHeader *first =
+            ConfigStore_GetNextKvpInRange(&_store, nullptr, first_key, last_key, key_increment);
+        return IteratorRange<KeyRangeIterator>(
+            KeyRangeIterator(&_store, first, first_key, last_key, key_increment),
+            KeyRangeIterator(&_store, ConfigStore_EndKvp(&_store), first_key, last_key,
+                             key_increment));
+    }
+
+    /// <summary> Iterates the KVPs of a KeyRange. </summary>
+    template <typename Range>
+    IteratorRange<RangeIterator<Range>> range() const noexcept
+    {
+        const ConfigStoreKey *keys;
+        size_t count = ConfigStore_GetIndexedKeys(&_store, &keys);
+        return IteratorRange<RangeIterator<Range>>(RangeIterator<Range>(&_store, 0),
+                                                   RangeIterator<Range>(&_store, count));
+    }
+
+    /// <summary> Gets the value of the i-th element of a KeyRange. </summary>
+    /// <returns> The value; nullopt if it's not found or <paramref name="i" /> is out of range. </returns>
+    template <typename Range>
+    std::optional<typename Range::value_type> get_at(size_t i) const noexcept
+    {
+        static_assert(!std::is_void_v<typename Range::value_type>, "the range has no value type");
+        if (i >= Range::count) {
+            return std::nullopt;
+        }
+        return get<typename Range::value_type>(Range::key(i));
+    }
+
+    /// <summary> Puts the value of the i-th element of a KeyRange. </summary>
+    /// <returns>
+    /// The KVP on success; NULL on failure with error indication in errno, which is ERANGE if
+    /// <paramref name="i" /> is out of range.
+    /// </returns>
+    template <typename Range>
+    ConfigStoreKvpHeader *put_at(size_t i, const typename Range::value_type &value) noexcept
+    {
+        if (i >= Range::count) {
+            errno = ERANGE;
+            return nullptr;
+        }
+        return put(Range::key(i), value);
+    }
+
+    /// <summary> Allocates a KVP with an unused key of a KeyRange; see ConfigStore_AllocUniqueKvp. </summary>
+    template <typename Range>
+    ConfigStoreKvpHeader *alloc(size_t value_size = sizeof(typename Range::value_type)) noexcept
+    {
+        return ConfigStore_AllocUniqueKvp(&_store, Range::first, Range::last, value_size,
+                                          Range::stride);
+    }
+
+    /// <summary> Erases the KVPs of a KeyRange. </summary>
+    /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+    template <typename Range>
+    int erase_range() noexcept
+    {
+        return erase_range(Range::first, Range::last, Range::stride);
+    }
+
+    /// <summary> Gets a value of a trivially copyable type. </summary>
+    /// <returns> The value; or nothing if the key is missing or its value has another size. </returns>
+    template <typename T>
+    std::optional<T> get(ConfigStoreKey key) const noexcept
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "values are copied as bytes");
+
+        const ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&_store, key);
+        if ((kvp == nullptr) || (kvp->size != sizeof(*kvp) + sizeof(T))) {
+            return std::nullopt;
+        }
+
+        T value;
+        std::memcpy(&value, kvp + 1, sizeof(T));
+        return value;
+    }
+
+    /// <summary> Puts a value of a trivially copyable type under a unique key. </summary>
+    /// <returns> The KVP on success; NULL on failure with error indication in errno. </returns>
+    template <typename T>
+    ConfigStoreKvpHeader *put(ConfigStoreKey key, const T &value) noexcept
+    {
+        static_assert(std::is_trivially_copyable_v<T>, "values are copied as bytes");
+
+        return ConfigStore_PutUniqueKey(&_store, key, reinterpret_cast<const uint8_t *>(&value),
+                                        sizeof(T));
+    }
+
+    /// <summary> Puts raw bytes under a unique key. </summary>
+    /// <returns> The KVP on success; NULL on failure with error indication in errno. </returns>
+    ConfigStoreKvpHeader *put_bytes(ConfigStoreKey key, ValueView value) noexcept
+    {
+        return ConfigStore_PutUniqueKey(
+            &_store, key, reinterpret_cast<const uint8_t *>(value.data()), value.size());
+    }
+
+    /// <summary> Erases a KVP. </summary>
+    /// <returns> An iterator to the KVP after it. </returns>
+    KvpIterator erase(KvpIterator pos) noexcept
+    {
+        return KvpIterator(ConfigStore_EraseKvp(&_store, pos.get()), ConfigStore_EndKvp(&_store));
+    }
+
+    /// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+    int erase_range(ConfigStoreKey first_key, ConfigStoreKey last_key,
+                    ConfigStoreKey key_increment = 1) noexcept
+    {
+        return ConfigStore_EraseKeysInRange(&_store, first_key, last_key, key_increment);
+    }
+
+private:
+    ConfigStore _store;
+};
+
+} // namespace config
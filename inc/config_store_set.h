@@ -0,0 +1,75 @@
+#pragma once
+
+#include <config_store.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/// <summary> Longest namespace name of a ConfigStoreSet. </summary>
+#define CONFIG_STORE_MAX_NAMESPACE_LENGTH 64
+
+/// <summary> A namespace of a ConfigStoreSet and its store. Private to the implementation. </summary>
+struct ConfigStoreNamespace;
+
+/// <summary>
+/// Set of stores keyed by namespace (for example "global", "networks", "credentials"), each
+/// backed by its own file and lock, named after the base path of the set and the namespace
+/// ("base.networks"). Namespaces are opened on first access, so reading one doesn't read, CRC or
+/// lock the others, and commits only write the namespaces that changed.
+/// </summary>
+typedef struct ConfigStoreSet {
+    char *_base_path;
+    size_t _max_size;
+    int _flags;
+    ConfigStoreReplicaType _replica_type;
+    ConfigStoreOptions _options;
+    struct ConfigStoreNamespace **_namespaces;
+    size_t _count;
+    size_t _capacity;
+} ConfigStoreSet;
+
+/// <summary> Initializes the memory of a ConfigStoreSet for usage. </summary>
+void ConfigStore_StoreSetInit(ConfigStoreSet *s);
+
+/// <summary>
+/// Sets the options of the stores of the namespaces. Like ConfigStore_SetOptions, set them before
+/// ConfigStore_StoreSetOpen. A shared_view_name is the base of the names of the shared memory
+/// objects of the namespaces, like the base path is of their files ("/base.networks").
+/// </summary>
+void ConfigStore_StoreSetSetOptions(ConfigStoreSet *s, const ConfigStoreOptions *options);
+
+/// <summary>
+/// Opens a set of stores. No file is opened until a namespace is accessed; the arguments apply to
+/// the store of each namespace, as in ConfigStore_Open.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+int ConfigStore_StoreSetOpen(ConfigStoreSet *s, const char *base_filepath, size_t max_size,
+                             int flags, ConfigStoreReplicaType rtype);
+
+/// <summary>
+/// Gets the store of a namespace, opening it on first access, or again after a commit in
+/// ConfigStoreReplica_Swap mode closed it. The store is owned by the set.
+/// </summary>
+/// <param name="name"> The namespace: up to CONFIG_STORE_MAX_NAMESPACE_LENGTH letters, digits, '_'
+/// and '-'. </param>
+/// <returns> The store on success; NULL on failure with error indication in errno. </returns>
+ConfigStore *ConfigStore_StoreSetGet(ConfigStoreSet *s, const char *name);
+
+/// <summary> Gets whether the store of a namespace is open, without opening it. </summary>
+bool ConfigStore_StoreSetIsLoaded(const ConfigStoreSet *s, const char *name);
+
+/// <summary>
+/// Commits the open namespaces. Namespaces that were never accessed aren't touched, and those
+/// whose content didn't change are skipped by ConfigStore_Commit.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno, after attempting to
+/// commit every namespace. </returns>
+int ConfigStore_StoreSetCommit(ConfigStoreSet *s);
+
+/// <summary> Closes the stores of the set and disposes of any allocated resources. </summary>
+void ConfigStore_StoreSetClose(ConfigStoreSet *s);
+
+#ifdef __cplusplus
+}
+#endif
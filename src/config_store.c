@@ -3,10 +3,13 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
@@ -14,6 +17,142 @@
 #include <unistd.h>
 #include <dirent.h>
 #include <string.h>
+#include <sched.h>
+#include <time.h>
+
+#if defined(__has_include) && !defined(CONFIG_STORE_NO_USDT)
+#if __has_include(<sys/sdt.h>)
+// Semaphores let the probes tell whether a tracer is attached to them.
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define CONFIG_STORE_HAS_USDT 1
+#endif
+#endif
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef CONFIG_STORE_ENABLE_STATS
+#define STATS_ADD(p, field, n) ((p)->_stats.field += (n))
+#define STATS_NOW() Impl_NowNs()
+#define STATS_LATENCY(p, field, start) Impl_AddLatency((p)->_stats.field, start)
+// Lookups run on const stores, possibly concurrently, so they count their hops in the key index
+// with relaxed atomics; see ConfigStore_GetStats.
+#define STATS_ADD_HOPS(p, n) __atomic_add_fetch(&(p)->_index->lookup_hops, (n), __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(p, field, n) ((void)0)
+#define STATS_NOW() 0
+#define STATS_LATENCY(p, field, start) ((void)0)
+#define STATS_ADD_HOPS(p, n) ((void)0)
+#endif
+
+// Traces an event that started at trace_start (from TRACE_START) to the USDT probe and the
+// registered tracer.
+#ifdef CONFIG_STORE_HAS_USDT
+// Semaphores of the probes, which tools like perf and bpftrace increment while attached.
+#define DEFINE_PROBE_SEMAPHORE(probe)                                                              \
+    unsigned short azscfgsto_##probe##_semaphore __attribute__((unused, section(".probes")))
+DEFINE_PROBE_SEMAPHORE(open_read);
+DEFINE_PROBE_SEMAPHORE(validate);
+DEFINE_PROBE_SEMAPHORE(commit_crc);
+DEFINE_PROBE_SEMAPHORE(write);
+DEFINE_PROBE_SEMAPHORE(truncate);
+DEFINE_PROBE_SEMAPHORE(fsync);
+DEFINE_PROBE_SEMAPHORE(rename);
+DEFINE_PROBE_SEMAPHORE(realloc);
+
+// Gets the start time of an event of a probe; see Impl_TraceStart.
+#define TRACE_START(probe)                                                                         \
+    Impl_TraceStart(__atomic_load_n(&azscfgsto_##probe##_semaphore, __ATOMIC_RELAXED) != 0)
+#define TRACE(probe, event, size, trace_start)                                                     \
+    do {                                                                                           \
+        uint64_t trace_ns_ = Impl_TraceElapsed(trace_start);                                       \
+        DTRACE_PROBE2(azscfgsto, probe, (size_t)(size), trace_ns_);                                \
+        Impl_TraceCallback(event, size, trace_ns_);                                                \
+    } while (0)
+#else
+#define TRACE_START(probe) Impl_TraceStart(false)
+#define TRACE(probe, event, size, trace_start)                                                     \
+    Impl_TraceCallback(event, size, Impl_TraceElapsed(trace_start))
+#endif
+
+/// <summary> Number of bits in the Bloom filter of the key index. </summary>
+#define CONFIG_STORE_BLOOM_BITS 2048
+
+/// <summary>
+/// Erases compact the buffer once the padding reaches this many bytes and a quarter of the buffer.
+/// Below that, holes are cheaper to keep around until the next commit.
+/// </summary>
+#define CONFIG_STORE_COMPACT_MIN_PADDING 1024
+
+/// <summary>
+/// Structure-of-arrays view of the KVP chain. keys[i] is the key of the i-th KVP (in chain order)
+/// and offsets[i] is the offset of that KVP from the beginning of the buffer.
+/// </summary>
+struct ConfigStoreKeyIndex {
+    size_t count;
+    size_t capacity;
+    ConfigStoreKey *keys;
+    uint32_t *offsets;
+
+    // Bloom filter of the keys. Only the mutating paths change it, so const lookups can run
+    // concurrently; the counters are updated with relaxed atomics for the same reason.
+    uint64_t bloom[CONFIG_STORE_BLOOM_BITS / 64];
+    ConfigStoreLookupFilterStats bloom_stats;
+    uint64_t lookup_hops;
+};
+
+/// <summary>
+/// Copy of a committed buffer. The store holds one reference to the published snapshot and each
+/// reader holds one more.
+/// </summary>
+struct ConfigStoreSnapshot {
+    unsigned refs;
+    size_t size;
+    uint8_t data[];
+};
+
+/// <summary> Granularity of the undo log: changes save whole pages of the buffer. </summary>
+#define CONFIG_STORE_UNDO_PAGE_SIZE 128
+
+/// <summary> Bytes of a page of the buffer as they were before a savepoint changed them. </summary>
+struct ConfigStoreUndoEntry {
+    size_t offset;
+    size_t size;
+    uint8_t data[CONFIG_STORE_UNDO_PAGE_SIZE];
+};
+
+/// <summary>
+/// Open savepoint. Its changes are undone by the entries of the log from log_start on. Bytes from
+/// save_limit on needn't be saved: rolling back this savepoint or any enclosing one drops them.
+/// </summary>
+struct ConfigStoreUndoLevel {
+    unsigned id;
+    size_t log_start;
+    size_t end_size;
+    size_t save_limit;
+    size_t padding_size;
+};
+
+/// <summary>
+/// Undo log of the open savepoints. marks[page] is the id of the savepoint that last saved the
+/// page, so a savepoint saves each page once however many times it changes it.
+/// </summary>
+struct ConfigStoreUndoLog {
+    struct ConfigStoreUndoEntry *entries;
+    size_t count;
+    size_t capacity;
+    struct ConfigStoreUndoLevel *levels;
+    size_t depth;
+    size_t level_capacity;
+    unsigned *marks;
+    size_t page_count;
+    unsigned next_id;
+    bool failed;
+};
 
 static char *AppendString(const char *front, const char *back)
 {
@@ -29,6 +168,125 @@ static char *AppendString(const char *front, const char *back)
     return dst;
 }
 
+static uint64_t Impl_NowNs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+#ifdef CONFIG_STORE_ENABLE_STATS
+static void Impl_AddLatency(uint64_t *histogram, uint64_t start_ns)
+{
+    uint64_t us = (Impl_NowNs() - start_ns) / 1000;
+    size_t bucket = (us > 1) ? (63 - __builtin_clzll(us)) : 0;
+    if (bucket >= CONFIG_STORE_LATENCY_BUCKETS) {
+        bucket = CONFIG_STORE_LATENCY_BUCKETS - 1;
+    }
+    ++histogram[bucket];
+}
+#endif
+
+/// <summary>
+/// A tracer registered with ConfigStore_SetTracer, published through a single pointer so that a
+/// callback is never called with the context of another registration. Registrations are never
+/// freed, since tracing threads may still be using them; registering a pair again reuses it.
+/// </summary>
+struct ConfigStoreTracer {
+    ConfigStoreTraceCallback callback;
+    void *context;
+    struct ConfigStoreTracer *next;
+};
+
+static struct ConfigStoreTracer *s_tracer;
+static struct ConfigStoreTracer *s_tracers;
+static pthread_mutex_t s_tracers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void ConfigStore_SetTracer(ConfigStoreTraceCallback callback, void *context)
+{
+    struct ConfigStoreTracer *tracer = NULL;
+    if (callback != NULL) {
+        pthread_mutex_lock(&s_tracers_lock);
+        for (tracer = s_tracers; tracer != NULL; tracer = tracer->next) {
+            if ((tracer->callback == callback) && (tracer->context == context)) {
+                break;
+            }
+        }
+        if (tracer == NULL) {
+            tracer = malloc(sizeof(*tracer));
+            if (tracer != NULL) {
+                tracer->callback = callback;
+                tracer->context = context;
+                tracer->next = s_tracers;
+                s_tracers = tracer;
+            }
+        }
+        pthread_mutex_unlock(&s_tracers_lock);
+    }
+
+    __atomic_store_n(&s_tracer, tracer, __ATOMIC_RELEASE);
+}
+
+/// <summary> Gets the start time of a traced event, or 0 if nothing traces it. </summary>
+/// <param name="probed"> Whether a tool is attached to the USDT probe of the event. </param>
+static uint64_t Impl_TraceStart(bool probed)
+{
+    return (probed || __atomic_load_n(&s_tracer, __ATOMIC_RELAXED)) ? Impl_NowNs() : 0;
+}
+
+static uint64_t Impl_TraceElapsed(uint64_t trace_start)
+{
+    return trace_start ? (Impl_NowNs() - trace_start) : 0;
+}
+
+static void Impl_TraceCallback(ConfigStoreTraceEvent event, size_t size, uint64_t duration_ns)
+{
+    const struct ConfigStoreTracer *tracer = __atomic_load_n(&s_tracer, __ATOMIC_ACQUIRE);
+    if (tracer != NULL) {
+        tracer->callback(tracer->context, event, size, duration_ns);
+    }
+}
+
+/// <summary> Calls fsync and accounts for it in the stats and the trace of the store. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_Fsync(ConfigStore *p, int fd, size_t size)
+{
+    uint64_t start = STATS_NOW();
+    uint64_t trace_start = TRACE_START(fsync);
+    int res = fsync(fd);
+    TRACE(fsync, ConfigStoreTrace_Fsync, size, trace_start);
+    STATS_ADD(p, fsyncs, 1);
+    STATS_ADD(p, fsync_ns, STATS_NOW() - start);
+    (void)p;
+    (void)start;
+    return res;
+}
+
+/// <summary>
+/// Calls fsync on the directory of a file, so that creating, renaming or removing the file is
+/// durable, and accounts for it as Impl_Fsync does.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_FsyncDirectory(ConfigStore *p, const char *file_path)
+{
+    char *path_copy = strdup(file_path);
+    if (path_copy == NULL) {
+        return -1;
+    }
+
+    int fd = open(dirname(path_copy), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(path_copy);
+    if (fd < 0) {
+        return -1;
+    }
+
+    int res = Impl_Fsync(p, fd, 0);
+    int error = errno;
+    close(fd);
+    errno = error;
+    return res;
+}
+
 static size_t GetDistance(const ConfigStoreKvpHeader *p, const ConfigStoreKvpHeader *pEnd)
 {
     return (ptrdiff_t)pEnd - (ptrdiff_t)p;
@@ -55,8 +313,9 @@ bool ConfigStore_CanDereferenceKvp(const ConfigStoreKvpHeader *p, const ConfigSt
     return ret;
 }
 
-ConfigStoreKvpHeader *ConfigStore_GetNextKvp(const ConfigStoreKvpHeader *p,
-                                             const ConfigStoreKvpHeader *pEnd)
+/// <summary> Like ConfigStore_GetNextKvp, but doesn't skip padding. </summary>
+static ConfigStoreKvpHeader *Impl_GetNextRawKvp(const ConfigStoreKvpHeader *p,
+                                                const ConfigStoreKvpHeader *pEnd)
 {
     size_t dist;
     if (!p) {
@@ -75,6 +334,47 @@ ConfigStoreKvpHeader *ConfigStore_GetNextKvp(const ConfigStoreKvpHeader *p,
     return retval;
 }
 
+/// <summary>
+/// Gets whether a KVP trails the KVP of a value: a continuation or an extension. They make up a run
+/// with the value that is moved and erased as a whole.
+/// </summary>
+static bool Impl_IsTrailerKey(ConfigStoreKey key)
+{
+    return (key == ConfigStoreContinuationKey) || (key == ConfigStoreExtensionKey);
+}
+
+/// <summary> Gets whether a KVP is padding or a trailer, which iteration skips. </summary>
+static bool Impl_IsHiddenKey(ConfigStoreKey key)
+{
+    return (key == ConfigStorePaddingKey) || Impl_IsTrailerKey(key);
+}
+
+/// <summary> Skips the padding and continuation KVPs starting at a given position, if any. </summary>
+static ConfigStoreKvpHeader *Impl_SkipHidden(const ConfigStoreKvpHeader *p,
+                                             const ConfigStoreKvpHeader *pEnd)
+{
+    while ((p != pEnd) && Impl_IsHiddenKey(p->key)) {
+        p = Impl_GetNextRawKvp(p, pEnd);
+    }
+    return (ConfigStoreKvpHeader *)p;
+}
+
+/// <summary> Skips the trailer KVPs starting at a given position, if any. </summary>
+static ConfigStoreKvpHeader *Impl_SkipTrailers(const ConfigStoreKvpHeader *p,
+                                               const ConfigStoreKvpHeader *pEnd)
+{
+    while ((p != pEnd) && Impl_IsTrailerKey(p->key)) {
+        p = Impl_GetNextRawKvp(p, pEnd);
+    }
+    return (ConfigStoreKvpHeader *)p;
+}
+
+ConfigStoreKvpHeader *ConfigStore_GetNextKvp(const ConfigStoreKvpHeader *p,
+                                             const ConfigStoreKvpHeader *pEnd)
+{
+    return Impl_SkipHidden(Impl_GetNextRawKvp(p, pEnd), pEnd);
+}
+
 uint32_t ConfigStore_AddCrc(uint32_t init, const uint8_t *data, size_t size)
 {
     uint32_t crc = init;
@@ -140,566 +440,3966 @@ void ConfigStore_DeleteAllTempFiles(const char *dirPath)
     free(directoryPath);
 }
 
-void ConfigStore_Close(ConfigStore *p)
+static void Impl_IndexFree(struct ConfigStoreKeyIndex *index)
 {
-    if (p->_fd >= 0) {
-        close(p->_fd);
+    if (index != NULL) {
+        free(index->keys);
+        free(index->offsets);
+        free(index);
     }
-    free(p->_primary_path);
-    free(p->_replica_path);
-    free(p->_begin);
-    ConfigStore_Init(p);
 }
 
-void ConfigStore_Move(ConfigStore *pDst, ConfigStore *pSrc)
+static void Impl_UndoFree(struct ConfigStoreUndoLog *log)
 {
-    if (pDst != pSrc) {
-        ConfigStore_Close(pDst);
-        memcpy(pDst, pSrc, sizeof(*pDst));
-        ConfigStore_Init(pSrc);
+    if (log != NULL) {
+        free(log->entries);
+        free(log->levels);
+        free(log->marks);
+        free(log);
     }
 }
 
-int ConfigStore_ReserveCapacity(ConfigStore *p, size_t capacity)
+/// <summary>
+/// Saves the pages of a range of the buffer that the innermost savepoint didn't save yet, before
+/// the store changes them. Does nothing if no savepoint is open.
+/// </summary>
+static void Impl_UndoTouch(ConfigStore *p, size_t offset, size_t size)
 {
-    if (capacity > p->_max_size) {
-        // Can't grow the file beyond max size.
-        errno = E2BIG;
-        return -1;
+    struct ConfigStoreUndoLog *log = p->_undo;
+    if ((log == NULL) || (log->depth == 0) || log->failed) {
+        return;
     }
 
-    size_t current_capacity = p->_capacity - p->_begin;
+    const struct ConfigStoreUndoLevel *level = &log->levels[log->depth - 1];
+    if (offset >= level->save_limit) {
+        return;
+    }
+    size_t last = (size < level->save_limit - offset) ? (offset + size) : level->save_limit;
 
-    if (capacity > current_capacity) {
-        uint8_t *new_begin = realloc(p->_begin, capacity);
-        if (new_begin == NULL) {
-            return -1;
+    for (size_t page = offset / CONFIG_STORE_UNDO_PAGE_SIZE;
+         page * CONFIG_STORE_UNDO_PAGE_SIZE < last; ++page) {
+        if (log->marks[page] == level->id) {
+            continue;
         }
 
-        p->_capacity = &new_begin[capacity];
-        p->_end = &new_begin[p->_end - p->_begin];
-        p->_begin = new_begin;
-    }
+        if (log->count == log->capacity) {
+            size_t capacity = log->capacity ? (log->capacity * 2) : 16;
+            struct ConfigStoreUndoEntry *entries =
+                realloc(log->entries, capacity * sizeof(*entries));
+            if (entries == NULL) {
+                // The changes can't be undone anymore; see ConfigStore_RollbackTo.
+                log->failed = true;
+                return;
+            }
+            log->entries = entries;
+            log->capacity = capacity;
+        }
 
-    return 0;
+        struct ConfigStoreUndoEntry *entry = &log->entries[log->count++];
+        entry->offset = page * CONFIG_STORE_UNDO_PAGE_SIZE;
+        entry->size = level->save_limit - entry->offset;
+        if (entry->size > CONFIG_STORE_UNDO_PAGE_SIZE) {
+            entry->size = CONFIG_STORE_UNDO_PAGE_SIZE;
+        }
+        memcpy(entry->data, &p->_begin[entry->offset], entry->size);
+        log->marks[page] = level->id;
+    }
 }
 
-static bool ConfigStore_InvariantsCheck(const ConfigStore *p)
+/// <summary> Closes the savepoints nested deeper than <paramref name="depth" />. </summary>
+static void Impl_UndoPop(struct ConfigStoreUndoLog *log, size_t depth)
 {
-    bool ok = (p) && (p->_fd >= 0) && (p->_begin + sizeof(ConfigStoreFileHeader) <= p->_end) &&
-              (p->_end <= p->_capacity);
-    return ok;
+    log->depth = depth;
+    if (depth == 0) {
+        // Marks of old savepoints never match the ids of new ones, so they can stay.
+        log->count = 0;
+        log->failed = false;
+    }
 }
 
-static bool ReplicaTypeIsValid(ConfigStoreReplicaType rtype)
+/// <summary> Copies the buffer of the store into a new snapshot with a single reference. </summary>
+/// <returns> The snapshot on success; NULL on failure with error indication in errno. </returns>
+static ConfigStoreSnapshot *Impl_NewSnapshot(const ConfigStore *p)
 {
-    switch (rtype) {
-    case ConfigStoreReplica_None ... ConfigStoreReplica_Swap:
-        return true;
-    default:
-        return false;
+    size_t size = p->_end - p->_begin;
+    ConfigStoreSnapshot *s = malloc(sizeof(*s) + size);
+    if (s != NULL) {
+        s->refs = 1;
+        s->size = size;
+        memcpy(s->data, p->_begin, size);
     }
+    return s;
 }
 
-static int Impl_Open(ConfigStore *p, const char *base_filepath, size_t max_size, int flags,
-                     ConfigStoreReplicaType rtype)
+/// <summary>
+/// The published snapshot of a store is tagged, in the bits above the pointer, with the number of
+/// readers in the middle of acquiring it, so that the pointer and the tag change atomically.
+/// </summary>
+#define CONFIG_STORE_SNAPSHOT_ACQUIRER ((uint64_t)1 << 48)
+
+static ConfigStoreSnapshot *Impl_SnapshotPointer(uint64_t tagged)
 {
-    if (!ReplicaTypeIsValid(rtype)) {
-        errno = EINVAL;
-        return -1;
-    }
+    return (ConfigStoreSnapshot *)(uintptr_t)(tagged & (CONFIG_STORE_SNAPSHOT_ACQUIRER - 1));
+}
 
-    p->_replica_type = rtype;
-    p->_max_size = max_size;
+/// <summary>
+/// Publishes a new snapshot (which may be NULL) and returns the previous one. Never waits for
+/// readers: those still acquiring the previous snapshot get the references they were counted for
+/// in its tag. The caller owns the store's reference to the result.
+/// </summary>
+static ConfigStoreSnapshot *Impl_SwapSnapshot(ConfigStore *p, ConfigStoreSnapshot *s)
+{
+    uint64_t old = __atomic_exchange_n(&p->_snapshot, (uint64_t)(uintptr_t)s, __ATOMIC_ACQ_REL);
 
-    p->_primary_path = strdup(base_filepath);
-    if (p->_primary_path == NULL) {
-        return -1;
+    ConfigStoreSnapshot *old_s = Impl_SnapshotPointer(old);
+    if (old_s != NULL) {
+        unsigned acquirers = (unsigned)(old / CONFIG_STORE_SNAPSHOT_ACQUIRER);
+        __atomic_add_fetch(&old_s->refs, acquirers, __ATOMIC_RELAXED);
     }
+    return old_s;
+}
 
-    if (p->_replica_type == ConfigStoreReplica_Swap) {
-        p->_replica_path = AppendString(base_filepath, ".tmp");
-        if (p->_replica_path == NULL) {
-            return -1;
-        }
-
-        // For swap mode, remove the swap file preemptively, even for readers.
-        // If the swap exists on open, that means it's a leftover from a previous run that
-        // crashed/exited before swaping it with the primary file.
-        remove(p->_replica_path);
+ConfigStoreSnapshot *ConfigStore_Snapshot(ConfigStore *p)
+{
+    // The tag keeps the snapshot alive until the reader holds a reference of its own.
+    uint64_t tagged =
+        __atomic_add_fetch(&p->_snapshot, CONFIG_STORE_SNAPSHOT_ACQUIRER, __ATOMIC_ACQUIRE);
+    ConfigStoreSnapshot *s = Impl_SnapshotPointer(tagged);
+    if (s != NULL) {
+        __atomic_add_fetch(&s->refs, 1, __ATOMIC_RELAXED);
     }
 
-    flags |= O_CLOEXEC;
-
-    p->_fd = open(p->_primary_path, flags, S_IRUSR | S_IWUSR);
-    if (p->_fd < 0) {
-        return -1;
+    // Drop the tag. The snapshot can't be freed and its address reused meanwhile, since the
+    // reader holds a reference, so a matching pointer means it's still the published one.
+    bool dropped = false;
+    uint64_t current = __atomic_load_n(&p->_snapshot, __ATOMIC_RELAXED);
+    while (!dropped && (Impl_SnapshotPointer(current) == s)) {
+        dropped = __atomic_compare_exchange_n(&p->_snapshot, &current,
+                                              current - CONFIG_STORE_SNAPSHOT_ACQUIRER, false,
+                                              __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (!dropped && (s != NULL)) {
+        // Replaced meanwhile: the writer turned the tag into one more reference.
+        __atomic_sub_fetch(&s->refs, 1, __ATOMIC_RELAXED);
     }
 
-    bool read_only = ((flags & (O_WRONLY | O_RDWR)) == 0);
-
-    int lockmode = read_only ? (LOCK_SH | LOCK_NB) : (LOCK_EX | LOCK_NB);
-
-    if (flock(p->_fd, lockmode) < 0) {
-        return -1;
+    if (s == NULL) {
+        errno = ENOENT;
     }
+    return s;
+}
 
-    bool ok = false;
-    off_t ssize = lseek(p->_fd, 0, SEEK_END);
-    ok = (ssize >= 0) && (lseek(p->_fd, 0, SEEK_SET) == 0);
-    if (!ok) {
-        return -1;
+void ConfigStore_SnapshotRelease(ConfigStoreSnapshot *s)
+{
+    if ((s != NULL) && (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+        free(s);
     }
+}
 
-    size_t size = ssize;
-    bool is_new = (size == 0);
-    bool expects_new = (flags & (O_CREAT | O_TRUNC));
+const ConfigStoreKvpHeader *ConfigStore_SnapshotBeginKvp(const ConfigStoreSnapshot *s)
+{
+    return ConfigStore_GetNextKvp((const ConfigStoreKvpHeader *)s->data,
+                                  ConfigStore_SnapshotEndKvp(s));
+}
 
-    if (is_new) {
-        if (!expects_new) {
-            errno = ENOENT;
-            return -1;
+const ConfigStoreKvpHeader *ConfigStore_SnapshotEndKvp(const ConfigStoreSnapshot *s)
+{
+    return (const ConfigStoreKvpHeader *)&s->data[s->size];
+}
+
+const ConfigStoreKvpHeader *ConfigStore_SnapshotTryGetKey(const ConfigStoreSnapshot *s,
+                                                          ConfigStoreKey key)
+{
+    const ConfigStoreKvpHeader *it_end = ConfigStore_SnapshotEndKvp(s);
+    for (const ConfigStoreKvpHeader *it = ConfigStore_SnapshotBeginKvp(s); it != it_end;
+         it = ConfigStore_GetNextKvp(it, it_end)) {
+        if (it->key == key) {
+            return it;
         }
-        size = sizeof(ConfigStoreFileHeader);
     }
+    return NULL;
+}
 
-    if (size < sizeof(ConfigStoreFileHeader)) {
-        errno = ERANGE;
+/// <summary>
+/// Shared memory image of a store. seq is odd while the writer is updating the image.
+/// capacity is fixed when the writer maps the object and bounds size.
+/// </summary>
+struct ConfigStoreSharedImage {
+    uint32_t seq;
+    uint32_t capacity;
+    uint32_t size;
+    uint32_t reserved;
+    uint8_t data[];
+};
+
+/// <summary>
+/// Creates (or reuses) and maps the shared memory object of the writer. The image holds the whole
+/// store, so the object is private to the user: one left behind by an earlier writer is only
+/// reused if that user owns it and no one else can access it.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_MapSharedImage(ConfigStore *p)
+{
+    const char *name = p->_options.shared_view_name;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if ((fd < 0) && (errno == EEXIST)) {
+        fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+    }
+    if (fd < 0) {
         return -1;
     }
 
-    if (ConfigStore_ReserveCapacity(p, size)) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if ((st.st_uid != geteuid()) || (st.st_mode & (S_IRWXG | S_IRWXO))) {
+        close(fd);
+        errno = EPERM;
         return -1;
     }
 
-    ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)(p->_begin);
+    // The image never outgrows the max size of the store, so readers can map it once.
+    size_t map_size = sizeof(struct ConfigStoreSharedImage) + p->_max_size;
+    if ((size_t)st.st_size > map_size) {
+        // Keep the size other readers may have mapped.
+        map_size = st.st_size;
+    }
+    bool ok = (ftruncate(fd, map_size) == 0);
 
-    if (is_new) {
-        // For new files, start with a basic header.
-        header->header.size = sizeof(ConfigStoreFileHeader);
-        header->header.key = ConfigStoreFileHeaderKey;
-        header->signature = ConfigStoreFileSignature;
-        header->version = ConfigStoreFileVersion;
-        p->_end += sizeof(ConfigStoreFileHeader);
-    } else {
-        // For existing files, try to read the store from them.
-        if (read(p->_fd, p->_begin, size) != ssize) {
-            return -1;
-        }
+    void *map = ok ? mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
 
-        size_t content_size = ConfigStore_ValidateFormat(p->_begin, size);
-        if (content_size == 0) {
-            // Invalid content.
-            errno = EINVAL;
-            return -1;
-        }
+    p->_shared_image = map;
+    p->_shared_image_size = map_size;
+    p->_shared_image->capacity = map_size - sizeof(struct ConfigStoreSharedImage);
 
-        bool must_truncate =
-            !read_only && (content_size < size) && (p->_replica_type != ConfigStoreReplica_Swap);
+    return 0;
+}
 
-        if (must_truncate) {
-            // The content is valid, but it's shorter than the file. The previous writer may have
-            // crashed after it wrote the content but before it truncated the file, so truncate it
-            // now.
+/// <summary> Copies the buffer of the store into its shared image, if it has one. </summary>
+static void Impl_PublishSharedImage(ConfigStore *p)
+{
+    struct ConfigStoreSharedImage *image = p->_shared_image;
+    if (image == NULL) {
+        return;
+    }
 
-            if (ftruncate(p->_fd, content_size) != 0) {
-                return -1;
-            }
+    uint32_t seq = __atomic_load_n(&image->seq, __ATOMIC_RELAXED);
+    if (seq & 1) {
+        // A previous writer died mid-publication.
+        ++seq;
+    }
 
-            fsync(p->_fd);
-        }
+    __atomic_store_n(&image->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-        p->_end += content_size;
-    }
+    size_t size = p->_end - p->_begin;
+    memcpy(image->data, p->_begin, size);
+    __atomic_store_n(&image->size, size, __ATOMIC_RELAXED);
 
-    return 0;
+    __atomic_store_n(&image->seq, seq + 2, __ATOMIC_RELEASE);
 }
 
-int ConfigStore_StatVfs(const char *path, struct statvfs *buf)
+/// <summary> Copies the state of a store that isn't reset by ConfigStore_Close. </summary>
+static void Impl_CopyKeptAcrossClose(ConfigStore *pDst, const ConfigStore *pSrc)
 {
-    return statvfs(path, buf);
+    pDst->_options = pSrc->_options;
+#ifdef CONFIG_STORE_ENABLE_STATS
+    pDst->_stats = pSrc->_stats;
+#endif
+    pDst->_wear = pSrc->_wear;
 }
 
-/// <summary>
-/// Adjusts the max file size considering an overhead per storage block, which the file system may
-/// consume for pointers and other metadata.
-/// </summary>
-/// <returns> The adjust size on success, or zero on failure. </summary>
-static size_t AdjustedMaxFileSize(const char *file_path, size_t file_size)
+void ConfigStore_Close(ConfigStore *p)
+{
+    if (p->_fd >= 0) {
+        close(p->_fd);
+    }
+    free(p->_primary_path);
+    free(p->_replica_path);
+    free(p->_begin);
+    free(p->_work);
+#ifdef CONFIG_STORE_ENABLE_STATS
+    if (p->_index != NULL) {
+        p->_stats.lookup_hops += p->_index->lookup_hops;
+    }
+#endif
+    Impl_IndexFree(p->_index);
+    Impl_UndoFree(p->_undo);
+    ConfigStore_SnapshotRelease(Impl_SwapSnapshot(p, NULL));
+    if (p->_shared_image != NULL) {
+        munmap(p->_shared_image, p->_shared_image_size);
+    }
+
+    ConfigStore kept;
+    Impl_CopyKeptAcrossClose(&kept, p);
+    ConfigStore_Init(p);
+    Impl_CopyKeptAcrossClose(p, &kept);
+}
+
+int ConfigStore_GetStats(const ConfigStore *p, ConfigStoreStats *stats)
+{
+#ifdef CONFIG_STORE_ENABLE_STATS
+    *stats = p->_stats;
+    if (p->_index != NULL) {
+        stats->lookup_hops += __atomic_load_n(&p->_index->lookup_hops, __ATOMIC_RELAXED);
+    }
+    return 0;
+#else
+    (void)p;
+    (void)stats;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+void ConfigStore_SetOptions(ConfigStore *p, const ConfigStoreOptions *options)
+{
+    p->_options = *options;
+}
+
+void ConfigStore_Move(ConfigStore *pDst, ConfigStore *pSrc)
+{
+    if (pDst != pSrc) {
+        ConfigStore_Close(pDst);
+        memcpy(pDst, pSrc, sizeof(*pDst));
+        ConfigStore_Init(pSrc);
+    }
+}
+
+int ConfigStore_ReserveCapacity(ConfigStore *p, size_t capacity)
+{
+    if (capacity > p->_max_size) {
+        // Can't grow the file beyond max size.
+        errno = E2BIG;
+        return -1;
+    }
+
+    size_t current_capacity = p->_capacity - p->_begin;
+
+    if (capacity > current_capacity) {
+        uint64_t trace_start = TRACE_START(realloc);
+        uint8_t *new_begin = realloc(p->_begin, capacity);
+        if (new_begin == NULL) {
+            return -1;
+        }
+        TRACE(realloc, ConfigStoreTrace_Realloc, capacity, trace_start);
+        STATS_ADD(p, reallocs, 1);
+
+        p->_capacity = &new_begin[capacity];
+        p->_end = &new_begin[p->_end - p->_begin];
+        p->_begin = new_begin;
+    }
+
+    return 0;
+}
+
+/// <summary> Ensures the key index can hold at least <paramref name="count" /> entries. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_IndexReserve(ConfigStore *p, size_t count)
+{
+    if (p->_index == NULL) {
+        p->_index = calloc(1, sizeof(*p->_index));
+        if (p->_index == NULL) {
+            return -1;
+        }
+    }
+
+    struct ConfigStoreKeyIndex *index = p->_index;
+    if (count <= index->capacity) {
+        return 0;
+    }
+
+    size_t new_capacity = index->capacity ? index->capacity * 2 : 16;
+    if (new_capacity < count) {
+        new_capacity = count;
+    }
+
+    ConfigStoreKey *keys = realloc(index->keys, new_capacity * sizeof(*keys));
+    if (keys == NULL) {
+        return -1;
+    }
+    index->keys = keys;
+
+    uint32_t *offsets = realloc(index->offsets, new_capacity * sizeof(*offsets));
+    if (offsets == NULL) {
+        return -1;
+    }
+    index->offsets = offsets;
+
+    index->capacity = new_capacity;
+    return 0;
+}
+
+static uint32_t Impl_BloomHash(ConfigStoreKey key)
+{
+    // Fibonacci hashing; the two probes come from disjoint bits of the product.
+    return (uint32_t)key * 0x9E3779B1u;
+}
+
+static void Impl_BloomAdd(struct ConfigStoreKeyIndex *index, ConfigStoreKey key)
+{
+    uint32_t h = Impl_BloomHash(key);
+    uint32_t b1 = (h >> 21) % CONFIG_STORE_BLOOM_BITS;
+    uint32_t b2 = (h >> 5) % CONFIG_STORE_BLOOM_BITS;
+    index->bloom[b1 / 64] |= 1ull << (b1 % 64);
+    index->bloom[b2 / 64] |= 1ull << (b2 % 64);
+}
+
+static bool Impl_BloomMayContain(const struct ConfigStoreKeyIndex *index, ConfigStoreKey key)
+{
+    uint32_t h = Impl_BloomHash(key);
+    uint32_t b1 = (h >> 21) % CONFIG_STORE_BLOOM_BITS;
+    uint32_t b2 = (h >> 5) % CONFIG_STORE_BLOOM_BITS;
+    return (index->bloom[b1 / 64] & (1ull << (b1 % 64))) &&
+           (index->bloom[b2 / 64] & (1ull << (b2 % 64)));
+}
+
+static void Impl_BloomRebuild(struct ConfigStoreKeyIndex *index)
+{
+    memset(index->bloom, 0, sizeof(index->bloom));
+    for (size_t i = 0; i < index->count; ++i) {
+        Impl_BloomAdd(index, index->keys[i]);
+    }
+}
+
+static size_t Impl_IndexCount(const ConfigStore *p)
+{
+    return p->_index ? p->_index->count : 0;
+}
+
+static ConfigStoreKvpHeader *Impl_IndexKvp(const ConfigStore *p, size_t i)
+{
+    return (ConfigStoreKvpHeader *)&p->_begin[p->_index->offsets[i]];
+}
+
+/// <summary> Gets the index of the first KVP located at or after a given buffer offset. </summary>
+static size_t Impl_IndexLowerBound(const ConfigStore *p, size_t offset)
+{
+    size_t first = 0;
+    size_t count = Impl_IndexCount(p);
+    while (count > 0) {
+        size_t half = count / 2;
+        if (p->_index->offsets[first + half] < offset) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    return first;
+}
+
+/// <summary>
+/// Inserts an entry at position <paramref name="i" /> of the index, shifting the offsets of the
+/// entries after it by <paramref name="shift" /> bytes. The capacity must have been reserved.
+/// </summary>
+static void Impl_IndexInsert(ConfigStore *p, size_t i, ConfigStoreKey key, size_t offset,
+                             size_t shift)
+{
+    struct ConfigStoreKeyIndex *index = p->_index;
+    size_t tail = index->count - i;
+
+    memmove(&index->keys[i + 1], &index->keys[i], tail * sizeof(*index->keys));
+    memmove(&index->offsets[i + 1], &index->offsets[i], tail * sizeof(*index->offsets));
+    for (size_t j = i + 1; j <= index->count; ++j) {
+        index->offsets[j] += shift;
+    }
+
+    index->keys[i] = key;
+    index->offsets[i] = offset;
+    ++index->count;
+
+    Impl_BloomAdd(index, key);
+}
+
+/// <summary>
+/// Removes the entry at position <paramref name="i" /> of the index, shifting the offsets of the
+/// entries after it back by <paramref name="shift" /> bytes.
+/// </summary>
+static void Impl_IndexErase(ConfigStore *p, size_t i, size_t shift)
+{
+    struct ConfigStoreKeyIndex *index = p->_index;
+    size_t tail = index->count - i - 1;
+
+    memmove(&index->keys[i], &index->keys[i + 1], tail * sizeof(*index->keys));
+    memmove(&index->offsets[i], &index->offsets[i + 1], tail * sizeof(*index->offsets));
+    --index->count;
+    for (size_t j = i; j < index->count; ++j) {
+        index->offsets[j] -= shift;
+    }
+
+    // Bits can't be cleared for a single key. The walk costs about as much as the shift above.
+    Impl_BloomRebuild(index);
+}
+
+/// <summary> Shifts the offsets of all the entries of the index by a number of bytes. </summary>
+static void Impl_IndexShiftAll(ConfigStore *p, ptrdiff_t shift)
+{
+    for (size_t j = 0; j < Impl_IndexCount(p); ++j) {
+        p->_index->offsets[j] += shift;
+    }
+}
+
+/// <summary>
+/// Rebuilds the entries of the key index past its first <paramref name="kept" /> ones, which must
+/// still describe the buffer, by walking the KVP chain from the last of them.
+/// </summary>
+/// <param name="padding_size"> Receives the size of the padding walked. </param>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_IndexRebuildFrom(ConfigStore *p, size_t kept, size_t *padding_size)
+{
+    if (Impl_IndexReserve(p, 0)) {
+        return -1;
+    }
+
+    ConfigStoreKvpHeader *it = (kept != 0) ? Impl_IndexKvp(p, kept - 1)
+                                           : (ConfigStoreKvpHeader *)p->_begin;
+    p->_index->count = kept;
+    *padding_size = 0;
+
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    for (it = Impl_GetNextRawKvp(it, it_end); it != it_end; it = Impl_GetNextRawKvp(it, it_end)) {
+        if (it->key == ConfigStorePaddingKey) {
+            *padding_size += it->size;
+            continue;
+        }
+        if (Impl_IsTrailerKey(it->key)) {
+            continue;
+        }
+
+        size_t count = p->_index->count;
+        if (Impl_IndexReserve(p, count + 1)) {
+            return -1;
+        }
+        p->_index->keys[count] = it->key;
+        p->_index->offsets[count] = (uint8_t *)it - p->_begin;
+        p->_index->count = count + 1;
+    }
+
+    Impl_BloomRebuild(p->_index);
+
+    return 0;
+}
+
+/// <summary> Rebuilds the key index by walking the KVP chain. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_IndexRebuild(ConfigStore *p)
+{
+    p->_padding_size = 0;
+    return Impl_IndexRebuildFrom(p, 0, &p->_padding_size);
+}
+
+/// <summary>
+/// Finds the first key equal to <paramref name="key" /> in keys[first, count).
+/// Compares 8 keys per instruction when SSE2 or NEON is available.
+/// </summary>
+/// <returns> The index of the match or <paramref name="count" /> if there is none. </returns>
+static size_t Impl_ScanKey(const ConfigStoreKey *keys, size_t first, size_t count,
+                           ConfigStoreKey key)
+{
+    size_t i = first;
+
+#if defined(__SSE2__)
+    const __m128i needle = _mm_set1_epi16((short)key);
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)&keys[i]);
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, needle));
+        if (mask != 0) {
+            return i + __builtin_ctz(mask) / 2;
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t needle = vdupq_n_u16(key);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t eq = vceqq_u16(vld1q_u16(&keys[i]), needle);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(eq, 4)), 0);
+        if (mask != 0) {
+            return i + __builtin_ctzll(mask) / 8;
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        if (keys[i] == key) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/// <summary>
+/// Finds the first key in keys[first, count) that matches the range
+/// [<paramref name="first_key" />, <paramref name="last_key" />) and the key increment.
+/// The range test is vectorized; the increment is then checked on each candidate.
+/// </summary>
+/// <returns> The index of the match or <paramref name="count" /> if there is none. </returns>
+static size_t Impl_ScanKeyRange(const ConfigStoreKey *keys, size_t first, size_t count,
+                                ConfigStoreKey first_key, ConfigStoreKey last_key,
+                                ConfigStoreKey key_increment)
+{
+    if (first_key >= last_key) {
+        return count;
+    }
+
+    // (key - first_key) < (last_key - first_key) in unsigned 16-bit arithmetic covers both ends.
+    const uint16_t span = last_key - first_key;
+    size_t i = first;
+
+#if defined(__SSE2__)
+    const __m128i base = _mm_set1_epi16((short)first_key);
+    const __m128i limit = _mm_set1_epi16((short)(span - 1));
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 8 <= count; i += 8) {
+        __m128i delta = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)&keys[i]), base);
+        // delta <= span - 1 <=> saturating (delta - (span - 1)) == 0.
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_subs_epu16(delta, limit), zero));
+        while (mask != 0) {
+            size_t lane = __builtin_ctz(mask) / 2;
+            if (((uint16_t)(keys[i + lane] - first_key) % key_increment) == 0) {
+                return i + lane;
+            }
+            mask &= ~(3u << (lane * 2));
+        }
+    }
+#elif defined(__ARM_NEON)
+    const uint16x8_t base = vdupq_n_u16(first_key);
+    const uint16x8_t limit = vdupq_n_u16(span);
+    for (; i + 8 <= count; i += 8) {
+        uint16x8_t delta = vsubq_u16(vld1q_u16(&keys[i]), base);
+        uint16x8_t in_range = vcltq_u16(delta, limit);
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(in_range, 4)), 0);
+        while (mask != 0) {
+            size_t lane = __builtin_ctzll(mask) / 8;
+            if (((uint16_t)(keys[i + lane] - first_key) % key_increment) == 0) {
+                return i + lane;
+            }
+            mask &= ~(0xFFull << (lane * 8));
+        }
+    }
+#endif
+
+    for (; i < count; ++i) {
+        uint16_t delta = keys[i] - first_key;
+        if ((delta < span) && ((delta % key_increment) == 0)) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+/// <summary>
+/// Turns <paramref name="size" /> bytes at a given offset into padding, merging them with padding
+/// that immediately follows when the result fits in one KVP.
+/// </summary>
+static void Impl_MakePadding(ConfigStore *p, size_t offset, size_t size)
+{
+    Impl_UndoTouch(p, offset, size);
+
+    // More than a KVP can hold takes several, none of them too small to be a KVP.
+    while (size > UINT16_MAX) {
+        size_t pad_size = UINT16_MAX;
+        if (size - pad_size < sizeof(ConfigStoreKvpHeader)) {
+            pad_size -= sizeof(ConfigStoreKvpHeader);
+        }
+        ConfigStoreKvpHeader *pad = (ConfigStoreKvpHeader *)&p->_begin[offset];
+        memset(pad, 0, pad_size);
+        pad->key = ConfigStorePaddingKey;
+        pad->size = pad_size;
+        offset += pad_size;
+        size -= pad_size;
+    }
+
+    ConfigStoreKvpHeader *pad = (ConfigStoreKvpHeader *)&p->_begin[offset];
+    ConfigStoreKvpHeader *next = (ConfigStoreKvpHeader *)&p->_begin[offset + size];
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+
+    if (ConfigStore_CanDereferenceKvp(next, it_end) && (next->key == ConfigStorePaddingKey) &&
+        (size + next->size <= UINT16_MAX)) {
+        size += next->size;
+        Impl_UndoTouch(p, offset, size);
+    }
+
+    // Don't keep stale values around.
+    memset(pad, 0, size);
+    pad->key = ConfigStorePaddingKey;
+    pad->size = size;
+}
+
+/// <summary>
+/// Gets whether a KVP can take over padding of a given size: either all of it, or its front with
+/// enough left for a smaller padding KVP.
+/// </summary>
+static bool Impl_FitsPadding(size_t pad_size, size_t kvp_size)
+{
+    return (pad_size == kvp_size) || (pad_size >= kvp_size + sizeof(ConfigStoreKvpHeader));
+}
+
+/// <summary>
+/// Gets the offset of the free space before the i-th indexed KVP (or before the end of the store),
+/// that is, the end of the KVP or file header before it, and of their trailers. Everything in
+/// between is padding.
+/// </summary>
+static size_t Impl_GapOffset(const ConfigStore *p, size_t i)
+{
+    if (p->_begin == p->_end) {
+        return 0;
+    }
+
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    ConfigStoreKvpHeader *prev =
+        (i == 0) ? (ConfigStoreKvpHeader *)p->_begin : Impl_IndexKvp(p, i - 1);
+    ConfigStoreKvpHeader *next = Impl_GetNextRawKvp(prev, it_end);
+    return (uint8_t *)Impl_SkipTrailers(next, it_end) - p->_begin;
+}
+
+/// <summary>
+/// Puts a KVP at the front of the padding at a given offset; what's left of the padding stays
+/// padding. The index must have room for the KVP.
+/// </summary>
+static ConfigStoreKvpHeader *Impl_FillPadding(ConfigStore *p, size_t offset, size_t pad_size,
+                                              ConfigStoreKey key, size_t kvp_size)
+{
+    if (pad_size > kvp_size) {
+        Impl_MakePadding(p, offset + kvp_size, pad_size - kvp_size);
+    }
+    p->_padding_size -= kvp_size;
+
+    // The value is left zeroed by the padding.
+    Impl_UndoTouch(p, offset, sizeof(ConfigStoreKvpHeader));
+    ConfigStoreKvpHeader *pKvp = (ConfigStoreKvpHeader *)&p->_begin[offset];
+    pKvp->size = kvp_size;
+    pKvp->key = key;
+
+    Impl_IndexInsert(p, Impl_IndexLowerBound(p, offset), key, offset, 0);
+
+    return pKvp;
+}
+
+/// <summary>
+/// Moves the KVPs over the padding between them so the buffer holds none. Invalidates pointers to
+/// KVPs, but not positions in the index.
+/// </summary>
+static void Impl_Compact(ConfigStore *p)
+{
+    if (p->_padding_size == 0) {
+        return;
+    }
+
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    ConfigStoreKvpHeader *it = Impl_GetNextRawKvp((ConfigStoreKvpHeader *)p->_begin, it_end);
+    uint8_t *out = (uint8_t *)it;
+    size_t i = 0;
+    bool moved = false;
+
+    while (it != it_end) {
+        ConfigStoreKvpHeader *next = Impl_GetNextRawKvp(it, it_end);
+        if (it->key != ConfigStorePaddingKey) {
+            size_t size = (uint8_t *)next - (uint8_t *)it;
+            if (out != (uint8_t *)it) {
+                if (!moved) {
+                    // Everything from the first hole on moves.
+                    Impl_UndoTouch(p, out - p->_begin, (uint8_t *)it_end - out);
+                    moved = true;
+                }
+                memmove(out, it, size);
+                STATS_ADD(p, bytes_moved, size);
+            }
+            // Every KVP but the file header, padding and trailers is indexed, in order.
+            if (!Impl_IsTrailerKey(it->key)) {
+                p->_index->offsets[i++] = out - p->_begin;
+            }
+            out += size;
+        }
+        it = next;
+    }
+
+    p->_end = out;
+    p->_padding_size = 0;
+    STATS_ADD(p, compactions, 1);
+}
+
+/// <summary> Gets whether erases left enough padding behind to compact the buffer. </summary>
+static bool Impl_ShouldCompact(const ConfigStore *p)
+{
+    return (p->_padding_size >= CONFIG_STORE_COMPACT_MIN_PADDING) &&
+           (p->_padding_size >= (size_t)(p->_end - p->_begin) / 4);
+}
+
+/// <summary>
+/// Reserves room for <paramref name="size" /> more bytes at the end of the buffer, compacting the
+/// padding if the store is otherwise full. Compaction invalidates pointers to KVPs.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_ReserveTail(ConfigStore *p, size_t size, bool *compacted)
+{
+    *compacted = false;
+    if (ConfigStore_ReserveCapacity(p, (p->_end - p->_begin) + size) == 0) {
+        return 0;
+    }
+    if ((errno != E2BIG) || (p->_padding_size == 0)) {
+        return -1;
+    }
+
+    Impl_Compact(p);
+    *compacted = true;
+    return ConfigStore_ReserveCapacity(p, (p->_end - p->_begin) + size);
+}
+
+static bool Impl_IsKnownFileVersion(uint8_t version)
+{
+    return (version == ConfigStoreFileVersion) || (version == ConfigStoreFileVersionCompact);
+}
+
+/// <summary> Gets the size of a value encoded in LEB128. </summary>
+static size_t Impl_VarintSize(uint32_t value)
+{
+    size_t size = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static uint8_t *Impl_PutVarint(uint8_t *dst, uint32_t value)
+{
+    while (value >= 0x80) {
+        *dst++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *dst++ = (uint8_t)value;
+    return dst;
+}
+
+/// <summary> Reads a 16-bit value encoded in LEB128. </summary>
+/// <returns> The position after the value; NULL if it's truncated or out of range. </returns>
+static const uint8_t *Impl_GetVarint16(const uint8_t *src, const uint8_t *end, uint16_t *value)
+{
+    uint32_t v = 0;
+    for (unsigned shift = 0; (src != end) && (shift <= 14); shift += 7) {
+        uint8_t b = *src++;
+        v |= (uint32_t)(b & 0x7F) << shift;
+        if ((b & 0x80) == 0) {
+            if (v > UINT16_MAX) {
+                return NULL;
+            }
+            *value = (uint16_t)v;
+            return src;
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+/// Decodes the KVPs of a compact (version 1) file, which follow its file header, into KVPs with
+/// fixed headers.
+/// </summary>
+/// <param name="dst"> If not NULL, receives the decoded KVPs. </param>
+/// <param name="decoded_size"> Receives the size of the decoded KVPs. </param>
+/// <returns> true on success; false if the KVPs are malformed. </returns>
+static bool Impl_DecodeCompact(const uint8_t *src, size_t size, uint8_t *dst, size_t *decoded_size)
+{
+    const uint8_t *end = src + size;
+    size_t total = 0;
+
+    while (src != end) {
+        uint16_t key;
+        uint16_t value_size;
+        src = Impl_GetVarint16(src, end, &key);
+        src = src ? Impl_GetVarint16(src, end, &value_size) : NULL;
+
+        bool ok = (src != NULL) && (key != ConfigStoreFileHeaderKey) &&
+                  (value_size <= UINT16_MAX - sizeof(ConfigStoreKvpHeader)) &&
+                  (value_size <= (size_t)(end - src));
+        if (!ok) {
+            return false;
+        }
+
+        if (dst != NULL) {
+            ConfigStoreKvpHeader header = {key, value_size + sizeof(ConfigStoreKvpHeader)};
+            memcpy(dst + total, &header, sizeof(header));
+            memcpy(dst + total + sizeof(header), src, value_size);
+        }
+        src += value_size;
+        total += value_size + sizeof(ConfigStoreKvpHeader);
+    }
+
+    *decoded_size = total;
+    return true;
+}
+
+/// <summary> Encodes the buffer of a store as a compact (version 1) file. </summary>
+/// <param name="size"> Receives the size of the file. </param>
+/// <returns> The file, to free by the caller; NULL on failure with error indication in errno. </returns>
+static uint8_t *Impl_EncodeCompact(ConfigStore *p, size_t *size)
+{
+    ConfigStoreKvpHeader *first = Impl_GetNextRawKvp((ConfigStoreKvpHeader *)p->_begin,
+                                                     (ConfigStoreKvpHeader *)p->_end);
+    ConfigStoreKvpHeader *last = (ConfigStoreKvpHeader *)p->_end;
+
+    // Padding is never written.
+    size_t total = sizeof(ConfigStoreFileHeader);
+    for (ConfigStoreKvpHeader *it = first; it != last; it = Impl_GetNextRawKvp(it, last)) {
+        if (it->key == ConfigStorePaddingKey) {
+            continue;
+        }
+        size_t value_size = it->size - sizeof(*it);
+        total += Impl_VarintSize(it->key) + Impl_VarintSize(value_size) + value_size;
+    }
+
+    uint8_t *file = malloc(total);
+    if (file == NULL) {
+        return NULL;
+    }
+
+    uint8_t *dst = file + sizeof(ConfigStoreFileHeader);
+    for (ConfigStoreKvpHeader *it = first; it != last; it = Impl_GetNextRawKvp(it, last)) {
+        if (it->key == ConfigStorePaddingKey) {
+            continue;
+        }
+        size_t value_size = it->size - sizeof(*it);
+        dst = Impl_PutVarint(dst, it->key);
+        dst = Impl_PutVarint(dst, value_size);
+        memcpy(dst, it + 1, value_size);
+        dst += value_size;
+    }
+
+    size_t crc_size = total - sizeof(ConfigStoreFileHeader);
+    ConfigStoreFileHeader header;
+    memcpy(&header, p->_begin, sizeof(header));
+    header.file_size = total;
+    header.crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, file + sizeof(header), crc_size);
+    memcpy(file, &header, sizeof(header));
+    STATS_ADD(p, crc_bytes, crc_size);
+
+    *size = total;
+    return file;
+}
+
+/// <summary>
+/// Replaces the compact file read into the buffer of a store with its KVPs with fixed headers. The
+/// file header keeps the version, so commits write the same version back.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_DecodeCompactFile(ConfigStore *p, size_t file_size)
+{
+    const size_t HeaderSize = sizeof(ConfigStoreFileHeader);
+
+    size_t decoded_size;
+    if (!Impl_DecodeCompact(p->_begin + HeaderSize, file_size - HeaderSize, NULL, &decoded_size)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint8_t *file = malloc(file_size);
+    if (file == NULL) {
+        return -1;
+    }
+    memcpy(file, p->_begin, file_size);
+
+    int res = ConfigStore_ReserveCapacity(p, HeaderSize + decoded_size);
+    if (res == 0) {
+        Impl_DecodeCompact(file + HeaderSize, file_size - HeaderSize, p->_begin + HeaderSize,
+                           &decoded_size);
+
+        // Describe the decoded content, as Impl_PrepareCommit would, to skip unchanged commits.
+        ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)p->_begin;
+        header->file_size = HeaderSize + decoded_size;
+        header->crc =
+            ConfigStore_AddCrc(ConfigStoreCrcInitValue, p->_begin + HeaderSize, decoded_size);
+        STATS_ADD(p, crc_bytes, decoded_size);
+    }
+
+    free(file);
+    return res;
+}
+
+static bool ConfigStore_InvariantsCheck(const ConfigStore *p)
+{
+    bool ok = (p) && (p->_fd >= 0) && (p->_begin + sizeof(ConfigStoreFileHeader) <= p->_end) &&
+              (p->_end <= p->_capacity);
+    return ok;
+}
+
+static bool ReplicaTypeIsValid(ConfigStoreReplicaType rtype)
+{
+    switch (rtype) {
+    case ConfigStoreReplica_None ... ConfigStoreReplica_Swap:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/// <summary> Bytes read from the store file at a time on open, and validated as they arrive. </summary>
+#define CONFIG_STORE_OPEN_READ_CHUNK (16 * 1024)
+
+/// <summary> Reads part of the store file into the buffer, in full. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_ReadChunk(ConfigStore *p, size_t offset, size_t size)
+{
+    uint64_t trace_start = TRACE_START(open_read);
+    for (size_t done = 0; done < size;) {
+        ssize_t res = read(p->_fd, &p->_begin[offset + done], size - done);
+        if (res <= 0) {
+            if (res == 0) {
+                // The file shrank since it was measured.
+                errno = EIO;
+            }
+            return -1;
+        }
+        done += res;
+    }
+    TRACE(open_read, ConfigStoreTrace_OpenRead, size, trace_start);
+    return 0;
+}
+
+/// <summary>
+/// Reads the store file into the buffer in chunks, validating each one as soon as it's read.
+/// </summary>
+/// <returns> The valid size of the content on success; 0 on failure with error indication in
+/// errno. </returns>
+static size_t Impl_ReadValidated(ConfigStore *p, size_t size)
+{
+    ConfigStoreValidator v;
+    ConfigStore_ValidatorInit(&v);
+
+    for (size_t offset = 0; offset < size; offset += CONFIG_STORE_OPEN_READ_CHUNK) {
+        size_t chunk_size = size - offset;
+        if (chunk_size > CONFIG_STORE_OPEN_READ_CHUNK) {
+            chunk_size = CONFIG_STORE_OPEN_READ_CHUNK;
+        }
+        if (Impl_ReadChunk(p, offset, chunk_size)) {
+            return 0;
+        }
+        STATS_ADD(p, bytes_read, chunk_size);
+
+        uint64_t trace_start = TRACE_START(validate);
+        int res = ConfigStore_ValidatorUpdate(&v, &p->_begin[offset], chunk_size);
+        TRACE(validate, ConfigStoreTrace_Validate, chunk_size, trace_start);
+        if (res) {
+            // Invalid content; the rest of the file isn't read.
+            return 0;
+        }
+    }
+
+    size_t content_size = ConfigStore_ValidatorFinish(&v);
+    if (content_size == 0) {
+        errno = EINVAL;
+    }
+    return content_size;
+}
+
+/// <summary> Reads the whole store file into the buffer, then validates it in parallel. </summary>
+/// <returns> The valid size of the content on success; 0 on failure with error indication in
+/// errno. </returns>
+static size_t Impl_ReadParallelValidated(ConfigStore *p, size_t size)
+{
+    if (Impl_ReadChunk(p, 0, size)) {
+        return 0;
+    }
+    STATS_ADD(p, bytes_read, size);
+
+    uint64_t trace_start = TRACE_START(validate);
+    size_t content_size =
+        ConfigStore_ValidateFormatParallel(p->_begin, size, p->_options.validation_threads);
+    TRACE(validate, ConfigStoreTrace_Validate, size, trace_start);
+    if (content_size == 0) {
+        errno = EINVAL;
+    }
+    return content_size;
+}
+
+static int Impl_Open(ConfigStore *p, const char *base_filepath, size_t max_size, int flags,
+                     ConfigStoreReplicaType rtype)
+{
+    if (!ReplicaTypeIsValid(rtype) || !Impl_IsKnownFileVersion(p->_options.file_version)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p->_replica_type = rtype;
+    p->_max_size = max_size;
+
+    p->_primary_path = strdup(base_filepath);
+    if (p->_primary_path == NULL) {
+        return -1;
+    }
+
+    if (p->_replica_type == ConfigStoreReplica_Swap) {
+        p->_replica_path = AppendString(base_filepath, ".tmp");
+        if (p->_replica_path == NULL) {
+            return -1;
+        }
+
+        // For swap mode, remove the swap file preemptively, even for readers.
+        // If the swap exists on open, that means it's a leftover from a previous run that
+        // crashed/exited before swaping it with the primary file.
+        remove(p->_replica_path);
+    }
+
+    flags |= O_CLOEXEC;
+
+    p->_fd = open(p->_primary_path, flags, S_IRUSR | S_IWUSR);
+    if (p->_fd < 0) {
+        return -1;
+    }
+
+    bool read_only = ((flags & (O_WRONLY | O_RDWR)) == 0);
+
+    int lockmode = read_only ? (LOCK_SH | LOCK_NB) : (LOCK_EX | LOCK_NB);
+
+    if (flock(p->_fd, lockmode) < 0) {
+        return -1;
+    }
+
+    bool ok = false;
+    off_t ssize = lseek(p->_fd, 0, SEEK_END);
+    ok = (ssize >= 0) && (lseek(p->_fd, 0, SEEK_SET) == 0);
+    if (!ok) {
+        return -1;
+    }
+
+    size_t size = ssize;
+    bool is_new = (size == 0);
+    bool expects_new = (flags & (O_CREAT | O_TRUNC));
+
+    if (is_new) {
+        if (!expects_new) {
+            errno = ENOENT;
+            return -1;
+        }
+        size = sizeof(ConfigStoreFileHeader);
+    }
+
+    if (size < sizeof(ConfigStoreFileHeader)) {
+        errno = ERANGE;
+        return -1;
+    }
+
+    if (ConfigStore_ReserveCapacity(p, size)) {
+        return -1;
+    }
+
+    ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)(p->_begin);
+
+    if (is_new) {
+        // For new files, start with a basic header.
+        header->header.size = sizeof(ConfigStoreFileHeader);
+        header->header.key = ConfigStoreFileHeaderKey;
+        header->signature = ConfigStoreFileSignature;
+        header->version = p->_options.file_version;
+        p->_end += sizeof(ConfigStoreFileHeader);
+    } else {
+        // For existing files, try to read the store from them.
+        size_t threshold = p->_options.parallel_validation_threshold;
+        size_t content_size = ((threshold != 0) && (size >= threshold))
+                                  ? Impl_ReadParallelValidated(p, size)
+                                  : Impl_ReadValidated(p, size);
+        if (content_size == 0) {
+            return -1;
+        }
+        STATS_ADD(p, crc_bytes, content_size - sizeof(ConfigStoreFileHeader));
+
+        bool must_truncate =
+            !read_only && (content_size < size) && (p->_replica_type != ConfigStoreReplica_Swap);
+
+        if (must_truncate) {
+            // The content is valid, but it's shorter than the file. The previous writer may have
+            // crashed after it wrote the content but before it truncated the file, so truncate it
+            // now.
+
+            uint64_t trace_start = TRACE_START(truncate);
+            if (ftruncate(p->_fd, content_size) != 0) {
+                return -1;
+            }
+            TRACE(truncate, ConfigStoreTrace_Truncate, content_size, trace_start);
+
+            if (Impl_Fsync(p, p->_fd, content_size)) {
+                return -1;
+            }
+        }
+
+        if (header->version == ConfigStoreFileVersionCompact) {
+            if (Impl_DecodeCompactFile(p, content_size)) {
+                return -1;
+            }
+            p->_end += ((const ConfigStoreFileHeader *)p->_begin)->file_size;
+        } else {
+            p->_end += content_size;
+        }
+
+        // Commits compare the decoded content, which compact files don't store as is.
+        const ConfigStoreFileHeader *decoded = (const ConfigStoreFileHeader *)p->_begin;
+        p->_committed = true;
+        p->_committed_size = decoded->file_size;
+        p->_committed_crc = decoded->crc;
+    }
+
+    if (Impl_IndexRebuild(p)) {
+        return -1;
+    }
+
+    if (p->_options.publish_snapshots) {
+        ConfigStoreSnapshot *s = Impl_NewSnapshot(p);
+        if (s == NULL) {
+            return -1;
+        }
+        ConfigStore_SnapshotRelease(Impl_SwapSnapshot(p, s));
+    }
+
+    if ((p->_options.shared_view_name != NULL) && !read_only) {
+        if (Impl_MapSharedImage(p)) {
+            return -1;
+        }
+        Impl_PublishSharedImage(p);
+    }
+
+    return 0;
+}
+
+int ConfigStore_StatVfs(const char *path, struct statvfs *buf)
+{
+    return statvfs(path, buf);
+}
+
+/// <summary>
+/// Adjusts the max file size considering an overhead per storage block, which the file system may
+/// consume for pointers and other metadata.
+/// </summary>
+/// <returns> The adjust size on success, or zero on failure. </summary>
+/// <param name="block_size"> Receives the block size of the file system on success. </param>
+static size_t AdjustedMaxFileSize(const char *file_path, size_t file_size, size_t *block_size)
+{
+    if (file_size <= ConfigStoreOverheadPerStorageBlock) {
+        return 0;
+    }
+
+    char *path_copy = strdup(file_path);
+    if (path_copy == NULL) {
+        return 0;
+    }
+
+    // Get block size
+    struct statvfs stat_buf;
+    int r = ConfigStore_StatVfs(dirname(path_copy), &stat_buf);
+    free(path_copy);
+
+    if (r) {
+        return 0;
+    }
+
+    const size_t BlockSize = stat_buf.f_bsize;
+    *block_size = BlockSize;
+
+    size_t pointer_overhead =
+        ((file_size - 1) / BlockSize + 1) * ConfigStoreOverheadPerStorageBlock;
+
+    return file_size - pointer_overhead;
+}
+
+int ConfigStore_Open(ConfigStore *p, const char *base_filepath, size_t max_size, int flags,
+                     ConfigStoreReplicaType rtype)
+{
+    if (p->_fd >= 0) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    uint64_t start = STATS_NOW();
+    (void)start;
+
+    ConfigStore temp;
+    ConfigStore_Init(&temp);
+    Impl_CopyKeptAcrossClose(&temp, p);
+
+    size_t adjusted_max_size = AdjustedMaxFileSize(base_filepath, max_size, &temp._block_size);
+    if (adjusted_max_size == 0) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    int res = Impl_Open(&temp, base_filepath, adjusted_max_size, flags, rtype);
+
+    if (res == 0) {
+        ConfigStore_Move(p, &temp);
+        STATS_ADD(p, opens, 1);
+        STATS_LATENCY(p, open_latency, start);
+    }
+
+    ConfigStore_Close(&temp);
+
+    return res;
+}
+
+static int Impl_WriteImage(int fd, ConfigStore *p, const uint8_t *image, ssize_t total_size)
+{
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+        return -1;
+    }
+
+    uint64_t trace_start = TRACE_START(write);
+    if (write(fd, image, total_size) != total_size) {
+        return -1;
+    }
+    TRACE(write, ConfigStoreTrace_Write, total_size, trace_start);
+    STATS_ADD(p, bytes_written, total_size);
+
+    trace_start = TRACE_START(truncate);
+    if (ftruncate(fd, total_size) != 0) {
+        return -1;
+    }
+    TRACE(truncate, ConfigStoreTrace_Truncate, total_size, trace_start);
+
+    return Impl_Fsync(p, fd, total_size);
+}
+
+/// <summary> Gets the size of the content of the buffer, which is what a commit writes. </summary>
+static size_t Impl_ContentSize(const ConfigStore *p)
+{
+    return (p->_end - p->_begin) - p->_padding_size;
+}
+
+/// <summary>
+/// Calls a function on each span of the buffer that a file holds, in order: the file header and
+/// the runs of KVPs between padding.
+/// </summary>
+static void Impl_ForEachContentSpan(const ConfigStore *p,
+                                    void (*fn)(void *context, const uint8_t *span, size_t size),
+                                    void *context)
+{
+    const ConfigStoreKvpHeader *it_end = (const ConfigStoreKvpHeader *)p->_end;
+    const uint8_t *span = p->_begin;
+    for (const ConfigStoreKvpHeader *it =
+             Impl_GetNextRawKvp((const ConfigStoreKvpHeader *)p->_begin, it_end);
+         it != it_end; it = Impl_GetNextRawKvp(it, it_end)) {
+        if (it->key == ConfigStorePaddingKey) {
+            if ((const uint8_t *)it != span) {
+                fn(context, span, (const uint8_t *)it - span);
+            }
+            span = (const uint8_t *)Impl_GetNextRawKvp(it, it_end);
+        }
+    }
+    if (span != p->_end) {
+        fn(context, span, p->_end - span);
+    }
+}
+
+static void Impl_CopySpan(void *context, const uint8_t *span, size_t size)
+{
+    uint8_t **dst = context;
+    memcpy(*dst, span, size);
+    *dst += size;
+}
+
+/// <summary> Gets the file image of the buffer, encoded in the file version of the store. </summary>
+/// <param name="owned"> Receives the image if it had to be allocated, to free by the caller. </param>
+/// <returns> The image; NULL on failure with error indication in errno. </returns>
+static const uint8_t *Impl_FileImage(ConfigStore *p, size_t *size, uint8_t **owned)
+{
+    *owned = NULL;
+
+    const ConfigStoreFileHeader *header = (const ConfigStoreFileHeader *)p->_begin;
+    if ((header->version != ConfigStoreFileVersionCompact) && (p->_padding_size == 0)) {
+        *size = p->_end - p->_begin;
+        return p->_begin;
+    }
+
+    if (header->version != ConfigStoreFileVersionCompact) {
+        // Padding is never written, but the buffer keeps it so KVP pointers stay valid.
+        *size = Impl_ContentSize(p);
+        *owned = malloc(*size);
+        uint8_t *dst = *owned;
+        if (dst != NULL) {
+            Impl_ForEachContentSpan(p, Impl_CopySpan, &dst);
+        }
+        return *owned;
+    }
+
+    *owned = Impl_EncodeCompact(p, size);
+    return *owned;
+}
+
+/// <summary> Writes the buffer to a file, encoded in the file version of the store. </summary>
+static int Impl_WriteToFile(int fd, ConfigStore *p)
+{
+    size_t size;
+    uint8_t *owned;
+    const uint8_t *image = Impl_FileImage(p, &size, &owned);
+    if (image == NULL) {
+        return -1;
+    }
+
+    int res = Impl_WriteImage(fd, p, image, size);
+    free(owned);
+    return res;
+}
+
+/// <summary> CRC of spans of the buffer past the first skip bytes. </summary>
+struct ConfigStoreSpanCrc {
+    uint32_t crc;
+    size_t skip;
+};
+
+static void Impl_AddSpanCrc(void *context, const uint8_t *span, size_t size)
+{
+    struct ConfigStoreSpanCrc *state = context;
+    size_t skip = (size < state->skip) ? size : state->skip;
+    state->skip -= skip;
+    state->crc = ConfigStore_AddCrc(state->crc, span + skip, size - skip);
+}
+
+/// <summary>
+/// Computes the CRC of the content of the buffer and updates the file header for a commit. The
+/// content is what the file holds: the padding is left out of it, but not moved out of the buffer,
+/// so pointers to KVPs stay valid across commits.
+/// </summary>
+/// <returns> true if the content differs from the last committed content; false otherwise. </returns>
+static bool Impl_PrepareCommit(ConfigStore *p)
+{
+    if (p->_undo != NULL) {
+        Impl_UndoPop(p->_undo, 0);
+    }
+
+    size_t content_size = Impl_ContentSize(p);
+    size_t crc_size = content_size - sizeof(ConfigStoreFileHeader);
+    uint64_t trace_start = TRACE_START(commit_crc);
+    struct ConfigStoreSpanCrc span_crc = {ConfigStoreCrcInitValue, sizeof(ConfigStoreFileHeader)};
+    Impl_ForEachContentSpan(p, Impl_AddSpanCrc, &span_crc);
+    uint32_t crc = span_crc.crc;
+    TRACE(commit_crc, ConfigStoreTrace_CommitCrc, crc_size, trace_start);
+    STATS_ADD(p, crc_bytes, crc_size);
+
+    ConfigStoreKvpHeader *first = (ConfigStoreKvpHeader *)p->_begin;
+    ConfigStoreKvpHeader *last = (ConfigStoreKvpHeader *)p->_end;
+
+    if ((first != last) && (first->key == ConfigStoreFileHeaderKey)) {
+        ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)(first);
+        header->file_size = content_size;
+        header->crc = crc;
+    }
+
+    return !p->_committed || (p->_committed_size != content_size) || (p->_committed_crc != crc);
+}
+
+/// <summary> Writes a prepared commit. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_Commit(ConfigStore *p)
+{
+    uint64_t trace_start;
+
+    if (p->_replica_type == ConfigStoreReplica_Swap) {
+        // Create the swap file always.
+        int fd = open(p->_replica_path, O_RDWR | O_CREAT | O_CLOEXEC | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            return -1;
+        }
+        int res = Impl_WriteToFile(fd, p);
+        close(fd);
+        if (res < 0) {
+            return -1;
+        }
+        trace_start = TRACE_START(rename);
+        res = rename(p->_replica_path, p->_primary_path);
+        if (res < 0) {
+            return -1;
+        }
+        TRACE(rename, ConfigStoreTrace_Rename, p->_end - p->_begin, trace_start);
+
+        Impl_PublishSharedImage(p);
+
+        // No snapshot to publish: closing the store retracts it.
+        ConfigStore_Close(p);
+    } else {
+        // Allocate the snapshot up front so a successful write is always published.
+        ConfigStoreSnapshot *snapshot = NULL;
+        if (p->_options.publish_snapshots) {
+            snapshot = Impl_NewSnapshot(p);
+            if (snapshot == NULL) {
+                return -1;
+            }
+        }
+
+        // A failed write can leave the file torn, so until one succeeds, the file doesn't hold
+        // what was last committed and a commit of that same content mustn't be skipped.
+        p->_committed = false;
+        if (Impl_WriteToFile(p->_fd, p) < 0) {
+            ConfigStore_SnapshotRelease(snapshot);
+            return -1;
+        }
+
+        const ConfigStoreFileHeader *header = (const ConfigStoreFileHeader *)p->_begin;
+        p->_committed = true;
+        p->_committed_size = header->file_size;
+        p->_committed_crc = header->crc;
+
+        Impl_PublishSharedImage(p);
+
+        if (snapshot != NULL) {
+            ConfigStore_SnapshotRelease(Impl_SwapSnapshot(p, snapshot));
+        }
+    }
+
+    return 0;
+}
+
+/// <summary> Expires the per-minute commit counts older than an hour and sums the rest. </summary>
+static uint32_t Impl_WearCommitsLastHour(ConfigStoreWear *wear, uint64_t minute)
+{
+    const size_t Minutes = sizeof(wear->commits_per_minute) / sizeof(wear->commits_per_minute[0]);
+
+    if (minute - wear->last_minute >= Minutes) {
+        memset(wear->commits_per_minute, 0, sizeof(wear->commits_per_minute));
+    } else {
+        for (uint64_t m = wear->last_minute + 1; m <= minute; ++m) {
+            wear->commits_per_minute[m % Minutes] = 0;
+        }
+    }
+    wear->last_minute = minute;
+
+    uint32_t sum = 0;
+    for (size_t i = 0; i < Minutes; ++i) {
+        sum += wear->commits_per_minute[i];
+    }
+    wear->info.commits_last_hour = sum;
+    return sum;
+}
+
+/// <summary> Checks whether the throttle or the wear budget defer a commit. </summary>
+static bool Impl_WearShouldDefer(ConfigStore *p, size_t commit_size)
+{
+    if (p->_replica_type == ConfigStoreReplica_Swap) {
+        // The commit must close the store, so it can't be coalesced with a later one.
+        return false;
+    }
+
+    uint32_t last_hour = Impl_WearCommitsLastHour(&p->_wear, Impl_NowNs() / 60000000000u);
+
+    uint32_t max_per_hour = p->_options.max_commits_per_hour;
+    if ((max_per_hour != 0) && (last_hour >= max_per_hour)) {
+        return true;
+    }
+
+    ConfigStoreWearBudgetCallback budget = p->_options.wear_budget;
+    return (budget != NULL) && !budget(p->_options.wear_budget_context, &p->_wear.info, commit_size);
+}
+
+/// <summary> Accounts for a commit of a given size that reached storage. </summary>
+static void Impl_WearAddCommit(ConfigStoreWear *wear, size_t commit_size, size_t block_size)
+{
+    // Like AdjustedMaxFileSize, assume the file system keeps some bytes of each block.
+    size_t block_payload = (block_size > ConfigStoreOverheadPerStorageBlock)
+                               ? (block_size - ConfigStoreOverheadPerStorageBlock)
+                               : 1;
+
+    wear->info.logical_bytes_written += commit_size;
+    wear->info.physical_blocks_written += (commit_size + block_payload - 1) / block_payload;
+    ++wear->info.commits;
+
+    uint64_t minute = Impl_NowNs() / 60000000000u;
+    Impl_WearCommitsLastHour(wear, minute);
+    ++wear->commits_per_minute[minute % 60];
+    ++wear->info.commits_last_hour;
+}
+
+/// <summary> Writes a prepared commit and accounts for it in the stats and the wear. </summary>
+static int Impl_AccountedCommit(ConfigStore *p)
+{
+    // A swap commit closes the store, so capture what's needed for accounting beforehand.
+    size_t commit_size = Impl_ContentSize(p);
+    size_t block_size = p->_block_size;
+
+    uint64_t start = STATS_NOW();
+    int res = Impl_Commit(p);
+    if (res == 0) {
+        p->_commit_deferred = false;
+        Impl_WearAddCommit(&p->_wear, commit_size, block_size);
+        STATS_ADD(p, commits, 1);
+        STATS_LATENCY(p, commit_latency, start);
+    }
+    (void)start;
+    return res;
+}
+
+/// <summary> Completes a commit that has nothing to write. </summary>
+static int Impl_SkipCommit(ConfigStore *p)
+{
+    p->_commit_deferred = false;
+    STATS_ADD(p, commits_skipped, 1);
+    STATS_ADD(p, bytes_write_avoided, Impl_ContentSize(p));
+
+    if (p->_replica_type == ConfigStoreReplica_Swap) {
+        // Same contract as a swap commit that writes.
+        ConfigStore_Close(p);
+    }
+
+    return 0;
+}
+
+int ConfigStore_Commit(ConfigStore *p)
+{
+    if (!ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (!Impl_PrepareCommit(p)) {
+        return Impl_SkipCommit(p);
+    }
+
+    if (Impl_WearShouldDefer(p, Impl_ContentSize(p))) {
+        p->_commit_deferred = true;
+        ++p->_wear.info.deferred_commits;
+        return 0;
+    }
+
+    return Impl_AccountedCommit(p);
+}
+
+int ConfigStore_Flush(ConfigStore *p)
+{
+    if (!p->_commit_deferred) {
+        return 0;
+    }
+
+    if (!ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // The buffer may have changed since the commit was deferred.
+    return Impl_PrepareCommit(p) ? Impl_AccountedCommit(p) : Impl_SkipCommit(p);
+}
+
+int ConfigStore_SetFileVersion(ConfigStore *p, uint8_t version)
+{
+    if (!ConfigStore_InvariantsCheck(p) || !Impl_IsKnownFileVersion(version)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)p->_begin;
+    if (header->version != version) {
+        Impl_UndoTouch(p, 0, sizeof(*header));
+        header->version = version;
+        // The content may be unchanged, but the file isn't.
+        p->_committed = false;
+    }
+
+    return 0;
+}
+
+uint8_t ConfigStore_GetFileVersion(const ConfigStore *p)
+{
+    if (!ConfigStore_InvariantsCheck(p)) {
+        return p->_options.file_version;
+    }
+    return ((const ConfigStoreFileHeader *)p->_begin)->version;
+}
+
+int ConfigStore_Savepoint(ConfigStore *p)
+{
+    if (!ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (p->_undo == NULL) {
+        p->_undo = calloc(1, sizeof(*p->_undo));
+        if (p->_undo == NULL) {
+            return -1;
+        }
+    }
+    struct ConfigStoreUndoLog *log = p->_undo;
+
+    if (log->depth == log->level_capacity) {
+        size_t capacity = log->level_capacity ? (log->level_capacity * 2) : 4;
+        struct ConfigStoreUndoLevel *levels = realloc(log->levels, capacity * sizeof(*levels));
+        if (levels == NULL) {
+            return -1;
+        }
+        log->levels = levels;
+        log->level_capacity = capacity;
+    }
+
+    // Bytes an enclosing savepoint may still have to restore are saved too.
+    size_t end_size = p->_end - p->_begin;
+    size_t save_limit = end_size;
+    if ((log->depth != 0) && (log->levels[log->depth - 1].save_limit > save_limit)) {
+        save_limit = log->levels[log->depth - 1].save_limit;
+    }
+
+    size_t page_count = (save_limit + CONFIG_STORE_UNDO_PAGE_SIZE - 1) / CONFIG_STORE_UNDO_PAGE_SIZE;
+    if (page_count > log->page_count) {
+        unsigned *marks = realloc(log->marks, page_count * sizeof(*marks));
+        if (marks == NULL) {
+            return -1;
+        }
+        memset(&marks[log->page_count], 0, (page_count - log->page_count) * sizeof(*marks));
+        log->marks = marks;
+        log->page_count = page_count;
+    }
+
+    struct ConfigStoreUndoLevel *level = &log->levels[log->depth++];
+    level->id = ++log->next_id;
+    level->log_start = log->count;
+    level->end_size = end_size;
+    level->save_limit = save_limit;
+    level->padding_size = p->_padding_size;
+
+    return (int)log->depth;
+}
+
+static bool Impl_IsOpenSavepoint(const ConfigStore *p, int savepoint)
+{
+    return (p->_undo != NULL) && (savepoint >= 1) && ((size_t)savepoint <= p->_undo->depth);
+}
+
+int ConfigStore_RollbackTo(ConfigStore *p, int savepoint)
+{
+    if (!Impl_IsOpenSavepoint(p, savepoint)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct ConfigStoreUndoLog *log = p->_undo;
+    if (log->failed) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // In reverse, so the page saved first, as it was at the savepoint, is the one that stays.
+    const struct ConfigStoreUndoLevel *level = &log->levels[savepoint - 1];
+    size_t restored = level->end_size;
+    while (log->count > level->log_start) {
+        const struct ConfigStoreUndoEntry *entry = &log->entries[--log->count];
+        memcpy(&p->_begin[entry->offset], entry->data, entry->size);
+        // The savepoint stays open, so the next change saves the page again.
+        log->marks[entry->offset / CONFIG_STORE_UNDO_PAGE_SIZE] = 0;
+        if (entry->offset < restored) {
+            restored = entry->offset;
+        }
+    }
+
+    Impl_UndoPop(log, savepoint);
+    p->_end = &p->_begin[level->end_size];
+    p->_padding_size = level->padding_size;
+
+    // The bytes before the first restored one didn't change, so the index entries of the KVPs
+    // whose headers lie there still hold; only the rest of the chain is walked again.
+    size_t kept = (restored >= sizeof(ConfigStoreKvpHeader))
+                      ? Impl_IndexLowerBound(p, restored - sizeof(ConfigStoreKvpHeader) + 1)
+                      : 0;
+    size_t padding_size;
+    return Impl_IndexRebuildFrom(p, kept, &padding_size);
+}
+
+int ConfigStore_Release(ConfigStore *p, int savepoint)
+{
+    if (!Impl_IsOpenSavepoint(p, savepoint)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    Impl_UndoPop(p->_undo, savepoint - 1);
+    return 0;
+}
+
+void ConfigStore_TransactionInit(ConfigStoreTransaction *t)
+{
+    memset(t, 0, sizeof(*t));
+}
+
+int ConfigStore_TransactionBegin(ConfigStoreTransaction *t, const char *journal_path)
+{
+    if (t->_journal_path != NULL) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    t->_journal_path = strdup(journal_path);
+    return (t->_journal_path != NULL) ? 0 : -1;
+}
+
+int ConfigStore_TransactionAdd(ConfigStoreTransaction *t, ConfigStore *p)
+{
+    if ((t->_journal_path == NULL) || !ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (size_t i = 0; i < t->_count; ++i) {
+        if (t->_stores[i] == p) {
+            return 0;
+        }
+    }
+
+    if (t->_count == t->_capacity) {
+        size_t capacity = t->_capacity ? (t->_capacity * 2) : 4;
+        ConfigStore **stores = realloc(t->_stores, capacity * sizeof(*stores));
+        if (stores == NULL) {
+            return -1;
+        }
+        t->_stores = stores;
+        t->_capacity = capacity;
+    }
+
+    t->_stores[t->_count++] = p;
+    return 0;
+}
+
+/// <summary>
+/// Writes the journal of a transaction: a store that holds the path of each store that changed
+/// under an even key, and its file image under the next key.
+/// </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_WriteJournal(ConfigStoreTransaction *t, const bool *changed)
+{
+    size_t journal_size = sizeof(ConfigStoreFileHeader);
+    for (size_t i = 0; i < t->_count; ++i) {
+        if (changed[i]) {
+            // Generous for the path, the image, and the headers of their KVPs.
+            journal_size += strlen(t->_stores[i]->_primary_path) +
+                            2 * (t->_stores[i]->_end - t->_stores[i]->_begin) + 64;
+        }
+    }
+
+    ConfigStore journal;
+    ConfigStore_Init(&journal);
+    int res = ConfigStore_Open(&journal, t->_journal_path, 2 * journal_size + 4096,
+                               O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, ConfigStoreReplica_None);
+
+    ConfigStoreKey key = 0;
+    for (size_t i = 0; (res == 0) && (i < t->_count); ++i) {
+        if (!changed[i]) {
+            continue;
+        }
+
+        ConfigStore *p = t->_stores[i];
+        size_t size;
+        uint8_t *owned;
+        const uint8_t *image = Impl_FileImage(p, &size, &owned);
+
+        bool ok = (image != NULL) &&
+                  ConfigStore_PutUniqueKey(&journal, key, (const uint8_t *)p->_primary_path,
+                                           strlen(p->_primary_path)) &&
+                  ConfigStore_PutUniqueChunkedKey(&journal, key + 1, image, size);
+        free(owned);
+        res = ok ? 0 : -1;
+        key += 2;
+    }
+
+    if (res == 0) {
+        res = ConfigStore_Commit(&journal);
+    }
+    if (res == 0) {
+        // The transaction is only committed once the journal can't be lost with its directory
+        // entry.
+        res = Impl_FsyncDirectory(&journal, t->_journal_path);
+    }
+
+    int error = errno;
+    ConfigStore_Close(&journal);
+    errno = error;
+    return res;
+}
+
+int ConfigStore_TransactionCommit(ConfigStoreTransaction *t)
+{
+    if (t->_journal_path == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    bool *changed = calloc(t->_count + 1, sizeof(*changed));
+    if (changed == NULL) {
+        return -1;
+    }
+
+    size_t changed_count = 0;
+    bool changed_in_place = false;
+    for (size_t i = 0; i < t->_count; ++i) {
+        if (!ConfigStore_InvariantsCheck(t->_stores[i])) {
+            free(changed);
+            errno = EINVAL;
+            return -1;
+        }
+        changed[i] = Impl_PrepareCommit(t->_stores[i]);
+        changed_count += changed[i];
+        changed_in_place |= changed[i] && (t->_stores[i]->_replica_type == ConfigStoreReplica_None);
+    }
+
+    // A single store in swap mode is committed atomically by its rename, but a store written in
+    // place can be torn by a crash, so it needs the journal even on its own.
+    bool journaled = (changed_count > 1) || changed_in_place;
+    int res = journaled ? Impl_WriteJournal(t, changed) : 0;
+
+    // Past the journal, the transaction is committed: a failure is completed by recovery.
+    int error = (res == 0) ? 0 : errno;
+    for (size_t i = 0; (res == 0) && (i < t->_count); ++i) {
+        ConfigStore *p = t->_stores[i];
+        int store_res = changed[i] ? Impl_AccountedCommit(p) : Impl_SkipCommit(p);
+        if (store_res != 0) {
+            error = errno;
+            journaled = false;
+        }
+    }
+
+    if (journaled) {
+        // Recovery would replay a journal that outlived its transaction over later commits, so its
+        // removal must be durable too.
+        bool removed = (unlink(t->_journal_path) == 0) &&
+                       (Impl_FsyncDirectory(t->_stores[0], t->_journal_path) == 0);
+        if (!removed && (error == 0)) {
+            error = errno;
+        }
+    }
+    if (error != 0) {
+        res = -1;
+        errno = error;
+    }
+
+    free(changed);
+    return res;
+}
+
+void ConfigStore_TransactionClose(ConfigStoreTransaction *t)
+{
+    free(t->_journal_path);
+    free(t->_stores);
+    ConfigStore_TransactionInit(t);
+}
+
+/// <summary> Writes a file image recorded in a journal over the store file it belongs to. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_ReplayJournalEntry(ConfigStore *journal, const ConfigStoreKvpHeader *path_kvp,
+                                   const ConfigStoreKvpHeader *image_kvp)
+{
+    size_t path_length = path_kvp->size - sizeof(*path_kvp);
+    size_t image_size = ConfigStore_GetChunkedValueSize(journal, image_kvp);
+    char *path = malloc(path_length + 1);
+    uint8_t *image = malloc(image_size);
+
+    int res = -1;
+    if ((path != NULL) && (image != NULL) &&
+        (ConfigStore_ReadChunkedValue(journal, image_kvp, 0, image, image_size) == 0)) {
+        memcpy(path, path_kvp + 1, path_length);
+        path[path_length] = '\0';
+
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (fd >= 0) {
+            if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+                res = Impl_WriteImage(fd, journal, image, image_size);
+            }
+            int error = errno;
+            close(fd);
+            errno = error;
+        }
+    }
+
+    free(path);
+    free(image);
+    return res;
+}
+
+int ConfigStore_TransactionRecover(const char *journal_path)
+{
+    struct stat st;
+    if (stat(journal_path, &st) != 0) {
+        return (errno == ENOENT) ? 0 : -1;
+    }
+
+    ConfigStore journal;
+    ConfigStore_Init(&journal);
+    if (ConfigStore_Open(&journal, journal_path, 2 * st.st_size + 4096, O_RDONLY | O_CLOEXEC,
+                         ConfigStoreReplica_None)) {
+        if ((errno != EINVAL) && (errno != ENOENT) && (errno != ERANGE)) {
+            return -1;
+        }
+        // The journal is torn, so the transaction never committed and no store was written.
+        if (unlink(journal_path)) {
+            return -1;
+        }
+        return Impl_FsyncDirectory(&journal, journal_path);
+    }
+
+    int res = 0;
+    for (ConfigStoreKey key = 0; res == 0; key += 2) {
+        ConfigStoreKvpHeader *path_kvp = ConfigStore_TryGetKey(&journal, key);
+        ConfigStoreKvpHeader *image_kvp = ConfigStore_TryGetKey(&journal, key + 1);
+        if ((path_kvp == NULL) || (image_kvp == NULL)) {
+            break;
+        }
+        res = Impl_ReplayJournalEntry(&journal, path_kvp, image_kvp);
+    }
+
+    if ((res == 0) && (unlink(journal_path) == 0)) {
+        res = Impl_FsyncDirectory(&journal, journal_path);
+    } else {
+        res = -1;
+    }
+
+    int error = errno;
+    ConfigStore_Close(&journal);
+    errno = error;
+    return res;
+}
+
+void ConfigStore_GetWearInfo(const ConfigStore *p, ConfigStoreWearInfo *info)
+{
+    ConfigStoreWear wear = p->_wear;
+    Impl_WearCommitsLastHour(&wear, Impl_NowNs() / 60000000000u);
+    *info = wear.info;
+}
+
+ConfigStoreKvpHeader *ConfigStore_BeginKvp(const ConfigStore *p)
+{
+    return ConfigStore_GetNextKvp((ConfigStoreKvpHeader *)p->_begin,
+                                  (ConfigStoreKvpHeader *)p->_end);
+}
+
+ConfigStoreKvpHeader *ConfigStore_EndKvp(const ConfigStore *p)
+{
+    return (ConfigStoreKvpHeader *)p->_end;
+}
+
+ConfigStoreKvpHeader *ConfigStore_InsertKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos,
+                                            ConfigStoreKey key, size_t size)
+{
+    uint16_t kvp_size;
+    if (__builtin_add_overflow(size, sizeof(ConfigStoreKvpHeader), &kvp_size)) {
+        // Too large for one KVP; see ConfigStore_PutUniqueChunkedKey.
+        errno = E2BIG;
+        return NULL;
+    }
+
+    size_t in_offset = (ptrdiff_t)pos - (ptrdiff_t)p->_begin;
+
+    if (Impl_IndexReserve(p, Impl_IndexCount(p) + 1)) {
+        return NULL;
+    }
+
+    size_t i = Impl_IndexLowerBound(p, in_offset);
+    size_t gap_offset = Impl_GapOffset(p, i);
+    if (Impl_FitsPadding(in_offset - gap_offset, kvp_size)) {
+        return Impl_FillPadding(p, gap_offset, in_offset - gap_offset, key, kvp_size);
+    }
+
+    bool compacted;
+    if (Impl_ReserveTail(p, kvp_size, &compacted)) {
+        return NULL;
+    }
+
+    size_t current_size = p->_end - p->_begin;
+    if (compacted) {
+        // Insert before the same KVP.
+        in_offset = (i != Impl_IndexCount(p)) ? p->_index->offsets[i] : current_size;
+    }
+
+    uint8_t *in_pos = &p->_begin[in_offset];
+
+    Impl_UndoTouch(p, in_offset, current_size - in_offset + kvp_size);
+    memmove(&in_pos[kvp_size], in_pos, current_size - in_offset);
+    STATS_ADD(p, bytes_moved, current_size - in_offset);
+
+    ConfigStoreKvpHeader *pKvp = (ConfigStoreKvpHeader *)(in_pos);
+    pKvp->size = kvp_size;
+    pKvp->key = key;
+
+    p->_end += kvp_size;
+
+    Impl_IndexInsert(p, i, key, in_offset, kvp_size);
+
+    return pKvp;
+}
+
+/// <summary>
+/// Inserts a KVP in the first padding it fits in, or at the end of the store if there's none.
+/// For KVPs whose position doesn't matter.
+/// </summary>
+static ConfigStoreKvpHeader *Impl_InsertAnywhere(ConfigStore *p, ConfigStoreKey key, size_t size)
+{
+    size_t kvp_size = size + sizeof(ConfigStoreKvpHeader);
+
+    if ((p->_padding_size >= kvp_size) && (kvp_size <= UINT16_MAX)) {
+        if (Impl_IndexReserve(p, Impl_IndexCount(p) + 1)) {
+            return NULL;
+        }
+
+        ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+        for (ConfigStoreKvpHeader *it =
+                 Impl_GetNextRawKvp((ConfigStoreKvpHeader *)p->_begin, it_end);
+             it != it_end; it = Impl_GetNextRawKvp(it, it_end)) {
+            if ((it->key == ConfigStorePaddingKey) && Impl_FitsPadding(it->size, kvp_size)) {
+                return Impl_FillPadding(p, (uint8_t *)it - p->_begin, it->size, key, kvp_size);
+            }
+        }
+    }
+
+    return ConfigStore_InsertKvp(p, ConfigStore_EndKvp(p), key, size);
+}
+
+/// <summary> Finds the index of the first KVP with a given key, starting at index first. </summary>
+static size_t Impl_FindKeyIndex(const ConfigStore *p, ConfigStoreKey key, size_t first)
+{
+    size_t count = Impl_IndexCount(p);
+    if (first >= count) {
+        return count;
+    }
+
+    size_t i = Impl_ScanKey(p->_index->keys, first, count, key);
+    STATS_ADD_HOPS(p, ((i < count) ? (i + 1) : count) - first);
+    return i;
+}
+
+/// <summary>
+/// Finds the index of the first KVP with a given key, consulting the Bloom filter first so
+/// definite misses don't scan the keys.
+/// </summary>
+static size_t Impl_LookupKeyIndex(const ConfigStore *p, ConfigStoreKey key)
+{
+    struct ConfigStoreKeyIndex *index = p->_index;
+    if (index == NULL) {
+        return 0;
+    }
+
+    __atomic_add_fetch(&index->bloom_stats.lookups, 1, __ATOMIC_RELAXED);
+    if (!Impl_BloomMayContain(index, key)) {
+        __atomic_add_fetch(&index->bloom_stats.filtered, 1, __ATOMIC_RELAXED);
+        return index->count;
+    }
+
+    size_t i = Impl_FindKeyIndex(p, key, 0);
+    if (i == index->count) {
+        __atomic_add_fetch(&index->bloom_stats.false_positives, 1, __ATOMIC_RELAXED);
+    }
+    return i;
+}
+
+ConfigStoreKvpHeader *ConfigStore_TryGetKey(const ConfigStore *p, ConfigStoreKey key)
+{
+    size_t i = Impl_LookupKeyIndex(p, key);
+    return (i != Impl_IndexCount(p)) ? Impl_IndexKvp(p, i) : NULL;
+}
+
+void ConfigStore_GetLookupFilterStats(const ConfigStore *p, ConfigStoreLookupFilterStats *stats)
+{
+    if (p->_index != NULL) {
+        const ConfigStoreLookupFilterStats *counters = &p->_index->bloom_stats;
+        stats->lookups = __atomic_load_n(&counters->lookups, __ATOMIC_RELAXED);
+        stats->filtered = __atomic_load_n(&counters->filtered, __ATOMIC_RELAXED);
+        stats->false_positives = __atomic_load_n(&counters->false_positives, __ATOMIC_RELAXED);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
+}
+
+/// <summary>
+/// Resizes a KVP without moving it or the KVPs after it: shrinking leaves padding behind, and
+/// growing takes over the padding or the free capacity right after the KVP.
+/// </summary>
+/// <returns> The resized KVP; or NULL if it can't be resized in place. </returns>
+static ConfigStoreKvpHeader *Impl_ResizeInPlace(ConfigStore *p, ConfigStoreKvpHeader *it,
+                                                uint16_t kvp_size)
+{
+    size_t offset = (uint8_t *)it - p->_begin;
+    size_t old_size = it->size;
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    ConfigStoreKvpHeader *next = Impl_GetNextRawKvp(it, it_end);
+    bool next_is_padding = (next != it_end) && (next->key == ConfigStorePaddingKey);
+
+    if ((next != it_end) && Impl_IsTrailerKey(next->key)) {
+        // The value is chunked or has extensions: let it be erased as a whole.
+        return NULL;
+    }
+
+    // The KVP, and the header of the padding that may follow it.
+    Impl_UndoTouch(p, offset,
+                   ((kvp_size > old_size) ? kvp_size : old_size) + sizeof(ConfigStoreKvpHeader));
+
+    if ((kvp_size < old_size) && (next == it_end)) {
+        // Last KVP: just give the bytes back.
+        it->size = kvp_size;
+        p->_end -= old_size - kvp_size;
+    } else if (kvp_size < old_size) {
+        size_t freed = old_size - kvp_size;
+        p->_padding_size += freed;
+        if (freed < sizeof(ConfigStoreKvpHeader)) {
+            // Too small to be padding on its own: it must be merged into the padding that follows.
+            if (!next_is_padding || (freed + next->size > UINT16_MAX)) {
+                p->_padding_size -= freed;
+                return NULL;
+            }
+            freed += next->size;
+        }
+        it->size = kvp_size;
+        Impl_MakePadding(p, offset + kvp_size, freed);
+    } else if (kvp_size > old_size) {
+        size_t needed = kvp_size - old_size;
+        if (next == it_end) {
+            // Last KVP: grow the buffer, which doesn't move anything.
+            if (ConfigStore_ReserveCapacity(p, (p->_end - p->_begin) + needed)) {
+                return NULL;
+            }
+            it = (ConfigStoreKvpHeader *)&p->_begin[offset];
+            p->_end += needed;
+        } else if (next_is_padding && (next->size == needed)) {
+            // Take over the whole padding.
+        } else if (next_is_padding && (next->size >= needed + sizeof(ConfigStoreKvpHeader))) {
+            // Take over the front of the padding.
+            uint16_t pad_size = next->size - needed;
+            ConfigStoreKvpHeader *pad = (ConfigStoreKvpHeader *)((uint8_t *)next + needed);
+            pad->key = ConfigStorePaddingKey;
+            pad->size = pad_size;
+        } else {
+            return NULL;
+        }
+        if (next_is_padding) {
+            p->_padding_size -= needed;
+        }
+        it->size = kvp_size;
+    }
+
+    return it;
+}
+
+ConfigStoreKvpHeader *ConfigStore_PutUniqueKey(ConfigStore *p, ConfigStoreKey key,
+                                               const uint8_t *optional_data, size_t value_size)
+{
+    ConfigStoreKvpHeader *it = NULL;
+
+    uint16_t kvp_size;
+    if (__builtin_add_overflow(value_size, sizeof(ConfigStoreKvpHeader), &kvp_size)) {
+        errno = E2BIG;
+        return NULL;
+    }
+
+    // For all matching keys.
+    for (size_t i = Impl_LookupKeyIndex(p, key); i != Impl_IndexCount(p);
+         i = Impl_FindKeyIndex(p, key, i)) {
+        it = Impl_ResizeInPlace(p, Impl_IndexKvp(p, i), kvp_size);
+        if (it == NULL) {
+            // Can't be resized in place. Erase KVP and continue with next.
+            ConfigStore_EraseKvp(p, Impl_IndexKvp(p, i));
+            continue;
+        }
+
+        // Reuse the KVP and erase any other occurrences of the same key after it, just in case.
+        size_t i_erase = i + 1;
+        while (i_erase = Impl_FindKeyIndex(p, key, i_erase), i_erase != Impl_IndexCount(p)) {
+            ConfigStore_EraseKvp(p, Impl_IndexKvp(p, i_erase));
+        }
+        it = Impl_IndexKvp(p, i);
+        break;
+    }
+
+    if (it == NULL) {
+        it = Impl_InsertAnywhere(p, key, value_size);
+        if ((it == NULL) || (it == ConfigStore_EndKvp(p))) {
+            // Space exhaustion.
+            return NULL;
+        }
+    }
+
+    if (optional_data != NULL) {
+        ConfigStore_WriteValue(it, 0, optional_data, value_size);
+    }
+
+    return it;
+}
+
+/// <summary> Finds an extension of a given type among the trailers of a KVP. </summary>
+/// <returns> The extension; or NULL if the KVP has none of at least <paramref name="size" /> bytes.
+/// </returns>
+static const ConfigStoreKvpHeader *Impl_FindExtension(const ConfigStore *p,
+                                                      const ConfigStoreKvpHeader *pos, uint8_t type,
+                                                      size_t size)
+{
+    const ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    for (const ConfigStoreKvpHeader *it = Impl_GetNextRawKvp(pos, it_end);
+         (it != it_end) && Impl_IsTrailerKey(it->key); it = Impl_GetNextRawKvp(it, it_end)) {
+        // The type follows the header of every extension.
+        if ((it->key == ConfigStoreExtensionKey) && (it->size >= size) &&
+            (((const uint8_t *)it)[sizeof(*it)] == type)) {
+            return it;
+        }
+    }
+    return NULL;
+}
+
+/// <summary> Finds the shared value with a given hash among the trailers of the file header. </summary>
+static ConfigStoreSharedValue *Impl_FindSharedValue(const ConfigStore *p, uint32_t hash)
+{
+    const ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    for (const ConfigStoreKvpHeader *it = Impl_GetNextRawKvp((ConfigStoreKvpHeader *)p->_begin, it_end);
+         (it != it_end) && Impl_IsTrailerKey(it->key); it = Impl_GetNextRawKvp(it, it_end)) {
+        const ConfigStoreSharedValue *shared = (const ConfigStoreSharedValue *)it;
+        if ((it->key == ConfigStoreExtensionKey) && (it->size >= sizeof(*shared)) &&
+            (shared->type == ConfigStoreExtension_SharedValue) && (shared->hash == hash)) {
+            return (ConfigStoreSharedValue *)shared;
+        }
+    }
+    return NULL;
+}
+
+/// <summary>
+/// Adds an unreferenced shared value after the other trailers of the file header, moving the KVPs
+/// after them. Invalidates pointers to KVPs.
+/// </summary>
+static ConfigStoreSharedValue *Impl_InsertSharedValue(ConfigStore *p, uint32_t hash,
+                                                      const uint8_t *data, size_t size)
+{
+    size_t kvp_size = sizeof(ConfigStoreSharedValue) + size;
+
+    bool compacted;
+    if (Impl_ReserveTail(p, kvp_size, &compacted)) {
+        return NULL;
+    }
+
+    size_t offset = Impl_GapOffset(p, 0);
+    size_t tail = (p->_end - p->_begin) - offset;
+    Impl_UndoTouch(p, offset, tail + kvp_size);
+    memmove(&p->_begin[offset + kvp_size], &p->_begin[offset], tail);
+    STATS_ADD(p, bytes_moved, tail);
+    p->_end += kvp_size;
+    Impl_IndexShiftAll(p, kvp_size);
+
+    ConfigStoreSharedValue *shared = (ConfigStoreSharedValue *)&p->_begin[offset];
+    shared->header.key = ConfigStoreExtensionKey;
+    shared->header.size = kvp_size;
+    shared->type = ConfigStoreExtension_SharedValue;
+    shared->flags = 0;
+    shared->hash = hash;
+    shared->refs = 0;
+    memcpy(shared + 1, data, size);
+
+    return shared;
+}
+
+/// <summary>
+/// Drops a reference to the shared value with a given hash, and removes the value along with the
+/// last reference. Only the trailers of the file header after the value move back: the room they
+/// leave before the first KVP becomes padding, so the KVPs don't move.
+/// </summary>
+static void Impl_ReleaseSharedValue(ConfigStore *p, uint32_t hash)
+{
+    ConfigStoreSharedValue *shared = Impl_FindSharedValue(p, hash);
+    if (shared == NULL) {
+        return;
+    }
+    size_t offset = (uint8_t *)shared - p->_begin;
+    Impl_UndoTouch(p, offset, sizeof(*shared));
+    if (--shared->refs != 0) {
+        return;
+    }
+
+    // Padding among the trailers would end them, so it goes after the last one.
+    size_t kvp_size = shared->header.size;
+    size_t trailers_end = Impl_GapOffset(p, 0);
+    size_t tail = trailers_end - (offset + kvp_size);
+    Impl_UndoTouch(p, offset, trailers_end - offset);
+    memmove(shared, (uint8_t *)shared + kvp_size, tail);
+    STATS_ADD(p, bytes_moved, tail);
+
+    if (&p->_begin[trailers_end] == p->_end) {
+        p->_end -= kvp_size;
+    } else {
+        Impl_MakePadding(p, trailers_end - kvp_size, kvp_size);
+        p->_padding_size += kvp_size;
+    }
+}
+
+ConfigStoreKvpHeader *ConfigStore_EraseKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos)
+{
+    const ConfigStoreValueReference *reference =
+        (const ConfigStoreValueReference *)Impl_FindExtension(
+            p, pos, ConfigStoreExtension_Reference, sizeof(ConfigStoreValueReference));
+    if (reference != NULL) {
+        Impl_ReleaseSharedValue(p, reference->hash);
+    }
+
+    // A chunked value goes along with its trailers.
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    ConfigStoreKvpHeader *next = Impl_SkipTrailers(Impl_GetNextRawKvp(pos, it_end), it_end);
+    size_t size = (uint8_t *)next - (uint8_t *)pos;
+    size_t offset = (uint8_t *)pos - p->_begin;
+    bool last = (next == it_end);
+
+    size_t i = Impl_IndexLowerBound(p, offset);
+    if ((i != Impl_IndexCount(p)) && (p->_index->offsets[i] == offset)) {
+        Impl_IndexErase(p, i, 0);
+    }
+
+    if (last) {
+        // Drop the KVP along with any padding before it.
+        size_t end_offset = Impl_GapOffset(p, Impl_IndexCount(p));
+        p->_padding_size -= offset - end_offset;
+        p->_end = &p->_begin[end_offset];
+        return ConfigStore_EndKvp(p);
+    }
+
+    // Leave a hole rather than moving the KVPs after it.
+    Impl_MakePadding(p, offset, size);
+    p->_padding_size += size;
+
+    if (Impl_ShouldCompact(p)) {
+        // The index position of the following KVP survives compaction; its pointer doesn't.
+        Impl_Compact(p);
+        return (i != Impl_IndexCount(p)) ? Impl_IndexKvp(p, i) : ConfigStore_EndKvp(p);
+    }
+
+    return Impl_SkipHidden(pos, ConfigStore_EndKvp(p));
+}
+
+ConfigStoreKvpHeader *ConfigStore_AllocUniqueKvp(ConfigStore *p, ConfigStoreKey first_key,
+                                                 ConfigStoreKey last_key, size_t value_size,
+                                                 ConfigStoreKey key_increment)
+{
+    while (first_key < last_key) {
+
+        bool found = (Impl_LookupKeyIndex(p, first_key) != Impl_IndexCount(p));
+        if (!found) {
+            break;
+        }
+
+        if (__builtin_add_overflow(first_key, key_increment, &first_key)) {
+            errno = ENOENT;
+            return NULL;
+        }
+    }
+
+    if (first_key >= last_key) {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return Impl_InsertAnywhere(p, first_key, value_size);
+}
+
+/// <summary> Finds the index of the first KVP at or after index first matching a key range. </summary>
+static size_t Impl_FindKeyInRangeIndex(const ConfigStore *p, size_t first, ConfigStoreKey first_key,
+                                       ConfigStoreKey last_key, ConfigStoreKey key_increment)
+{
+    size_t count = Impl_IndexCount(p);
+    if (first >= count) {
+        return count;
+    }
+
+    size_t i = Impl_ScanKeyRange(p->_index->keys, first, count, first_key, last_key, key_increment);
+    STATS_ADD_HOPS(p, ((i < count) ? (i + 1) : count) - first);
+    return i;
+}
+
+int ConfigStore_EraseKeysInRange(ConfigStore *p, ConfigStoreKey first_key, ConfigStoreKey last_key,
+                                 ConfigStoreKey key_increment)
+{
+    bool good_args = (p) && (first_key <= last_key) && (1 <= key_increment);
+    if (!good_args) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t i = 0;
+    while (i = Impl_FindKeyInRangeIndex(p, i, first_key, last_key, key_increment),
+           i != Impl_IndexCount(p)) {
+        ConfigStore_EraseKvp(p, Impl_IndexKvp(p, i));
+    }
+
+    return 0;
+}
+
+ConfigStoreKvpHeader *ConfigStore_GetNextKvpInRange(ConfigStore *p, const ConfigStoreKvpHeader *pos,
+                                                    ConfigStoreKey first_key,
+                                                    ConfigStoreKey last_key,
+                                                    ConfigStoreKey key_increment)
+{
+    // Start with the first indexed KVP after the current one.
+    size_t i = pos ? Impl_IndexLowerBound(p, (uint8_t *)pos - p->_begin + 1) : 0;
+
+    i = Impl_FindKeyInRangeIndex(p, i, first_key, last_key, key_increment);
+
+    return (i != Impl_IndexCount(p)) ? Impl_IndexKvp(p, i) : ConfigStore_EndKvp(p);
+}
+
+size_t ConfigStore_GetIndexedKeys(const ConfigStore *p, const ConfigStoreKey **keys)
+{
+    *keys = p->_index ? p->_index->keys : NULL;
+    return Impl_IndexCount(p);
+}
+
+ConfigStoreKvpHeader *ConfigStore_GetIndexedKvp(const ConfigStore *p, size_t i)
+{
+    return Impl_IndexKvp(p, i);
+}
+
+int ConfigStore_WriteValue(ConfigStoreKvpHeader *pos, size_t offset, const void *data, size_t size)
+{
+    size_t hdr_size = pos ? sizeof(*pos) : 0;
+    size_t dst_size = (pos && (pos->size > sizeof(*pos))) ? (pos->size - sizeof(*pos)) : 0;
+
+    uint8_t *dst_data = (uint8_t *)pos + hdr_size + offset;
+
+    size_t last_offset = offset + size;
+    if (dst_size < last_offset) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    memcpy(dst_data, (uint8_t *)data, size);
+    memset(dst_data + size, 0, dst_size - last_offset);
+
+    return 0;
+}
+
+/// <summary>
+/// Replaces the KVPs of a key with a value appended at the end of the store, split into chunks as
+/// needed and followed by an extension, if any.
+/// </summary>
+static ConfigStoreKvpHeader *Impl_AppendRun(ConfigStore *p, ConfigStoreKey key,
+                                            const uint8_t *optional_data, size_t value_size,
+                                            const ConfigStoreKvpHeader *extension)
+{
+    size_t chunk_count = (value_size + ConfigStoreMaxKvpValueSize - 1) / ConfigStoreMaxKvpValueSize;
+    if (chunk_count == 0) {
+        chunk_count = 1;
+    }
+    size_t run_size = value_size + chunk_count * sizeof(ConfigStoreKvpHeader) +
+                      (extension ? extension->size : 0);
+
+    size_t i = Impl_LookupKeyIndex(p, key);
+    while (i != Impl_IndexCount(p)) {
+        ConfigStore_EraseKvp(p, Impl_IndexKvp(p, i));
+        i = Impl_FindKeyIndex(p, key, i);
+    }
+
+    // The run must be contiguous, so it always goes to the end of the store.
+    bool compacted;
+    if (Impl_IndexReserve(p, Impl_IndexCount(p) + 1) || Impl_ReserveTail(p, run_size, &compacted)) {
+        return NULL;
+    }
+
+    size_t offset = p->_end - p->_begin;
+    Impl_UndoTouch(p, offset, run_size);
+    ConfigStoreKey chunk_key = key;
+    size_t left = value_size;
+    for (size_t chunk_index = 0; chunk_index < chunk_count; ++chunk_index) {
+        size_t chunk_size = (left < ConfigStoreMaxKvpValueSize) ? left : ConfigStoreMaxKvpValueSize;
+        ConfigStoreKvpHeader *chunk = (ConfigStoreKvpHeader *)p->_end;
+        chunk->key = chunk_key;
+        chunk->size = chunk_size + sizeof(ConfigStoreKvpHeader);
+        if (optional_data != NULL) {
+            memcpy(chunk + 1, optional_data, chunk_size);
+            optional_data += chunk_size;
+        }
+        p->_end += chunk->size;
+        left -= chunk_size;
+        chunk_key = ConfigStoreContinuationKey;
+    }
+
+    if (extension != NULL) {
+        memcpy(p->_end, extension, extension->size);
+        p->_end += extension->size;
+    }
+
+    Impl_IndexInsert(p, Impl_IndexCount(p), key, offset, 0);
+
+    return (ConfigStoreKvpHeader *)&p->_begin[offset];
+}
+
+ConfigStoreKvpHeader *ConfigStore_PutUniqueChunkedKey(ConfigStore *p, ConfigStoreKey key,
+                                                      const uint8_t *optional_data,
+                                                      size_t value_size)
+{
+    if (value_size <= ConfigStoreMaxKvpValueSize) {
+        return ConfigStore_PutUniqueKey(p, key, optional_data, value_size);
+    }
+
+    return Impl_AppendRun(p, key, optional_data, value_size, NULL);
+}
+
+size_t ConfigStore_GetChunkedValueSize(const ConfigStore *p, const ConfigStoreKvpHeader *pos)
+{
+    const ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    size_t size = pos->size - sizeof(ConfigStoreKvpHeader);
+
+    for (const ConfigStoreKvpHeader *chunk = Impl_GetNextRawKvp(pos, it_end);
+         (chunk != it_end) && (chunk->key == ConfigStoreContinuationKey);
+         chunk = Impl_GetNextRawKvp(chunk, it_end)) {
+        size += chunk->size - sizeof(ConfigStoreKvpHeader);
+    }
+
+    return size;
+}
+
+/// <summary> Saves a KVP and its trailers for the innermost savepoint before writing the value. </summary>
+static void Impl_UndoTouchValue(ConfigStore *p, const ConfigStoreKvpHeader *pos)
+{
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    ConfigStoreKvpHeader *next = Impl_SkipTrailers(Impl_GetNextRawKvp(pos, it_end), it_end);
+    Impl_UndoTouch(p, (const uint8_t *)pos - p->_begin, (uint8_t *)next - (const uint8_t *)pos);
+}
+
+static void Impl_CursorInit(ConfigStoreValueCursor *c, const ConfigStore *p,
+                            const ConfigStoreKvpHeader *pos)
+{
+    c->_head = pos;
+    c->_chunk = pos;
+    c->_end = ConfigStore_EndKvp(p);
+    c->_chunk_offset = 0;
+}
+
+/// <summary>
+/// Gets the bytes of the value that are contiguous at the cursor, moving on to the next chunk if
+/// the current one is used up.
+/// </summary>
+/// <returns> The number of bytes at <paramref name="data" />; 0 at the end of the value. </returns>
+static size_t Impl_CursorSpan(ConfigStoreValueCursor *c, uint8_t **data)
+{
+    for (;;) {
+        size_t chunk_size = c->_chunk->size - sizeof(ConfigStoreKvpHeader);
+        if (c->_chunk_offset < chunk_size) {
+            *data = (uint8_t *)(c->_chunk + 1) + c->_chunk_offset;
+            return chunk_size - c->_chunk_offset;
+        }
+
+        const ConfigStoreKvpHeader *next = Impl_GetNextRawKvp(c->_chunk, c->_end);
+        if ((next == c->_end) || (next->key != ConfigStoreContinuationKey)) {
+            *data = NULL;
+            return 0;
+        }
+        c->_chunk = next;
+        c->_chunk_offset = 0;
+    }
+}
+
+/// <summary> Moves the cursor forward, stopping at the end of the value. </summary>
+/// <returns> The number of bytes the cursor moved. </returns>
+static size_t Impl_CursorAdvance(ConfigStoreValueCursor *c, size_t size)
+{
+    size_t advanced = 0;
+    while (advanced < size) {
+        uint8_t *data;
+        size_t span = Impl_CursorSpan(c, &data);
+        if (span == 0) {
+            break;
+        }
+        if (span > size - advanced) {
+            span = size - advanced;
+        }
+        c->_chunk_offset += span;
+        advanced += span;
+    }
+    return advanced;
+}
+
+static int Impl_CursorSeek(ConfigStoreValueCursor *c, size_t offset)
+{
+    c->_chunk = c->_head;
+    c->_chunk_offset = 0;
+    if (Impl_CursorAdvance(c, offset) != offset) {
+        errno = E2BIG;
+        return -1;
+    }
+    return 0;
+}
+
+/// <summary>
+/// Copies bytes between the value at a cursor and a buffer, in the direction given by
+/// <paramref name="write" />, and moves the cursor past them.
+/// </summary>
+/// <returns> The number of bytes copied, which is less than asked at the end of the value. </returns>
+static size_t Impl_CursorCopy(ConfigStoreValueCursor *c, uint8_t *data, size_t size, bool write)
+{
+    size_t copied = 0;
+    while (copied < size) {
+        uint8_t *value;
+        size_t span = Impl_CursorSpan(c, &value);
+        if (span == 0) {
+            break;
+        }
+        if (span > size - copied) {
+            span = size - copied;
+        }
+        if (write) {
+            memcpy(value, data + copied, span);
+        } else {
+            memcpy(data + copied, value, span);
+        }
+        c->_chunk_offset += span;
+        copied += span;
+    }
+    return copied;
+}
+
+/// <summary> Copies all of a range of a chunked value, or nothing if it's past the end. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_CopyChunked(const ConfigStore *p, const ConfigStoreKvpHeader *pos, size_t offset,
+                            uint8_t *data, size_t size, bool write)
+{
+    size_t last_offset;
+    if (__builtin_add_overflow(offset, size, &last_offset) ||
+        (last_offset > ConfigStore_GetChunkedValueSize(p, pos))) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    ConfigStoreValueCursor c;
+    Impl_CursorInit(&c, p, pos);
+    Impl_CursorAdvance(&c, offset);
+    Impl_CursorCopy(&c, data, size, write);
+
+    return 0;
+}
+
+int ConfigStore_WriteChunkedValue(ConfigStore *p, ConfigStoreKvpHeader *pos, size_t offset,
+                                  const void *data, size_t size)
+{
+    Impl_UndoTouchValue(p, pos);
+    return Impl_CopyChunked(p, pos, offset, (uint8_t *)data, size, true);
+}
+
+int ConfigStore_ReadChunkedValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos,
+                                 size_t offset, void *data, size_t size)
+{
+    return Impl_CopyChunked(p, pos, offset, data, size, false);
+}
+
+/// <summary> Bits of the hash of the compressor, which has one slot per hash. </summary>
+#define CONFIG_STORE_LZ_HASH_BITS 12
+/// <summary> Shortest match the compressor encodes. </summary>
+#define CONFIG_STORE_LZ_MIN_MATCH 4
+/// <summary> Bytes of the hash table of the compressor. </summary>
+#define CONFIG_STORE_LZ_TABLE_SIZE ((1u << CONFIG_STORE_LZ_HASH_BITS) * sizeof(uint32_t))
+
+/// <summary>
+/// Appends a token-encoded length (the part that didn't fit in the 4 bits of the token) to the
+/// compressed output.
+/// </summary>
+/// <returns> false if the output is full. </returns>
+static bool Impl_LzPutLength(uint8_t **op, const uint8_t *oend, size_t length)
+{
+    for (; length >= 255; length -= 255) {
+        if (*op == oend) {
+            return false;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op == oend) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)length;
+    return true;
+}
+
+/// <summary>
+/// Appends a sequence to the compressed output: literals followed by a match, if
+/// <paramref name="match_length" /> isn't zero.
+/// </summary>
+/// <returns> false if the output is full. </returns>
+static bool Impl_LzPutSequence(uint8_t **op, const uint8_t *oend, const uint8_t *literals,
+                               size_t literal_length, size_t offset, size_t match_length)
+{
+    size_t match_code = match_length ? (match_length - CONFIG_STORE_LZ_MIN_MATCH) : 0;
+    if (*op == oend) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)(((literal_length < 15 ? literal_length : 15) << 4) |
+                         (match_code < 15 ? match_code : 15));
+
+    if ((literal_length >= 15) && !Impl_LzPutLength(op, oend, literal_length - 15)) {
+        return false;
+    }
+    if ((size_t)(oend - *op) < literal_length) {
+        return false;
+    }
+    memcpy(*op, literals, literal_length);
+    *op += literal_length;
+
+    if (match_length == 0) {
+        return true;
+    }
+    if (oend - *op < 2) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)offset;
+    *(*op)++ = (uint8_t)(offset >> 8);
+    return (match_code < 15) || Impl_LzPutLength(op, oend, match_code - 15);
+}
+
+static uint32_t Impl_LzRead32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+/// <summary>
+/// Compresses a buffer in the LZ4 block style: sequences of a token (literal and match lengths),
+/// literals, and a 16-bit match offset. The last sequence has no match. Doesn't allocate memory.
+/// </summary>
+/// <param name="table"> CONFIG_STORE_LZ_TABLE_SIZE bytes for the hash table. </param>
+/// <returns> The compressed size; 0 if it would exceed <paramref name="out_size" />. </returns>
+static size_t Impl_LzCompress(const uint8_t *in, size_t in_size, uint8_t *out, size_t out_size,
+                              uint32_t *table)
 {
-    if (file_size <= ConfigStoreOverheadPerStorageBlock) {
+    memset(table, 0, CONFIG_STORE_LZ_TABLE_SIZE);
+
+    uint8_t *op = out;
+    const uint8_t *oend = out + out_size;
+    size_t anchor = 0;
+    size_t ip = 0;
+
+    while (ip + CONFIG_STORE_LZ_MIN_MATCH <= in_size) {
+        uint32_t sequence = Impl_LzRead32(&in[ip]);
+        uint32_t hash = (sequence * 2654435761u) >> (32 - CONFIG_STORE_LZ_HASH_BITS);
+        size_t ref = table[hash];
+        table[hash] = ip;
+
+        if ((ref >= ip) || (ip - ref > UINT16_MAX) || (Impl_LzRead32(&in[ref]) != sequence)) {
+            ++ip;
+            continue;
+        }
+
+        size_t match_length = CONFIG_STORE_LZ_MIN_MATCH;
+        while ((ip + match_length < in_size) && (in[ref + match_length] == in[ip + match_length])) {
+            ++match_length;
+        }
+
+        if (!Impl_LzPutSequence(&op, oend, &in[anchor], ip - anchor, ip - ref, match_length)) {
+            return 0;
+        }
+        ip += match_length;
+        anchor = ip;
+    }
+
+    if (!Impl_LzPutSequence(&op, oend, &in[anchor], in_size - anchor, 0, 0)) {
+        return 0;
+    }
+    return op - out;
+}
+
+/// <summary> Reads a byte of a compressed value, across its chunks. </summary>
+static bool Impl_LzGetByte(ConfigStoreValueCursor *c, uint8_t *value)
+{
+    uint8_t *data;
+    if (Impl_CursorSpan(c, &data) == 0) {
+        return false;
+    }
+    *value = *data;
+    ++c->_chunk_offset;
+    return true;
+}
+
+/// <summary> Reads the part of a length that didn't fit in the 4 bits of the token. </summary>
+static bool Impl_LzGetLength(ConfigStoreValueCursor *c, size_t *length)
+{
+    uint8_t byte;
+    do {
+        if (!Impl_LzGetByte(c, &byte)) {
+            return false;
+        }
+        *length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+/// <summary> Decompresses the output of Impl_LzCompress, reading it across chunks. </summary>
+/// <returns> 0 on success; -1 with errno set to EBADMSG if the input is corrupt. </returns>
+static int Impl_LzDecompress(ConfigStoreValueCursor *c, uint8_t *out, size_t out_size)
+{
+    size_t op = 0;
+    for (;;) {
+        uint8_t token;
+        if (!Impl_LzGetByte(c, &token)) {
+            break;
+        }
+
+        size_t literal_length = token >> 4;
+        if ((literal_length == 15) && !Impl_LzGetLength(c, &literal_length)) {
+            break;
+        }
+        if ((literal_length > out_size - op) ||
+            (Impl_CursorCopy(c, &out[op], literal_length, false) != literal_length)) {
+            break;
+        }
+        op += literal_length;
+
+        if (op == out_size) {
+            return 0;
+        }
+
+        uint8_t offset_bytes[2];
+        if (Impl_CursorCopy(c, offset_bytes, sizeof(offset_bytes), false) != sizeof(offset_bytes)) {
+            break;
+        }
+        size_t offset = offset_bytes[0] | ((size_t)offset_bytes[1] << 8);
+        size_t match_length = token & 0x0F;
+        if ((match_length == 15) && !Impl_LzGetLength(c, &match_length)) {
+            break;
+        }
+        match_length += CONFIG_STORE_LZ_MIN_MATCH;
+        if ((offset == 0) || (offset > op) || (match_length > out_size - op)) {
+            break;
+        }
+
+        // Byte by byte: the match may overlap the bytes it produces.
+        for (size_t i = 0; i < match_length; ++i, ++op) {
+            out[op] = out[op - offset];
+        }
+    }
+
+    errno = EBADMSG;
+    return -1;
+}
+
+/// <summary> Finds the attributes of a value among its trailers. </summary>
+/// <returns> The attributes; or NULL if the value has none. </returns>
+static const ConfigStoreValueAttributes *Impl_FindAttributes(const ConfigStore *p,
+                                                             const ConfigStoreKvpHeader *pos)
+{
+    return (const ConfigStoreValueAttributes *)Impl_FindExtension(
+        p, pos, ConfigStoreExtension_Attributes, sizeof(ConfigStoreValueAttributes));
+}
+
+/// <summary> Finds the shared value a value references. </summary>
+/// <returns> The shared value; or NULL if the value isn't shared. </returns>
+static const ConfigStoreSharedValue *Impl_FindReferencedValue(const ConfigStore *p,
+                                                              const ConfigStoreKvpHeader *pos)
+{
+    const ConfigStoreValueReference *reference =
+        (const ConfigStoreValueReference *)Impl_FindExtension(
+            p, pos, ConfigStoreExtension_Reference, sizeof(ConfigStoreValueReference));
+    return reference ? Impl_FindSharedValue(p, reference->hash) : NULL;
+}
+
+/// <summary>
+/// Gets a work area of at least a given size. The store keeps it until it's closed, so operations
+/// that need scratch memory, like compression, don't allocate it on every call.
+/// </summary>
+/// <returns> The work area; NULL on failure with error indication in errno. </returns>
+static uint8_t *Impl_WorkArea(ConfigStore *p, size_t size)
+{
+    if (size > p->_work_size) {
+        uint8_t *work = realloc(p->_work, size);
+        if (work == NULL) {
+            return NULL;
+        }
+        p->_work = work;
+        p->_work_size = size;
+    }
+    return p->_work;
+}
+
+bool ConfigStore_IsPlainValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos)
+{
+    const ConfigStoreValueAttributes *attributes = Impl_FindAttributes(p, pos);
+    return (Impl_FindReferencedValue(p, pos) == NULL) &&
+           ((attributes == NULL) || !(attributes->flags & ConfigStoreValue_Compressed));
+}
+
+ConfigStoreKvpHeader *ConfigStore_PutValue(ConfigStore *p, ConfigStoreKey key, const uint8_t *data,
+                                           size_t size)
+{
+    size_t threshold = p->_options.compress_threshold;
+    if ((threshold == 0) || (size < threshold) || (size > UINT32_MAX) ||
+        (size <= sizeof(ConfigStoreValueAttributes) + 1)) {
+        return ConfigStore_PutUniqueChunkedKey(p, key, data, size);
+    }
+
+    // Only keep the compressed value if it saves more than its attributes cost.
+    size_t max_compressed_size = size - sizeof(ConfigStoreValueAttributes) - 1;
+
+    uint8_t *work = Impl_WorkArea(p, CONFIG_STORE_LZ_TABLE_SIZE + max_compressed_size);
+    if (work == NULL) {
+        return NULL;
+    }
+    uint8_t *compressed = work + CONFIG_STORE_LZ_TABLE_SIZE;
+
+    ConfigStoreKvpHeader *kvp;
+    size_t compressed_size =
+        Impl_LzCompress(data, size, compressed, max_compressed_size, (uint32_t *)work);
+    if (compressed_size == 0) {
+        kvp = ConfigStore_PutUniqueChunkedKey(p, key, data, size);
+    } else {
+        ConfigStoreValueAttributes attributes = {
+            .header = {.key = ConfigStoreExtensionKey, .size = sizeof(attributes)},
+            .type = ConfigStoreExtension_Attributes,
+            .flags = ConfigStoreValue_Compressed,
+            .raw_size = size,
+        };
+        kvp = Impl_AppendRun(p, key, compressed, compressed_size, &attributes.header);
+    }
+
+    return kvp;
+}
+
+ConfigStoreKvpHeader *ConfigStore_PutSharedValue(ConfigStore *p, ConfigStoreKey key,
+                                                 const uint8_t *data, size_t size)
+{
+    if (size > ConfigStoreMaxSharedValueSize) {
+        return ConfigStore_PutValue(p, key, data, size);
+    }
+
+    uint32_t hash = ConfigStore_AddCrc(ConfigStoreCrcInitValue, data, size);
+    ConfigStoreSharedValue *shared = Impl_FindSharedValue(p, hash);
+    if ((shared != NULL) && ((shared->header.size != sizeof(*shared) + size) ||
+                             (memcmp(shared + 1, data, size) != 0))) {
+        // Another value has the same hash: this one can't be told apart from it.
+        return ConfigStore_PutValue(p, key, data, size);
+    }
+
+    if (shared == NULL) {
+        shared = Impl_InsertSharedValue(p, hash, data, size);
+        if (shared == NULL) {
+            return NULL;
+        }
+    }
+
+    // Referenced before the KVPs of the key are replaced, in case they already reference it.
+    Impl_UndoTouch(p, (uint8_t *)shared - p->_begin, sizeof(*shared));
+    ++shared->refs;
+
+    ConfigStoreValueReference reference = {
+        .header = {.key = ConfigStoreExtensionKey, .size = sizeof(reference)},
+        .type = ConfigStoreExtension_Reference,
+        .flags = 0,
+        .hash = hash,
+    };
+    ConfigStoreKvpHeader *kvp = Impl_AppendRun(p, key, NULL, 0, &reference.header);
+    if (kvp == NULL) {
+        int error = errno;
+        Impl_ReleaseSharedValue(p, hash);
+        errno = error;
+    }
+    return kvp;
+}
+
+size_t ConfigStore_GetValueSize(const ConfigStore *p, const ConfigStoreKvpHeader *pos)
+{
+    const ConfigStoreSharedValue *shared = Impl_FindReferencedValue(p, pos);
+    if (shared != NULL) {
+        return shared->header.size - sizeof(*shared);
+    }
+
+    const ConfigStoreValueAttributes *attributes = Impl_FindAttributes(p, pos);
+    if ((attributes != NULL) && (attributes->flags & ConfigStoreValue_Compressed)) {
+        return attributes->raw_size;
+    }
+    return ConfigStore_GetChunkedValueSize(p, pos);
+}
+
+int ConfigStore_ReadValue(const ConfigStore *p, const ConfigStoreKvpHeader *pos, void *data,
+                          size_t size)
+{
+    size_t value_size = ConfigStore_GetValueSize(p, pos);
+    if (size < value_size) {
+        errno = E2BIG;
+        return -1;
+    }
+
+    const ConfigStoreSharedValue *shared = Impl_FindReferencedValue(p, pos);
+    if (shared != NULL) {
+        memcpy(data, shared + 1, value_size);
+        return 0;
+    }
+
+    const ConfigStoreValueAttributes *attributes = Impl_FindAttributes(p, pos);
+    if ((attributes == NULL) || !(attributes->flags & ConfigStoreValue_Compressed)) {
+        return ConfigStore_ReadChunkedValue(p, pos, 0, data, value_size);
+    }
+
+    ConfigStoreValueCursor c;
+    Impl_CursorInit(&c, p, pos);
+    return Impl_LzDecompress(&c, data, value_size);
+}
+
+void ConfigStore_ValueReaderInit(ConfigStoreValueReader *r, const ConfigStore *p,
+                                 const ConfigStoreKvpHeader *pos)
+{
+    Impl_CursorInit(&r->_cursor, p, pos);
+}
+
+int ConfigStore_ValueReaderSeek(ConfigStoreValueReader *r, size_t offset)
+{
+    return Impl_CursorSeek(&r->_cursor, offset);
+}
+
+size_t ConfigStore_ValueReaderRead(ConfigStoreValueReader *r, void *data, size_t size)
+{
+    return Impl_CursorCopy(&r->_cursor, data, size, false);
+}
+
+size_t ConfigStore_ValueReaderPeek(ConfigStoreValueReader *r, const uint8_t **data)
+{
+    return Impl_CursorSpan(&r->_cursor, (uint8_t **)data);
+}
+
+size_t ConfigStore_ValueReaderAdvance(ConfigStoreValueReader *r, size_t size)
+{
+    return Impl_CursorAdvance(&r->_cursor, size);
+}
+
+void ConfigStore_ValueWriterInit(ConfigStoreValueWriter *w, ConfigStore *p,
+                                 ConfigStoreKvpHeader *pos)
+{
+    Impl_UndoTouchValue(p, pos);
+    Impl_CursorInit(&w->_cursor, p, pos);
+}
+
+int ConfigStore_ValueWriterSeek(ConfigStoreValueWriter *w, size_t offset)
+{
+    return Impl_CursorSeek(&w->_cursor, offset);
+}
+
+size_t ConfigStore_ValueWriterWrite(ConfigStoreValueWriter *w, const void *data, size_t size)
+{
+    return Impl_CursorCopy(&w->_cursor, (uint8_t *)data, size, true);
+}
+
+size_t ConfigStore_ValueWriterPeek(ConfigStoreValueWriter *w, uint8_t **data)
+{
+    return Impl_CursorSpan(&w->_cursor, data);
+}
+
+size_t ConfigStore_ValueWriterAdvance(ConfigStoreValueWriter *w, size_t size)
+{
+    return Impl_CursorAdvance(&w->_cursor, size);
+}
+
+/// <summary> Checks the fields of a file header, short of the size of the file. </summary>
+static bool Impl_IsValidHeader(const ConfigStoreFileHeader *header)
+{
+    return (header->header.key == ConfigStoreFileHeaderKey) &&
+           (header->header.size >= sizeof(ConfigStoreFileHeader)) &&
+           (header->signature == ConfigStoreFileSignature) &&
+           Impl_IsKnownFileVersion(header->version) &&
+           (header->header.size <= header->file_size);
+}
+
+/// <summary> Checks the file header at the beginning of a buffer. </summary>
+/// <returns> The header if it's valid; NULL otherwise. </returns>
+static const ConfigStoreFileHeader *Impl_ValidateHeader(const uint8_t *data, size_t size)
+{
+    const ConfigStoreFileHeader *header = (const ConfigStoreFileHeader *)data;
+
+    bool ok = (data != NULL) && (size != 0) && Impl_IsValidHeader(header) &&
+              (header->file_size <= size);
+
+    return ok ? header : NULL;
+}
+
+/// <summary> Bytes a validator hashes and walks at a time, so the walk reads them from cache. </summary>
+#define CONFIG_STORE_VALIDATE_BLOCK (4 * 1024)
+
+/// <summary> What the validator expects at the end of the bytes it skips. </summary>
+enum {
+    // A KVP header; or the key of a KVP in compact files.
+    ConfigStoreValidator_Key = 0,
+    // The value size of a KVP in compact files.
+    ConfigStoreValidator_Size = 1,
+    // Nothing: the chain reached the end of the file.
+    ConfigStoreValidator_Done = 2,
+};
+
+/// <summary>
+/// Moves the KVP-chain state machine of a validator over bytes of content at its offset. Like
+/// ConfigStore_GetNextKvp, a KVP whose size doesn't fit ends the chain of version 0 files.
+/// </summary>
+/// <returns> false if the bytes make the chain invalid. </returns>
+static bool Impl_ValidatorWalk(ConfigStoreValidator *v, const uint8_t *data, size_t size)
+{
+    const uint8_t *end = data + size;
+    size_t offset = v->_offset;
+    size_t file_size = v->_header.file_size;
+    bool compact = (v->_header.version == ConfigStoreFileVersionCompact);
+
+    while ((data != end) && (v->_state != ConfigStoreValidator_Done)) {
+        if (v->_skip != 0) {
+            size_t n = (v->_skip < (size_t)(end - data)) ? v->_skip : (size_t)(end - data);
+            v->_skip -= n;
+            data += n;
+            offset += n;
+            continue;
+        }
+
+        if (!compact) {
+            if ((v->_field_size == 0) && (file_size - offset < sizeof(ConfigStoreKvpHeader))) {
+                v->_state = ConfigStoreValidator_Done;
+                break;
+            }
+            v->_field[v->_field_size++] = *data++;
+            ++offset;
+            if (v->_field_size < sizeof(ConfigStoreKvpHeader)) {
+                continue;
+            }
+
+            ConfigStoreKvpHeader kvp;
+            memcpy(&kvp, v->_field, sizeof(kvp));
+            v->_field_size = 0;
+            if (kvp.key == ConfigStoreFileHeaderKey) {
+                // The header key must only be used in the beginning of the file.
+                return false;
+            }
+            if ((kvp.size < sizeof(kvp)) || (kvp.size - sizeof(kvp) > file_size - offset)) {
+                v->_state = ConfigStoreValidator_Done;
+            } else {
+                v->_skip = kvp.size - sizeof(kvp);
+            }
+            continue;
+        }
+
+        // LEB128, as read by Impl_GetVarint16.
+        uint8_t b = *data++;
+        ++offset;
+        v->_varint |= (uint32_t)(b & 0x7F) << v->_shift;
+        if (b & 0x80) {
+            v->_shift += 7;
+            if (v->_shift > 14) {
+                return false;
+            }
+            continue;
+        }
+
+        uint32_t value = v->_varint;
+        v->_varint = 0;
+        v->_shift = 0;
+        if (value > UINT16_MAX) {
+            return false;
+        }
+
+        if (v->_state == ConfigStoreValidator_Key) {
+            if (value == ConfigStoreFileHeaderKey) {
+                return false;
+            }
+            v->_state = ConfigStoreValidator_Size;
+        } else {
+            if ((value > UINT16_MAX - sizeof(ConfigStoreKvpHeader)) || (value > file_size - offset)) {
+                return false;
+            }
+            v->_skip = value;
+            v->_state = ConfigStoreValidator_Key;
+        }
+    }
+
+    return true;
+}
+
+/// <summary> Gets whether the chain of a validator ended where a KVP ends. </summary>
+static bool Impl_ValidatorAtBoundary(const ConfigStoreValidator *v)
+{
+    return (v->_state == ConfigStoreValidator_Done) ||
+           ((v->_state == ConfigStoreValidator_Key) && (v->_skip == 0) && (v->_field_size == 0) &&
+            (v->_shift == 0));
+}
+
+void ConfigStore_ValidatorInit(ConfigStoreValidator *v)
+{
+    memset(v, 0, sizeof(*v));
+    v->_crc = ConfigStoreCrcInitValue;
+    v->_state = ConfigStoreValidator_Key;
+}
+
+int ConfigStore_ValidatorUpdate(ConfigStoreValidator *v, const void *data, size_t size)
+{
+    const uint8_t *bytes = data;
+
+    if (!v->_failed && (v->_offset < sizeof(ConfigStoreFileHeader))) {
+        size_t n = sizeof(ConfigStoreFileHeader) - v->_offset;
+        if (n > size) {
+            n = size;
+        }
+        memcpy((uint8_t *)&v->_header + v->_offset, bytes, n);
+        v->_offset += n;
+        bytes += n;
+        size -= n;
+        if (v->_offset == sizeof(ConfigStoreFileHeader)) {
+            if (!Impl_IsValidHeader(&v->_header)) {
+                v->_failed = true;
+            } else {
+                // Like the KVP chain, the walk starts past the whole header, which may be longer.
+                v->_skip = v->_header.header.size - sizeof(ConfigStoreFileHeader);
+            }
+        }
+    }
+
+    if (v->_failed) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    // Bytes past the content, as left by a writer that didn't get to truncate the file, don't count.
+    size_t left = (v->_offset < sizeof(ConfigStoreFileHeader)) ? 0 : (v->_header.file_size - v->_offset);
+    if (size > left) {
+        size = left;
+    }
+
+    while (size != 0) {
+        size_t n = (size < CONFIG_STORE_VALIDATE_BLOCK) ? size : CONFIG_STORE_VALIDATE_BLOCK;
+        v->_crc = ConfigStore_AddCrc(v->_crc, bytes, n);
+        if (!Impl_ValidatorWalk(v, bytes, n)) {
+            v->_failed = true;
+            errno = EINVAL;
+            return -1;
+        }
+        v->_offset += n;
+        bytes += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+size_t ConfigStore_ValidatorFinish(const ConfigStoreValidator *v)
+{
+    bool ok = !v->_failed && (v->_offset >= sizeof(ConfigStoreFileHeader)) &&
+              (v->_offset == v->_header.file_size) && (v->_crc == v->_header.crc) &&
+              Impl_ValidatorAtBoundary(v);
+
+    return ok ? v->_header.file_size : 0;
+}
+
+/// <summary> Checks the KVPs after a valid file header, up to the file size it gives. </summary>
+static bool Impl_ValidateChain(const ConfigStoreFileHeader *header)
+{
+    ConfigStoreValidator v;
+    ConfigStore_ValidatorInit(&v);
+    v._header = *header;
+    v._offset = sizeof(ConfigStoreFileHeader);
+
+    return Impl_ValidatorWalk(&v, (const uint8_t *)(header + 1),
+                              header->file_size - sizeof(ConfigStoreFileHeader)) &&
+           Impl_ValidatorAtBoundary(&v);
+}
+
+size_t ConfigStore_ValidateFormat(const uint8_t *data, size_t size)
+{
+    const ConfigStoreFileHeader *header = Impl_ValidateHeader(data, size);
+    if (header == NULL) {
+        return 0;
+    }
+
+    ConfigStoreValidator v;
+    ConfigStore_ValidatorInit(&v);
+    if (ConfigStore_ValidatorUpdate(&v, data, header->file_size)) {
+        return 0;
+    }
+    return ConfigStore_ValidatorFinish(&v);
+}
+
+/// <summary> Multiplies a vector by a 32x32 matrix over GF(2), one column per bit. </summary>
+static uint32_t Impl_Gf2Times(const uint32_t *matrix, uint32_t vector)
+{
+    uint32_t sum = 0;
+    for (; vector != 0; vector >>= 1, ++matrix) {
+        if (vector & 1) {
+            sum ^= *matrix;
+        }
+    }
+    return sum;
+}
+
+static void Impl_Gf2Square(uint32_t *square, const uint32_t *matrix)
+{
+    for (int n = 0; n < 32; ++n) {
+        square[n] = Impl_Gf2Times(matrix, matrix[n]);
+    }
+}
+
+/// <summary>
+/// Advances a CRC over <paramref name="size" /> zero bytes in O(log(size)) time, by squaring the
+/// operator of one zero bit. The CRC of a buffer split in two is then the CRC of the front shifted
+/// by the size of the back, xor the CRC of the back from 0 (as in zlib's crc32_combine).
+/// </summary>
+static uint32_t Impl_CrcShift(uint32_t crc, size_t size)
+{
+    uint32_t odd[32];
+    uint32_t even[32];
+
+    odd[0] = 0xEDB88320;
+    for (int n = 1; n < 32; ++n) {
+        odd[n] = 1u << (n - 1);
+    }
+    Impl_Gf2Square(even, odd); // Two zero bits.
+    Impl_Gf2Square(odd, even); // Four zero bits.
+
+    // Odd and even alternate as the operators of 1, 2, 4... zero bytes.
+    while (size != 0) {
+        Impl_Gf2Square(even, odd);
+        if (size & 1) {
+            crc = Impl_Gf2Times(even, crc);
+        }
+        size >>= 1;
+        if (size == 0) {
+            break;
+        }
+
+        Impl_Gf2Square(odd, even);
+        if (size & 1) {
+            crc = Impl_Gf2Times(odd, crc);
+        }
+        size >>= 1;
+    }
+
+    return crc;
+}
+
+/// <summary> Smallest chunk of a parallel validation worth a thread of its own. </summary>
+#define CONFIG_STORE_MIN_CRC_CHUNK (16 * 1024)
+
+/// <summary> A chunk of the CRC of a parallel validation, hashed from 0. </summary>
+struct ConfigStoreCrcChunk {
+    const uint8_t *data;
+    size_t size;
+    uint32_t crc;
+    pthread_t thread;
+    bool started;
+};
+
+static void *Impl_HashChunk(void *context)
+{
+    struct ConfigStoreCrcChunk *chunk = context;
+    chunk->crc = ConfigStore_AddCrc(0, chunk->data, chunk->size);
+    return NULL;
+}
+
+size_t ConfigStore_ValidateFormatParallel(const uint8_t *data, size_t size, unsigned threads)
+{
+    const ConfigStoreFileHeader *header = Impl_ValidateHeader(data, size);
+    if (header == NULL) {
         return 0;
     }
 
-    char *path_copy = strdup(file_path);
-    if (path_copy == NULL) {
-        return 0;
+    const uint8_t *content = data + sizeof(ConfigStoreFileHeader);
+    size_t content_size = header->file_size - sizeof(ConfigStoreFileHeader);
+
+    if (threads == 0) {
+        threads = CONFIG_STORE_DEFAULT_VALIDATION_THREADS;
+    }
+    if (threads > content_size / CONFIG_STORE_MIN_CRC_CHUNK) {
+        threads = content_size / CONFIG_STORE_MIN_CRC_CHUNK;
+    }
+    if (threads < 2) {
+        return ConfigStore_ValidateFormat(data, size);
+    }
+
+    struct ConfigStoreCrcChunk *chunks = calloc(threads, sizeof(*chunks));
+    if (chunks == NULL) {
+        return ConfigStore_ValidateFormat(data, size);
     }
 
-    // Get block size
-    struct statvfs stat_buf;
-    int r = ConfigStore_StatVfs(dirname(path_copy), &stat_buf);
-    free(path_copy);
+    size_t chunk_size = content_size / threads;
+    for (unsigned i = 0; i < threads; ++i) {
+        chunks[i].data = content + i * chunk_size;
+        chunks[i].size = (i + 1 < threads) ? chunk_size : (content_size - i * chunk_size);
+        chunks[i].started =
+            (pthread_create(&chunks[i].thread, NULL, Impl_HashChunk, &chunks[i]) == 0);
+    }
 
-    if (r) {
-        return 0;
+    bool ok = Impl_ValidateChain(header);
+
+    uint32_t crc = ConfigStoreCrcInitValue;
+    for (unsigned i = 0; i < threads; ++i) {
+        if (chunks[i].started) {
+            pthread_join(chunks[i].thread, NULL);
+        } else {
+            Impl_HashChunk(&chunks[i]);
+        }
+        crc = Impl_CrcShift(crc, chunks[i].size) ^ chunks[i].crc;
     }
+    free(chunks);
 
-    const size_t BlockSize = stat_buf.f_bsize;
+    if (!ok || (crc != header->crc)) {
+        return 0;
+    }
 
-    size_t pointer_overhead =
-        ((file_size - 1) / BlockSize + 1) * ConfigStoreOverheadPerStorageBlock;
+    return header->file_size;
+}
 
-    return file_size - pointer_overhead;
+/// <summary> Drops everything an import put in the store. </summary>
+static void Impl_ImportRollBack(ConfigStoreImporter *im)
+{
+    ConfigStore *p = im->_store;
+    p->_end = p->_begin + ((const ConfigStoreKvpHeader *)p->_begin)->size;
+    Impl_IndexRebuild(p);
+    im->_validator._failed = true;
 }
 
-int ConfigStore_Open(ConfigStore *p, const char *base_filepath, size_t max_size, int flags,
-                     ConfigStoreReplicaType rtype)
+int ConfigStore_ImportBegin(ConfigStoreImporter *im, ConfigStore *p)
 {
-    if (p->_fd >= 0) {
-        errno = EALREADY;
+    if (!ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
         return -1;
     }
 
-    ConfigStore temp;
-    ConfigStore_Init(&temp);
-
-    size_t adjusted_max_size = AdjustedMaxFileSize(base_filepath, max_size);
-    if (adjusted_max_size == 0) {
-        errno = ENOSPC;
+    // Not even shared values, which trail the file header.
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    if (Impl_GetNextRawKvp((ConfigStoreKvpHeader *)p->_begin, it_end) != it_end) {
+        errno = ENOTEMPTY;
         return -1;
     }
 
-    int res = Impl_Open(&temp, base_filepath, adjusted_max_size, flags, rtype);
-
-    if (res == 0) {
-        ConfigStore_Move(p, &temp);
-    }
-
-    ConfigStore_Close(&temp);
-
-    return res;
+    im->_store = p;
+    ConfigStore_ValidatorInit(&im->_validator);
+    return 0;
 }
 
-static int Impl_WriteToFile(int fd, ConfigStore *p)
+int ConfigStore_ImportUpdate(ConfigStoreImporter *im, const void *data, size_t size)
 {
-    if (lseek(fd, 0, SEEK_SET) < 0) {
+    ConfigStore *p = im->_store;
+    ConfigStoreValidator *v = &im->_validator;
+    const uint8_t *bytes = data;
+
+    // The stream's own file header is only validated; the store keeps its own.
+    size_t header_size = 0;
+    if (v->_offset < sizeof(ConfigStoreFileHeader)) {
+        header_size = sizeof(ConfigStoreFileHeader) - v->_offset;
+        if (header_size > size) {
+            header_size = size;
+        }
+    }
+    size_t offset = v->_offset;
+    if (ConfigStore_ValidatorUpdate(v, bytes, size)) {
+        if (offset > sizeof(ConfigStoreFileHeader)) {
+            Impl_ImportRollBack(im);
+        }
         return -1;
     }
-
-    ssize_t total_size = p->_end - p->_begin;
-
-    if (write(fd, p->_begin, total_size) != total_size) {
+    if ((v->_offset >= sizeof(ConfigStoreFileHeader)) &&
+        (v->_header.version != ConfigStoreFileVersion)) {
+        // Compact streams would have to be decoded first.
+        v->_failed = true;
+        errno = EINVAL;
         return -1;
     }
 
-    if (ftruncate(fd, total_size) != 0) {
-        return -1;
+    // The validator took what belongs to the stream, if not all of it.
+    size_t content_size = (v->_offset - offset) - header_size;
+    if (content_size == 0) {
+        return 0;
+    }
+
+    size_t end_size = p->_end - p->_begin;
+    size_t capacity = p->_capacity - p->_begin;
+    if (end_size + content_size > capacity) {
+        // Grow geometrically, as streams come in many small pieces.
+        size_t new_capacity = (capacity * 2 < p->_max_size) ? (capacity * 2) : p->_max_size;
+        if (new_capacity < end_size + content_size) {
+            new_capacity = end_size + content_size;
+        }
+        if (ConfigStore_ReserveCapacity(p, new_capacity)) {
+            int error = errno;
+            Impl_ImportRollBack(im);
+            errno = error;
+            return -1;
+        }
     }
 
-    fsync(fd);
+    Impl_UndoTouch(p, end_size, content_size);
+    memcpy(p->_end, bytes + header_size, content_size);
+    p->_end += content_size;
+    STATS_ADD(p, crc_bytes, content_size);
 
     return 0;
 }
 
-int ConfigStore_Commit(ConfigStore *p)
+int ConfigStore_ImportEnd(ConfigStoreImporter *im)
 {
-    if (!ConfigStore_InvariantsCheck(p)) {
+    ConfigStore *p = im->_store;
+    if (im->_validator._failed) {
         errno = EINVAL;
         return -1;
     }
 
-    uint32_t crc =
-        ConfigStore_AddCrc(ConfigStoreCrcInitValue, p->_begin + sizeof(ConfigStoreFileHeader),
-                           p->_end - p->_begin - sizeof(ConfigStoreFileHeader));
-
-    ConfigStoreKvpHeader *first = (ConfigStoreKvpHeader *)p->_begin;
-    ConfigStoreKvpHeader *last = (ConfigStoreKvpHeader *)p->_end;
+    if (ConfigStore_ValidatorFinish(&im->_validator) == 0) {
+        Impl_ImportRollBack(im);
+        errno = EINVAL;
+        return -1;
+    }
 
-    if ((first != last) && (first->key == ConfigStoreFileHeaderKey)) {
-        ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)(first);
-        header->file_size = (p->_end - p->_begin);
-        header->crc = crc;
+    if (Impl_IndexRebuild(p)) {
+        int error = errno;
+        Impl_ImportRollBack(im);
+        errno = error;
+        return -1;
     }
 
-    if (p->_replica_type == ConfigStoreReplica_Swap) {
-        // Create the swap file always.
-        int fd = open(p->_replica_path, O_RDWR | O_CREAT | O_CLOEXEC | O_TRUNC, S_IRUSR | S_IWUSR);
-        if (fd < 0) {
-            return -1;
-        }
-        int res = Impl_WriteToFile(fd, p);
-        close(fd);
-        if (res < 0) {
-            return -1;
-        }
-        res = rename(p->_replica_path, p->_primary_path);
-        if (res < 0) {
+    // Sorted keys are what spared the lookups, so that duplicates are where they'd be expected.
+    const ConfigStoreKey *keys = p->_index->keys;
+    for (size_t i = 1; i < p->_index->count; ++i) {
+        if (keys[i] < keys[i - 1]) {
+            Impl_ImportRollBack(im);
+            errno = EINVAL;
             return -1;
         }
-
-        ConfigStore_Close(p);
-    } else {
-        return Impl_WriteToFile(p->_fd, p);
     }
 
     return 0;
 }
 
-ConfigStoreKvpHeader *ConfigStore_BeginKvp(const ConfigStore *p)
+/// <summary> Gets the end of a KVP and of its trailers. </summary>
+static const uint8_t *Impl_RunEnd(const ConfigStore *p, const ConfigStoreKvpHeader *pos)
 {
-    return ConfigStore_GetNextKvp((ConfigStoreKvpHeader *)p->_begin,
-                                  (ConfigStoreKvpHeader *)p->_end);
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
+    return (const uint8_t *)Impl_SkipTrailers(Impl_GetNextRawKvp(pos, it_end), it_end);
 }
 
-ConfigStoreKvpHeader *ConfigStore_EndKvp(const ConfigStore *p)
+struct ConfigStoreExportEntry {
+    ConfigStoreKey key;
+    uint32_t offset;
+};
+
+static int Impl_CompareExportEntries(const void *a, const void *b)
 {
-    return (ConfigStoreKvpHeader *)p->_end;
+    const struct ConfigStoreExportEntry *x = a;
+    const struct ConfigStoreExportEntry *y = b;
+    if (x->key != y->key) {
+        return (x->key < y->key) ? -1 : 1;
+    }
+    // Duplicate keys keep their order.
+    return (x->offset < y->offset) ? -1 : (x->offset > y->offset);
 }
 
-ConfigStoreKvpHeader *ConfigStore_InsertKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos,
-                                            ConfigStoreKey key, size_t size)
+int ConfigStore_ExportBegin(ConfigStoreExporter *ex, const ConfigStore *p)
 {
-    uint16_t kvp_size;
-    if (__builtin_add_overflow(size, sizeof(ConfigStoreKvpHeader), &kvp_size)) {
-        return NULL;
+    memset(ex, 0, sizeof(*ex));
+    if (!ConfigStore_InvariantsCheck(p)) {
+        errno = EINVAL;
+        return -1;
     }
 
-    size_t in_offset = (ptrdiff_t)pos - (ptrdiff_t)p->_begin;
-    size_t current_size = p->_end - p->_begin;
+    size_t count = Impl_IndexCount(p);
+    struct ConfigStoreExportEntry *entries = malloc((count ? count : 1) * sizeof(*entries));
+    ex->_offsets = malloc((count ? count : 1) * sizeof(*ex->_offsets));
+    if ((entries == NULL) || (ex->_offsets == NULL)) {
+        free(entries);
+        free(ex->_offsets);
+        ex->_offsets = NULL;
+        return -1;
+    }
 
-    if (ConfigStore_ReserveCapacity(p, current_size + kvp_size)) {
-        return NULL;
+    for (size_t i = 0; i < count; ++i) {
+        entries[i].key = p->_index->keys[i];
+        entries[i].offset = p->_index->offsets[i];
     }
+    qsort(entries, count, sizeof(*entries), Impl_CompareExportEntries);
+
+    // The shared values trailing the file header come first, as in the store.
+    const uint8_t *trailers = (const uint8_t *)Impl_GetNextRawKvp(
+        (const ConfigStoreKvpHeader *)p->_begin, ConfigStore_EndKvp(p));
+    size_t trailers_size = (p->_begin + Impl_GapOffset(p, 0)) - trailers;
+    uint32_t crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, trailers, trailers_size);
+    size_t file_size = sizeof(ConfigStoreFileHeader) + trailers_size;
+
+    for (size_t i = 0; i < count; ++i) {
+        const uint8_t *run = p->_begin + entries[i].offset;
+        size_t run_size = Impl_RunEnd(p, (const ConfigStoreKvpHeader *)run) - run;
+        crc = ConfigStore_AddCrc(crc, run, run_size);
+        file_size += run_size;
+        ex->_offsets[i] = entries[i].offset;
+    }
+    free(entries);
 
-    uint8_t *in_pos = &p->_begin[in_offset];
+    ex->_store = p;
+    ex->_count = count;
+    ex->_header = *(const ConfigStoreFileHeader *)p->_begin;
+    ex->_header.header.size = sizeof(ConfigStoreFileHeader);
+    ex->_header.version = ConfigStoreFileVersion;
+    ex->_header.file_size = file_size;
+    ex->_header.crc = crc;
 
-    memmove(&in_pos[kvp_size], in_pos, current_size - in_offset);
+    return 0;
+}
 
-    ConfigStoreKvpHeader *pKvp = (ConfigStoreKvpHeader *)(in_pos);
-    pKvp->size = kvp_size;
-    pKvp->key = key;
+size_t ConfigStore_ExportNext(ConfigStoreExporter *ex, const uint8_t **data)
+{
+    const ConfigStore *p = ex->_store;
+    if (p == NULL) {
+        *data = NULL;
+        return 0;
+    }
 
-    p->_end += kvp_size;
+    // The file header, then the shared values, then the KVPs.
+    size_t next = ex->_next++;
+    if (next == 0) {
+        *data = (const uint8_t *)&ex->_header;
+        return sizeof(ex->_header);
+    }
+    if (next == 1) {
+        *data = (const uint8_t *)Impl_GetNextRawKvp((const ConfigStoreKvpHeader *)p->_begin,
+                                                    ConfigStore_EndKvp(p));
+        size_t size = (p->_begin + Impl_GapOffset(p, 0)) - *data;
+        if (size != 0) {
+            return size;
+        }
+        next = ex->_next++;
+    }
+    if (next - 2 < ex->_count) {
+        *data = p->_begin + ex->_offsets[next - 2];
+        return Impl_RunEnd(p, (const ConfigStoreKvpHeader *)*data) - *data;
+    }
 
-    return pKvp;
+    ex->_next = ex->_count + 2;
+    *data = NULL;
+    return 0;
 }
 
-static ConfigStoreKvpHeader *Impl_FindKey(ConfigStoreKey key, ConfigStoreKvpHeader *pFirst,
-                                          ConfigStoreKvpHeader *pLast)
+void ConfigStore_ExportEnd(ConfigStoreExporter *ex)
 {
-    while ((pFirst != pLast) && (pFirst->key != key)) {
-        pFirst = ConfigStore_GetNextKvp(pFirst, pLast);
-    }
+    free(ex->_offsets);
+    memset(ex, 0, sizeof(*ex));
+}
 
-    return pFirst;
+void ConfigStore_WatchInit(ConfigStoreWatch *w)
+{
+    memset(w, 0, sizeof(*w));
+    w->_fd = -1;
 }
 
-ConfigStoreKvpHeader *ConfigStore_TryGetKey(const ConfigStore *p, ConfigStoreKey key)
+/// <summary>
+/// Reads the size and CRC from the header of the file, once the whole file validates against them:
+/// an in-place commit in progress can leave the header and the content torn, and the write that
+/// completes it raises another notification. A missing or unreadable file reads as zeros.
+/// </summary>
+/// <returns> true if the size and CRC were read; false if the file is torn. </returns>
+static bool Impl_WatchReadHeader(ConfigStoreWatch *w)
 {
-    ConfigStoreKvpHeader *it = ConfigStore_BeginKvp(p);
-    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(p);
-    it = Impl_FindKey(key, it, it_end);
-    return (it != it_end) ? it : NULL;
+    ConfigStoreValidator validator;
+    ConfigStore_ValidatorInit(&validator);
+    bool readable = false;
+
+    char *path = AppendString(w->_dir_path, w->_file_name);
+    if (path != NULL) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            uint8_t buf[512];
+            ssize_t len;
+            while ((len = read(fd, buf, sizeof(buf))) > 0) {
+                if (ConfigStore_ValidatorUpdate(&validator, buf, len)) {
+                    break;
+                }
+            }
+            readable = (len >= 0);
+            close(fd);
+        }
+        free(path);
+    }
+
+    if (!readable) {
+        w->_file_size = 0;
+        w->_crc = 0;
+        return true;
+    }
+    if (ConfigStore_ValidatorFinish(&validator) == 0) {
+        return false;
+    }
+
+    w->_file_size = validator._header.file_size;
+    w->_crc = validator._header.crc;
+    return true;
 }
 
-ConfigStoreKvpHeader *ConfigStore_PutUniqueKey(ConfigStore *p, ConfigStoreKey key,
-                                               const uint8_t *optional_data, size_t value_size)
+int ConfigStore_WatchOpen(ConfigStoreWatch *w, const char *base_filepath)
 {
-    ConfigStoreKvpHeader *it = ConfigStore_BeginKvp(p);
-    ConfigStoreKvpHeader *it_end = NULL;
+    if (w->_fd >= 0) {
+        errno = EALREADY;
+        return -1;
+    }
 
-    // For all matching keys.
-    while (it_end = ConfigStore_EndKvp(p), it = Impl_FindKey(key, it, it_end), it != it_end) {
-        if (it->size != value_size) {
-            // Not same size. Erase KVP and continue with next.
-            it = ConfigStore_EraseKvp(p, it);
-            continue;
-        }
+    char *dir_copy = strdup(base_filepath);
+    char *name_copy = strdup(base_filepath);
+    if ((dir_copy == NULL) || (name_copy == NULL)) {
+        free(dir_copy);
+        free(name_copy);
+        return -1;
+    }
 
-        // Found KVP with same size. Reuse it and erase any other occurrences of the same
-        // key after it, just in case.
-        ConfigStoreKvpHeader *it_erase = ConfigStore_GetNextKvp(it, it_end);
-        while (it_end = ConfigStore_EndKvp(p), it_erase = Impl_FindKey(key, it_erase, it_end),
-               it_erase != it_end) {
-            it_erase = ConfigStore_EraseKvp(p, it_erase);
-        }
-        break;
+    w->_dir_path = AppendString(dirname(dir_copy), "/");
+    w->_file_name = strdup(basename(name_copy));
+    free(dir_copy);
+    free(name_copy);
+    if ((w->_dir_path == NULL) || (w->_file_name == NULL)) {
+        ConfigStore_WatchClose(w);
+        return -1;
     }
 
-    it_end = ConfigStore_EndKvp(p);
-    if (it == it_end) {
-        it = ConfigStore_InsertKvp(p, it_end, key, value_size);
-        if (it == ConfigStore_EndKvp(p)) {
-            // Space exhaustion.
-            return NULL;
-        }
+    // Watch the directory rather than the file: swap commits replace the file's inode. In-place
+    // commits keep the file open, so their writes are watched too.
+    w->_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if ((w->_fd < 0) ||
+        (inotify_add_watch(w->_fd, w->_dir_path, IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_TO) < 0)) {
+        ConfigStore_WatchClose(w);
+        return -1;
     }
 
-    if (optional_data != NULL) {
-        ConfigStore_WriteValue(it, 0, optional_data, value_size);
+    if (!Impl_WatchReadHeader(w)) {
+        w->_file_size = 0;
+        w->_crc = 0;
     }
 
-    return it;
+    return 0;
 }
 
-ConfigStoreKvpHeader *ConfigStore_EraseKvp(ConfigStore *p, const ConfigStoreKvpHeader *pos)
+int ConfigStore_WatchGetFd(const ConfigStoreWatch *w)
 {
-    size_t size = pos->size;
-    ptrdiff_t offset = (ptrdiff_t)pos - (ptrdiff_t)p->_begin;
-    uint8_t *out_pos = &p->_begin[offset];
-    memmove(&out_pos[0], &out_pos[size], p->_end - &out_pos[size]);
-    p->_end -= size;
-
-    return (ConfigStoreKvpHeader *)out_pos;
+    return w->_fd;
 }
 
-ConfigStoreKvpHeader *ConfigStore_AllocUniqueKvp(ConfigStore *p, ConfigStoreKey first_key,
-                                                 ConfigStoreKey last_key, size_t value_size,
-                                                 ConfigStoreKey key_increment)
+int ConfigStore_WatchConsume(ConfigStoreWatch *w)
 {
-    while (first_key < last_key) {
+    if (w->_fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
 
-        bool found = false;
+    bool touched = false;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
 
-        ConfigStoreKvpHeader *kvp = ConfigStore_BeginKvp(p);
-        while (kvp != ConfigStore_EndKvp(p)) {
-            found = (kvp->key == first_key);
-            if (found) {
+    for (;;) {
+        ssize_t len = read(w->_fd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EAGAIN) {
                 break;
             }
-            kvp = ConfigStore_GetNextKvp(kvp, ConfigStore_EndKvp(p));
+            return -1;
         }
 
-        if (!found) {
-            break;
+        for (ssize_t i = 0; i < len;) {
+            const struct inotify_event *ev = (const struct inotify_event *)&buf[i];
+            if ((ev->len > 0) && (strcmp(ev->name, w->_file_name) == 0)) {
+                touched = true;
+            }
+            i += sizeof(*ev) + ev->len;
         }
+    }
 
-        if (__builtin_add_overflow(first_key, key_increment, &first_key)) {
-            errno = ENOENT;
-            return NULL;
-        }
+    if (!touched) {
+        return 0;
     }
 
-    if (first_key >= last_key) {
-        errno = ENOENT;
-        return NULL;
+    uint32_t file_size = w->_file_size;
+    uint32_t crc = w->_crc;
+    if (!Impl_WatchReadHeader(w)) {
+        // Not a change yet.
+        return 0;
     }
 
-    return ConfigStore_InsertKvp(p, ConfigStore_EndKvp(p), first_key, value_size);
+    return (file_size != w->_file_size) || (crc != w->_crc);
 }
 
-int ConfigStore_EraseKeysInRange(ConfigStore *p, ConfigStoreKey first_key, ConfigStoreKey last_key,
-                                 ConfigStoreKey key_increment)
+void ConfigStore_WatchClose(ConfigStoreWatch *w)
 {
-    bool good_args = (p) && (first_key <= last_key) && (1 <= key_increment);
-    if (!good_args) {
-        errno = EINVAL;
-        return -1;
-    }
-
-    ConfigStoreKvpHeader *kvp = ConfigStore_BeginKvp(p);
-    while (kvp != ConfigStore_EndKvp(p)) {
-        bool match = (first_key <= kvp->key) && (kvp->key < last_key) &&
-                     (((kvp->key - first_key) % key_increment) == 0);
-        if (match) {
-            kvp = ConfigStore_EraseKvp(p, kvp);
-        } else {
-            kvp = ConfigStore_GetNextKvp(kvp, ConfigStore_EndKvp(p));
-        }
+    if (w->_fd >= 0) {
+        close(w->_fd);
     }
-
-    return 0;
+    free(w->_dir_path);
+    free(w->_file_name);
+    ConfigStore_WatchInit(w);
 }
 
-ConfigStoreKvpHeader *ConfigStore_GetNextKvpInRange(ConfigStore *p, const ConfigStoreKvpHeader *pos,
-                                                    ConfigStoreKey first_key,
-                                                    ConfigStoreKey last_key,
-                                                    ConfigStoreKey key_increment)
+void ConfigStore_SharedViewInit(ConfigStoreSharedView *v)
 {
-    ConfigStoreKvpHeader *end_pos = ConfigStore_EndKvp(p);
-
-    pos = pos ? ConfigStore_GetNextKvp(pos, end_pos) : ConfigStore_BeginKvp(p);
+    memset(v, 0, sizeof(*v));
+    v->_fd = -1;
+}
 
-    while (pos != end_pos) {
-        bool match = (first_key <= pos->key) && (pos->key < last_key) &&
-                     (((pos->key - first_key) % key_increment) == 0);
-        if (match) {
-            break;
-        }
-        pos = ConfigStore_GetNextKvp(pos, end_pos);
+int ConfigStore_SharedViewOpen(ConfigStoreSharedView *v, const char *name)
+{
+    if (v->_fd >= 0) {
+        errno = EALREADY;
+        return -1;
     }
 
-    return (ConfigStoreKvpHeader *)pos;
-}
+    v->_fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (v->_fd < 0) {
+        return -1;
+    }
 
-int ConfigStore_WriteValue(ConfigStoreKvpHeader *pos, size_t offset, const void *data, size_t size)
-{
-    size_t hdr_size = pos ? sizeof(*pos) : 0;
-    size_t dst_size = (pos && (pos->size > sizeof(*pos))) ? (pos->size - sizeof(*pos)) : 0;
+    struct stat st;
+    if (fstat(v->_fd, &st) != 0) {
+        ConfigStore_SharedViewClose(v);
+        return -1;
+    }
 
-    uint8_t *dst_data = (uint8_t *)pos + hdr_size + offset;
+    if ((size_t)st.st_size < sizeof(struct ConfigStoreSharedImage)) {
+        ConfigStore_SharedViewClose(v);
+        errno = ENODATA;
+        return -1;
+    }
 
-    size_t last_offset = offset + size;
-    if (dst_size < last_offset) {
-        errno = E2BIG;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, v->_fd, 0);
+    if (map == MAP_FAILED) {
+        ConfigStore_SharedViewClose(v);
         return -1;
     }
 
-    memcpy(dst_data, (uint8_t *)data, size);
-    memset(dst_data + last_offset, 0, dst_size - last_offset);
+    v->_image = map;
+    v->_map_size = st.st_size;
 
     return 0;
 }
 
-size_t ConfigStore_ValidateFormat(const uint8_t *data, size_t size)
-{
-    const ConfigStoreKvpHeader *first = (const ConfigStoreKvpHeader *)data;
-    const ConfigStoreKvpHeader *last = (const ConfigStoreKvpHeader *)(data + size);
-
-    bool has_header = (first != NULL) && (first != last) &&
-                      (first->key == ConfigStoreFileHeaderKey) &&
-                      (first->size >= sizeof(ConfigStoreFileHeader));
+/// <summary>
+/// How long ConfigStore_SharedViewBegin waits for a publication to complete. A publication is a
+/// copy of at most the max size of the store, so one that takes longer is from a dead writer.
+/// </summary>
+#define CONFIG_STORE_SHARED_VIEW_WAIT_NS (100 * 1000 * 1000)
 
-    if (!has_header) {
-        return 0;
+int ConfigStore_SharedViewBegin(const ConfigStoreSharedView *v, uint32_t *pSeq,
+                                const ConfigStoreKvpHeader **pFirst,
+                                const ConfigStoreKvpHeader **pLast)
+{
+    const struct ConfigStoreSharedImage *image = v->_image;
+
+    uint32_t seq;
+    uint64_t start = 0;
+    while ((seq = __atomic_load_n(&image->seq, __ATOMIC_ACQUIRE)) & 1) {
+        uint64_t now = Impl_NowNs();
+        if (start == 0) {
+            start = now;
+        } else if (now - start > CONFIG_STORE_SHARED_VIEW_WAIT_NS) {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        sched_yield();
     }
 
-    const ConfigStoreFileHeader *header = (const ConfigStoreFileHeader *)first;
-
-    bool ok = (header->signature == ConfigStoreFileSignature) &&
-              (header->version == ConfigStoreFileVersion) &&
-              (header->header.size <= header->file_size) && (header->file_size <= size);
-    if (!ok) {
-        return 0;
+    // Never trust the size beyond the mapping. A torn size is caught by the retry; an image that
+    // outgrew the mapping (the writer was reopened with a larger max size) reads as empty.
+    size_t size = __atomic_load_n(&image->size, __ATOMIC_RELAXED);
+    if (size > v->_map_size - sizeof(*image)) {
+        size = 0;
     }
 
-    size = header->file_size;
+    const ConfigStoreKvpHeader *first = (const ConfigStoreKvpHeader *)image->data;
+    const ConfigStoreKvpHeader *last = (const ConfigStoreKvpHeader *)&image->data[size];
+    *pFirst = (size < sizeof(ConfigStoreFileHeader)) ? last : ConfigStore_GetNextKvp(first, last);
+    *pLast = last;
+    *pSeq = seq;
 
-    data += sizeof(ConfigStoreFileHeader);
-    size -= sizeof(ConfigStoreFileHeader);
-
-    uint32_t crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, data, size);
-
-    if (crc != header->crc) {
-        return 0;
-    }
-
-    ++first;
+    return 0;
+}
 
-    while ((first != NULL) && (first != last)) {
-        if (first->key == ConfigStoreFileHeaderKey) {
-            // The header key must only be used in the beginning of the file.
-            break;
-        }
+bool ConfigStore_SharedViewRetry(const ConfigStoreSharedView *v, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&v->_image->seq, __ATOMIC_RELAXED) != seq;
+}
 
-        first = ConfigStore_GetNextKvp(first, last);
+void ConfigStore_SharedViewClose(ConfigStoreSharedView *v)
+{
+    if (v->_image != NULL) {
+        munmap((void *)v->_image, v->_map_size);
     }
-
-    if (first != last) {
-        // Didn't get to the end of the file.
-        return 0;
+    if (v->_fd >= 0) {
+        close(v->_fd);
     }
-
-    return header->file_size;
+    ConfigStore_SharedViewInit(v);
 }
@@ -0,0 +1,200 @@
+#include "config_store_set.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ConfigStoreNamespace {
+    char name[CONFIG_STORE_MAX_NAMESPACE_LENGTH + 1];
+    char *shared_view_name;
+    ConfigStore store;
+};
+
+static bool Impl_IsValidNamespace(const char *name)
+{
+    size_t length = name ? strnlen(name, CONFIG_STORE_MAX_NAMESPACE_LENGTH + 1) : 0;
+    if ((length == 0) || (length > CONFIG_STORE_MAX_NAMESPACE_LENGTH)) {
+        return false;
+    }
+
+    for (size_t i = 0; i < length; ++i) {
+        char c = name[i];
+        bool ok = ((c >= 'a') && (c <= 'z')) || ((c >= 'A') && (c <= 'Z')) ||
+                  ((c >= '0') && (c <= '9')) || (c == '_') || (c == '-');
+        if (!ok) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static struct ConfigStoreNamespace *Impl_FindNamespace(const ConfigStoreSet *s, const char *name)
+{
+    for (size_t i = 0; i < s->_count; ++i) {
+        if (strcmp(s->_namespaces[i]->name, name) == 0) {
+            return s->_namespaces[i];
+        }
+    }
+    return NULL;
+}
+
+/// <summary> Names something of a namespace after that of the set ("base.networks"). </summary>
+/// <returns> The allocated name; NULL on failure with error indication in errno. </returns>
+static char *Impl_NamespaceName(const char *base, const char *name)
+{
+    size_t base_length = strlen(base);
+    size_t name_length = strlen(name);
+    char *joined = malloc(base_length + 1 + name_length + 1);
+    if (joined == NULL) {
+        return NULL;
+    }
+    memcpy(joined, base, base_length);
+    joined[base_length] = '.';
+    memcpy(&joined[base_length + 1], name, name_length + 1);
+    return joined;
+}
+
+/// <summary> Opens (or reopens) the store of a namespace from its file. </summary>
+/// <returns> 0 on success; -1 on failure with error indication in errno. </returns>
+static int Impl_OpenNamespace(const ConfigStoreSet *s, struct ConfigStoreNamespace *ns)
+{
+    char *path = Impl_NamespaceName(s->_base_path, ns->name);
+    if (path == NULL) {
+        return -1;
+    }
+
+    int res = ConfigStore_Open(&ns->store, path, s->_max_size, s->_flags, s->_replica_type);
+
+    free(path);
+    return res;
+}
+
+void ConfigStore_StoreSetInit(ConfigStoreSet *s)
+{
+    memset(s, 0, sizeof(*s));
+}
+
+void ConfigStore_StoreSetSetOptions(ConfigStoreSet *s, const ConfigStoreOptions *options)
+{
+    s->_options = *options;
+}
+
+int ConfigStore_StoreSetOpen(ConfigStoreSet *s, const char *base_filepath, size_t max_size,
+                             int flags, ConfigStoreReplicaType rtype)
+{
+    if (s->_base_path != NULL) {
+        errno = EALREADY;
+        return -1;
+    }
+
+    s->_base_path = strdup(base_filepath);
+    if (s->_base_path == NULL) {
+        return -1;
+    }
+
+    s->_max_size = max_size;
+    s->_flags = flags;
+    s->_replica_type = rtype;
+
+    return 0;
+}
+
+ConfigStore *ConfigStore_StoreSetGet(ConfigStoreSet *s, const char *name)
+{
+    if ((s->_base_path == NULL) || !Impl_IsValidNamespace(name)) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct ConfigStoreNamespace *ns = Impl_FindNamespace(s, name);
+    if (ns != NULL) {
+        // A commit in swap mode closes the store.
+        if ((ns->store._fd < 0) && Impl_OpenNamespace(s, ns)) {
+            return NULL;
+        }
+        return &ns->store;
+    }
+
+    if (s->_count == s->_capacity) {
+        size_t capacity = s->_capacity ? (s->_capacity * 2) : 4;
+        struct ConfigStoreNamespace **namespaces =
+            realloc(s->_namespaces, capacity * sizeof(*namespaces));
+        if (namespaces == NULL) {
+            return NULL;
+        }
+        s->_namespaces = namespaces;
+        s->_capacity = capacity;
+    }
+
+    // Allocated one by one so the stores handed out don't move.
+    ns = malloc(sizeof(*ns));
+    if (ns == NULL) {
+        return NULL;
+    }
+    strcpy(ns->name, name);
+    ns->shared_view_name = NULL;
+
+    // Each namespace publishes its own image, so it needs its own shared memory object.
+    ConfigStoreOptions options = s->_options;
+    if (options.shared_view_name != NULL) {
+        ns->shared_view_name = Impl_NamespaceName(options.shared_view_name, name);
+        if (ns->shared_view_name == NULL) {
+            free(ns);
+            return NULL;
+        }
+        options.shared_view_name = ns->shared_view_name;
+    }
+
+    ConfigStore_Init(&ns->store);
+    ConfigStore_SetOptions(&ns->store, &options);
+
+    if (Impl_OpenNamespace(s, ns)) {
+        int error = errno;
+        ConfigStore_Close(&ns->store);
+        free(ns->shared_view_name);
+        free(ns);
+        errno = error;
+        return NULL;
+    }
+
+    s->_namespaces[s->_count++] = ns;
+    return &ns->store;
+}
+
+bool ConfigStore_StoreSetIsLoaded(const ConfigStoreSet *s, const char *name)
+{
+    const struct ConfigStoreNamespace *ns = name ? Impl_FindNamespace(s, name) : NULL;
+    return (ns != NULL) && (ns->store._fd >= 0);
+}
+
+int ConfigStore_StoreSetCommit(ConfigStoreSet *s)
+{
+    int res = 0;
+    int error = 0;
+
+    for (size_t i = 0; i < s->_count; ++i) {
+        ConfigStore *store = &s->_namespaces[i]->store;
+        if ((store->_fd >= 0) && ConfigStore_Commit(store)) {
+            res = -1;
+            error = errno;
+        }
+    }
+
+    if (res != 0) {
+        errno = error;
+    }
+    return res;
+}
+
+void ConfigStore_StoreSetClose(ConfigStoreSet *s)
+{
+    for (size_t i = 0; i < s->_count; ++i) {
+        ConfigStore_Close(&s->_namespaces[i]->store);
+        free(s->_namespaces[i]->shared_view_name);
+        free(s->_namespaces[i]);
+    }
+    free(s->_namespaces);
+    free(s->_base_path);
+
+    ConfigStore_StoreSetInit(s);
+}
@@ -0,0 +1,742 @@
+#include <config_store.h>
+#include <config_store.hpp>
+
+#include <benchmark/benchmark.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace config
+{
+
+// tmpfs, so the benchmarks measure the store rather than the disk.
+static const char *BenchDir()
+{
+    const char *dir = getenv("AZSCFGSTO_BENCH_DIR");
+    return dir ? dir : "/dev/shm";
+}
+
+static constexpr size_t BenchMaxSize = 64 * 1024;
+
+// Keys are even so that odd keys are guaranteed misses.
+static constexpr ConfigStoreKey KeyStride = 2;
+
+static std::string BenchPath(const char *name)
+{
+    return std::string(BenchDir()) + "/azscfgsto-bench-" + name + "-" + std::to_string(getpid());
+}
+
+static void RemoveStore(const std::string &path)
+{
+    unlink(path.c_str());
+    unlink((path + ".tmp").c_str());
+}
+
+static int OpenStore(ConfigStore *sto, const std::string &path, ConfigStoreReplicaType rtype,
+                     int flags = O_RDWR | O_CREAT)
+{
+    ConfigStore_Init(sto);
+    return ConfigStore_Open(sto, path.c_str(), BenchMaxSize, flags, rtype);
+}
+
+// Fills the store with kvp_count KVPs adding up to roughly store_size bytes.
+static void FillStore(ConfigStore *sto, size_t kvp_count, size_t store_size)
+{
+    size_t kvp_size = store_size / kvp_count;
+    size_t value_size = (kvp_size > sizeof(ConfigStoreKvpHeader))
+                            ? (kvp_size - sizeof(ConfigStoreKvpHeader))
+                            : 0;
+    std::vector<uint8_t> value(value_size, 0x5A);
+
+    ConfigStore_ReserveCapacity(sto, sizeof(ConfigStoreFileHeader) +
+                                         kvp_count * (sizeof(ConfigStoreKvpHeader) + value_size));
+    for (size_t i = 0; i < kvp_count; ++i) {
+        ConfigStoreKvpHeader *kvp =
+            ConfigStore_InsertKvp(sto, ConfigStore_EndKvp(sto), i * KeyStride, value_size);
+        ConfigStore_WriteValue(kvp, 0, value.data(), value_size);
+    }
+}
+
+static void CreateStoreFile(const std::string &path, size_t kvp_count, size_t store_size)
+{
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvp_count, store_size);
+    ConfigStore_Commit(&sto);
+    ConfigStore_Close(&sto);
+}
+
+// Store sizes from 1 KB to 60 KB and KVP counts from 1 to 5000, skipping the combinations that
+// can't fit.
+static void StoreShapes(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"kvps", "bytes"});
+    for (int64_t bytes : {1024, 8 * 1024, 60 * 1024}) {
+        for (int64_t kvps : {1, 16, 128, 1024, 5000}) {
+            if ((size_t)kvps * sizeof(ConfigStoreKvpHeader) <= (size_t)bytes) {
+                b->Args({kvps, bytes});
+            }
+        }
+    }
+}
+
+static void WithReplicaTypes(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"replica", "kvps", "bytes"});
+    for (int64_t rtype : {ConfigStoreReplica_None, ConfigStoreReplica_Swap}) {
+        for (int64_t bytes : {1024, 60 * 1024}) {
+            for (int64_t kvps : {1, 1024}) {
+                if ((size_t)kvps * sizeof(ConfigStoreKvpHeader) <= (size_t)bytes) {
+                    b->Args({rtype, kvps, bytes});
+                }
+            }
+        }
+    }
+}
+
+static void BM_OpenNew(benchmark::State &state)
+{
+    auto path = BenchPath("open-new");
+    auto rtype = (ConfigStoreReplicaType)state.range(0);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        RemoveStore(path);
+        state.ResumeTiming();
+
+        ConfigStore sto;
+        if (OpenStore(&sto, path, rtype)) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        ConfigStore_Close(&sto);
+    }
+
+    RemoveStore(path);
+}
+BENCHMARK(BM_OpenNew)->ArgName("replica")->Arg(ConfigStoreReplica_None)->Arg(ConfigStoreReplica_Swap);
+
+static void BM_OpenExisting(benchmark::State &state)
+{
+    auto path = BenchPath("open-existing");
+    auto rtype = (ConfigStoreReplicaType)state.range(0);
+    CreateStoreFile(path, state.range(1), state.range(2));
+
+    for (auto _ : state) {
+        ConfigStore sto;
+        if (OpenStore(&sto, path, rtype, O_RDWR)) {
+            state.SkipWithError("open failed");
+            break;
+        }
+        ConfigStore_Close(&sto);
+    }
+
+    state.SetBytesProcessed(state.iterations() * state.range(2));
+    RemoveStore(path);
+}
+BENCHMARK(BM_OpenExisting)->Apply(WithReplicaTypes);
+
+static void BM_Commit(benchmark::State &state)
+{
+    auto path = BenchPath("commit");
+    auto rtype = (ConfigStoreReplicaType)state.range(0);
+    CreateStoreFile(path, state.range(1), state.range(2));
+
+    // Swap commits close the store, so in that mode it's opened by every iteration instead.
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    if ((rtype != ConfigStoreReplica_Swap) && OpenStore(&sto, path, rtype, O_RDWR)) {
+        state.SkipWithError("open failed");
+    }
+    uint8_t counter = 0;
+
+    for (auto _ : state) {
+        if (rtype == ConfigStoreReplica_Swap) {
+            state.PauseTiming();
+            int res = OpenStore(&sto, path, rtype, O_RDWR);
+            state.ResumeTiming();
+            if (res) {
+                state.SkipWithError("open failed");
+                break;
+            }
+        }
+
+        // Change the content so every commit has something to write.
+        ++counter;
+        ConfigStore_PutUniqueKey(&sto, 1, &counter, sizeof(counter));
+
+        if (ConfigStore_Commit(&sto)) {
+            state.SkipWithError("commit failed");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * state.range(2));
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_Commit)->Apply(WithReplicaTypes);
+
+static void BM_TryGetKey(benchmark::State &state, bool hit)
+{
+    auto path = BenchPath("get");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    size_t i = 0;
+    for (auto _ : state) {
+        // Hits cycle through every key; misses probe the odd keys in between.
+        ConfigStoreKey key = (i % kvps) * KeyStride + (hit ? 0 : 1);
+        benchmark::DoNotOptimize(ConfigStore_TryGetKey(&sto, key));
+        ++i;
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK_CAPTURE(BM_TryGetKey, hit, true)->Apply(StoreShapes);
+BENCHMARK_CAPTURE(BM_TryGetKey, miss, false)->Apply(StoreShapes);
+
+static void BM_PutUniqueKey(benchmark::State &state)
+{
+    auto path = BenchPath("put");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    size_t value_size = ConfigStore_TryGetKey(&sto, 0)->size - sizeof(ConfigStoreKvpHeader);
+    std::vector<uint8_t> value(value_size, 0xA5);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        // Replace an existing key with a value of the same size.
+        ConfigStoreKey key = (i % kvps) * KeyStride;
+        benchmark::DoNotOptimize(ConfigStore_PutUniqueKey(&sto, key, value.data(), value_size));
+        ++i;
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_PutUniqueKey)->Apply(StoreShapes);
+
+static void BM_PutUniqueKeyResize(benchmark::State &state)
+{
+    auto path = BenchPath("put-resize");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    size_t value_size = ConfigStore_TryGetKey(&sto, 0)->size - sizeof(ConfigStoreKvpHeader);
+    if (value_size < sizeof(ConfigStoreKvpHeader)) {
+        state.SkipWithError("values too small to shrink");
+        return;
+    }
+    std::vector<uint8_t> value(value_size, 0xA5);
+
+    size_t i = 0;
+    for (auto _ : state) {
+        // Alternately shrink and grow back a KVP in the middle of the store.
+        size_t size = (i % 2) ? value_size : (value_size - sizeof(ConfigStoreKvpHeader));
+        ConfigStoreKey key = (kvps / 2) * KeyStride;
+        benchmark::DoNotOptimize(ConfigStore_PutUniqueKey(&sto, key, value.data(), size));
+        ++i;
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_PutUniqueKeyResize)->Apply(StoreShapes);
+
+static void BM_AllocUniqueKvp(benchmark::State &state)
+{
+    auto path = BenchPath("alloc");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    for (auto _ : state) {
+        // The first free even key is past every existing one.
+        ConfigStoreKvpHeader *kvp = ConfigStore_AllocUniqueKvp(&sto, 0, 0xF000, 4, KeyStride);
+        if (kvp == NULL) {
+            state.SkipWithError("alloc failed");
+            break;
+        }
+
+        state.PauseTiming();
+        ConfigStore_EraseKvp(&sto, kvp);
+        state.ResumeTiming();
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_AllocUniqueKvp)->Apply(StoreShapes);
+
+static void BM_ReplaceMiddleKvp(benchmark::State &state)
+{
+    auto path = BenchPath("replace");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    ConfigStoreKey key = (kvps / 2) * KeyStride;
+    size_t value_size = ConfigStore_TryGetKey(&sto, key)->size - sizeof(ConfigStoreKvpHeader);
+
+    for (auto _ : state) {
+        // Erase a KVP in the middle of the store and put it back; the hole is reused.
+        ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, key));
+        benchmark::DoNotOptimize(ConfigStore_PutUniqueKey(&sto, key, NULL, value_size));
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_ReplaceMiddleKvp)->Apply(StoreShapes);
+
+static void BM_EraseKeysInRange(benchmark::State &state)
+{
+    auto path = BenchPath("erase");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        ConfigStore_EraseKeysInRange(&sto, 0, 0xF000, 1);
+        FillStore(&sto, kvps, state.range(1));
+        state.ResumeTiming();
+
+        // Erase every other KVP.
+        ConfigStore_EraseKeysInRange(&sto, 0, 0xF000, KeyStride * 2);
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_EraseKeysInRange)->Apply(StoreShapes);
+
+static void BM_GetNextKvpInRange(benchmark::State &state)
+{
+    auto path = BenchPath("range");
+    size_t kvps = state.range(0);
+
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, kvps, state.range(1));
+
+    for (auto _ : state) {
+        // Visit every fourth KVP, like iterating one field of every network.
+        size_t n = 0;
+        for (ConfigStoreKvpHeader *it = ConfigStore_GetNextKvpInRange(&sto, NULL, 0, 0xF000, 8);
+             it != ConfigStore_EndKvp(&sto);
+             it = ConfigStore_GetNextKvpInRange(&sto, it, 0, 0xF000, 8)) {
+            ++n;
+        }
+        benchmark::DoNotOptimize(n);
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_GetNextKvpInRange)->Apply(StoreShapes);
+
+static void BM_ValidateFormat(benchmark::State &state)
+{
+    auto path = BenchPath("validate");
+    CreateStoreFile(path, state.range(0), state.range(1));
+
+    std::vector<uint8_t> image;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (f != NULL) {
+        fseek(f, 0, SEEK_END);
+        image.resize(ftell(f));
+        fseek(f, 0, SEEK_SET);
+        if (fread(image.data(), 1, image.size(), f) != image.size()) {
+            image.clear();
+        }
+        fclose(f);
+    }
+
+    for (auto _ : state) {
+        if (ConfigStore_ValidateFormat(image.data(), image.size()) == 0) {
+            state.SkipWithError("invalid store");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * image.size());
+    RemoveStore(path);
+}
+BENCHMARK(BM_ValidateFormat)->Apply(StoreShapes);
+
+// Image of a large valid store of 1 KB KVPs, built in memory.
+static std::vector<uint8_t> LargeStoreImage(size_t size)
+{
+    std::vector<uint8_t> image(sizeof(ConfigStoreFileHeader));
+    const size_t kvp_size = 1024;
+    for (ConfigStoreKey key = 0; image.size() + kvp_size <= size; key += KeyStride) {
+        ConfigStoreKvpHeader kvp = {key, (uint16_t)kvp_size};
+        image.insert(image.end(), (uint8_t *)&kvp, (uint8_t *)(&kvp + 1));
+        image.resize(image.size() + kvp_size - sizeof(kvp), (uint8_t)key);
+    }
+
+    ConfigStoreFileHeader header = {{ConfigStoreFileHeaderKey, sizeof(header)},
+                                    ConfigStoreFileSignature,
+                                    ConfigStoreFileVersion,
+                                    (uint32_t)image.size(),
+                                    0};
+    header.crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, &image[sizeof(header)],
+                                    image.size() - sizeof(header));
+    memcpy(image.data(), &header, sizeof(header));
+    return image;
+}
+
+// Serial (threads = 1) against parallel validation of stores of several namespaces' worth.
+static void BM_ValidateFormatParallel(benchmark::State &state)
+{
+    auto image = LargeStoreImage(state.range(0));
+    unsigned threads = state.range(1);
+
+    for (auto _ : state) {
+        size_t size = (threads == 1) ? ConfigStore_ValidateFormat(image.data(), image.size())
+                                     : ConfigStore_ValidateFormatParallel(image.data(),
+                                                                          image.size(), threads);
+        if (size == 0) {
+            state.SkipWithError("invalid store");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * image.size());
+}
+BENCHMARK(BM_ValidateFormatParallel)
+    ->ArgNames({"bytes", "threads"})
+    ->ArgsProduct({{64 * 1024, 256 * 1024, 1024 * 1024}, {1, 2, 4}})
+    ->UseRealTime();
+
+// PEM-like text, which compresses about as well as certificates and PAC files do.
+static std::vector<uint8_t> CompressibleValue(size_t size)
+{
+    std::string text;
+    for (int i = 0; text.size() < size; ++i) {
+        text += "MIIDdzCCAl+gAwIBAgIEAgAAuTANBgkqhkiG9w0BAQUFADBaMQswCQYDVQQGEwJJ" + std::to_string(i) +
+                "\n";
+    }
+    return std::vector<uint8_t>(text.begin(), text.begin() + size);
+}
+
+static void BM_PutValue(benchmark::State &state)
+{
+    auto path = BenchPath("put-value");
+    std::vector<uint8_t> value = CompressibleValue(state.range(1));
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ConfigStoreOptions options = {};
+    options.compress_threshold = state.range(0);
+    ConfigStore_SetOptions(&sto, &options);
+    RemoveStore(path);
+    ConfigStore_Open(&sto, path.c_str(), 256 * 1024, O_RDWR | O_CREAT, ConfigStoreReplica_None);
+
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(ConfigStore_PutValue(&sto, 1, value.data(), value.size()));
+    }
+
+    ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, 1);
+    state.counters["stored"] = kvp ? ConfigStore_GetChunkedValueSize(&sto, kvp) : 0;
+    state.SetBytesProcessed(state.iterations() * value.size());
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+
+static void BM_ReadValue(benchmark::State &state)
+{
+    auto path = BenchPath("read-value");
+    std::vector<uint8_t> value = CompressibleValue(state.range(1));
+    std::vector<uint8_t> read(value.size());
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ConfigStoreOptions options = {};
+    options.compress_threshold = state.range(0);
+    ConfigStore_SetOptions(&sto, &options);
+    RemoveStore(path);
+    ConfigStore_Open(&sto, path.c_str(), 256 * 1024, O_RDWR | O_CREAT, ConfigStoreReplica_None);
+    ConfigStoreKvpHeader *kvp = ConfigStore_PutValue(&sto, 1, value.data(), value.size());
+
+    for (auto _ : state) {
+        if (ConfigStore_ReadValue(&sto, kvp, read.data(), read.size())) {
+            state.SkipWithError("read failed");
+            break;
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * value.size());
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+
+// Uncompressed and compressed, for values from 4 KB to 128 KB.
+static void WithCompression(benchmark::internal::Benchmark *b)
+{
+    b->ArgNames({"threshold", "bytes"});
+    for (int64_t threshold : {0, 256}) {
+        for (int64_t bytes : {4 * 1024, 32 * 1024, 128 * 1024}) {
+            b->Args({threshold, bytes});
+        }
+    }
+}
+BENCHMARK(BM_PutValue)->Apply(WithCompression);
+BENCHMARK(BM_ReadValue)->Apply(WithCompression);
+
+// The C++ wrapper against the C API it wraps, doing the same work: the pairs should match.
+
+static void BM_IterateC(benchmark::State &state)
+{
+    auto path = BenchPath("iterate-c");
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    FillStore(&sto, state.range(0), state.range(1));
+
+    for (auto _ : state) {
+        size_t sum = 0;
+        ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(&sto);
+        for (ConfigStoreKvpHeader *it = ConfigStore_BeginKvp(&sto); it != it_end;
+             it = ConfigStore_GetNextKvp(it, it_end)) {
+            sum += it->key;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_IterateC)->Apply(StoreShapes);
+
+static void BM_IterateCpp(benchmark::State &state)
+{
+    auto path = BenchPath("iterate-cpp");
+    Store sto;
+    RemoveStore(path);
+    OpenStore(sto.native(), path, ConfigStoreReplica_None);
+    FillStore(sto.native(), state.range(0), state.range(1));
+
+    for (auto _ : state) {
+        size_t sum = 0;
+        for (const auto &kvp : sto) {
+            sum += kvp.key;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    sto.close();
+    RemoveStore(path);
+}
+BENCHMARK(BM_IterateCpp)->Apply(StoreShapes);
+
+static void BM_GetC(benchmark::State &state)
+{
+    auto path = BenchPath("get-c");
+    size_t kvps = state.range(0);
+    ConfigStore sto;
+    RemoveStore(path);
+    OpenStore(&sto, path, ConfigStoreReplica_None);
+    for (size_t i = 0; i < kvps; ++i) {
+        uint32_t value = i;
+        ConfigStore_PutUniqueKey(&sto, i * KeyStride, (const uint8_t *)&value, sizeof(value));
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        uint32_t value = 0;
+        ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, (i++ % kvps) * KeyStride);
+        if ((kvp != NULL) && (kvp->size == sizeof(*kvp) + sizeof(value))) {
+            memcpy(&value, kvp + 1, sizeof(value));
+        }
+        benchmark::DoNotOptimize(value);
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+}
+BENCHMARK(BM_GetC)->ArgName("kvps")->Arg(16)->Arg(1024);
+
+static void BM_GetCpp(benchmark::State &state)
+{
+    auto path = BenchPath("get-cpp");
+    size_t kvps = state.range(0);
+    Store sto;
+    RemoveStore(path);
+    OpenStore(sto.native(), path, ConfigStoreReplica_None);
+    for (size_t i = 0; i < kvps; ++i) {
+        sto.put<uint32_t>(i * KeyStride, i);
+    }
+
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(sto.get<uint32_t>((i++ % kvps) * KeyStride).value_or(0));
+    }
+
+    sto.close();
+    RemoveStore(path);
+}
+BENCHMARK(BM_GetCpp)->ArgName("kvps")->Arg(16)->Arg(1024);
+
+// A strided range scanned with the runtime range against the same KeyRange known at compile time.
+
+using EveryFourthKvp = KeyRange<0, 0xF000, 4 * KeyStride>;
+
+static void BM_RangeRuntime(benchmark::State &state)
+{
+    auto path = BenchPath("range-runtime");
+    Store sto;
+    RemoveStore(path);
+    OpenStore(sto.native(), path, ConfigStoreReplica_None);
+    FillStore(sto.native(), state.range(0), state.range(1));
+
+    for (auto _ : state) {
+        size_t sum = 0;
+        for (const auto &kvp :
+             sto.range(EveryFourthKvp::first, EveryFourthKvp::last, EveryFourthKvp::stride)) {
+            sum += kvp.key;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    sto.close();
+    RemoveStore(path);
+}
+BENCHMARK(BM_RangeRuntime)->Apply(StoreShapes);
+
+static void BM_RangeSchema(benchmark::State &state)
+{
+    auto path = BenchPath("range-schema");
+    Store sto;
+    RemoveStore(path);
+    OpenStore(sto.native(), path, ConfigStoreReplica_None);
+    FillStore(sto.native(), state.range(0), state.range(1));
+
+    for (auto _ : state) {
+        size_t sum = 0;
+        for (const auto &kvp : sto.range<EveryFourthKvp>()) {
+            sum += kvp.key;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+
+    sto.close();
+    RemoveStore(path);
+}
+BENCHMARK(BM_RangeSchema)->Apply(StoreShapes);
+
+static constexpr size_t ProvisionKvps = 10000;
+static constexpr size_t ProvisionValueSize = 16;
+static constexpr size_t ProvisionMaxSize = 1024 * 1024;
+
+// Stream of a provisioned store of 10k KVPs, as ConfigStore_ExportBegin produces it.
+static std::vector<uint8_t> ProvisionStream(const std::string &path)
+{
+    ConfigStore sto;
+    RemoveStore(path);
+    ConfigStore_Init(&sto);
+    ConfigStore_Open(&sto, path.c_str(), ProvisionMaxSize, O_RDWR | O_CREAT,
+                     ConfigStoreReplica_None);
+    FillStore(&sto, ProvisionKvps,
+              ProvisionKvps * (sizeof(ConfigStoreKvpHeader) + ProvisionValueSize));
+
+    std::vector<uint8_t> stream;
+    ConfigStoreExporter ex;
+    if (ConfigStore_ExportBegin(&ex, &sto) == 0) {
+        const uint8_t *data;
+        for (size_t size; (size = ConfigStore_ExportNext(&ex, &data)) != 0;) {
+            stream.insert(stream.end(), data, data + size);
+        }
+        ConfigStore_ExportEnd(&ex);
+    }
+
+    ConfigStore_Close(&sto);
+    RemoveStore(path);
+    return stream;
+}
+
+// Builds a store of 10k KVPs into a new file, by putting each KVP (import = 0) or by importing a
+// sorted stream in 16 KB pieces (import = 1).
+static void BM_Provision(benchmark::State &state)
+{
+    auto path = BenchPath("provision");
+    bool import = state.range(0);
+    auto stream = ProvisionStream(path);
+    std::vector<uint8_t> value(ProvisionValueSize, 0x5A);
+
+    for (auto _ : state) {
+        state.PauseTiming();
+        ConfigStore sto;
+        RemoveStore(path);
+        ConfigStore_Init(&sto);
+        ConfigStore_Open(&sto, path.c_str(), ProvisionMaxSize, O_RDWR | O_CREAT,
+                         ConfigStoreReplica_None);
+        state.ResumeTiming();
+
+        if (import) {
+            ConfigStoreImporter im;
+            bool ok = (ConfigStore_ImportBegin(&im, &sto) == 0);
+            for (size_t offset = 0; ok && (offset < stream.size()); offset += 16 * 1024) {
+                size_t size = std::min<size_t>(16 * 1024, stream.size() - offset);
+                ok = (ConfigStore_ImportUpdate(&im, &stream[offset], size) == 0);
+            }
+            if (!ok || ConfigStore_ImportEnd(&im)) {
+                state.SkipWithError("import failed");
+            }
+        } else {
+            for (size_t i = 0; i < ProvisionKvps; ++i) {
+                if (ConfigStore_PutUniqueKey(&sto, i * KeyStride, value.data(), value.size()) ==
+                    NULL) {
+                    state.SkipWithError("put failed");
+                    break;
+                }
+            }
+        }
+
+        state.PauseTiming();
+        const ConfigStoreKey *keys;
+        if (ConfigStore_GetIndexedKeys(&sto, &keys) != ProvisionKvps) {
+            state.SkipWithError("wrong KVP count");
+        }
+        ConfigStore_Close(&sto);
+        state.ResumeTiming();
+    }
+
+    state.SetItemsProcessed(state.iterations() * ProvisionKvps);
+    RemoveStore(path);
+}
+BENCHMARK(BM_Provision)->ArgName("import")->Arg(0)->Arg(1)->Unit(benchmark::kMillisecond);
+
+} // namespace config
@@ -1,4 +1,6 @@
 #include <config_store.h>
+#include <config_store.hpp>
+#include <config_store_set.h>
 
 #include <ftw.h>
 #include <fcntl.h>
@@ -9,6 +11,15 @@
 #include <dirent.h>
 #include <strings.h>
 #include <malloc.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
 
 namespace config
 {
@@ -159,4 +170,1845 @@ TEST_F(ConfigStoreTests, WriterCanAddEntryToFile)
     ConfigStore_Close(&sto);
 }
 
+TEST_F(ConfigStoreTests, LookupsFollowKvpOrderAfterEditsAndReopen)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    // Enough keys to go through the vectorized scans and the scalar tail.
+    constexpr ConfigStoreKey AnyFirstKey = 100;
+    constexpr ConfigStoreKey AnyStride = 3;
+    constexpr size_t AnyCount = 37;
+    for (size_t i = 0; i < AnyCount; ++i) {
+        uint32_t value = i;
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, AnyFirstKey + i * AnyStride, (uint8_t *)&value,
+                                           sizeof(value)),
+                  nullptr);
+    }
+
+    // Insert a duplicate at the front: lookups must return the first one in KVP order.
+    auto front = ConfigStore_InsertKvp(&sto, ConfigStore_BeginKvp(&sto), AnyFirstKey + 30, 0);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, AnyFirstKey + 30), front);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, AnyFirstKey + 1), nullptr);
+    ConfigStore_EraseKvp(&sto, front);
+
+    auto it = ConfigStore_TryGetKey(&sto, AnyFirstKey + 20 * AnyStride);
+    ASSERT_NE(it, nullptr);
+    ASSERT_EQ(*(uint32_t *)(it + 1), 20u);
+
+    // Every other KVP in the stride.
+    size_t matches = 0;
+    for (it = ConfigStore_GetNextKvpInRange(&sto, nullptr, AnyFirstKey, 0xF000, AnyStride * 2);
+         it != ConfigStore_EndKvp(&sto);
+         it = ConfigStore_GetNextKvpInRange(&sto, it, AnyFirstKey, 0xF000, AnyStride * 2)) {
+        ASSERT_EQ((it->key - AnyFirstKey) % (AnyStride * 2), 0);
+        ++matches;
+    }
+    ASSERT_EQ(matches, (AnyCount + 1) / 2);
+
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, AnyFirstKey, 0xF000, AnyStride * 2), 0);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, AnyFirstKey), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDONLY,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    for (size_t i = 0; i < AnyCount; ++i) {
+        it = ConfigStore_TryGetKey(&sto, AnyFirstKey + i * AnyStride);
+        if (i % 2 == 0) {
+            ASSERT_EQ(it, nullptr);
+        } else {
+            ASSERT_NE(it, nullptr);
+            ASSERT_EQ(*(uint32_t *)(it + 1), i);
+        }
+    }
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, LookupFilterAnswersMissesAfterErase)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    for (ConfigStoreKey key = 0; key < 64; ++key) {
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, key, nullptr, 0), nullptr);
+    }
+
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 0, 32, 1), 0);
+
+    ConfigStoreLookupFilterStats before;
+    ConfigStore_GetLookupFilterStats(&sto, &before);
+
+    // Erased and never-inserted keys are both misses; the rest must still be found.
+    for (ConfigStoreKey key = 0; key < 1024; ++key) {
+        bool expected = (32 <= key) && (key < 64);
+        ASSERT_EQ(ConfigStore_TryGetKey(&sto, key) != nullptr, expected) << key;
+    }
+
+    ConfigStoreLookupFilterStats after;
+    ConfigStore_GetLookupFilterStats(&sto, &after);
+
+    ASSERT_EQ(after.lookups - before.lookups, 1024u);
+    ASSERT_EQ((after.filtered - before.filtered) + (after.false_positives - before.false_positives),
+              1024u - 32u);
+    ASSERT_GT(after.filtered - before.filtered, after.false_positives - before.false_positives);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, SnapshotsStayImmutableAcrossCommits)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ConfigStoreOptions options = {};
+    options.publish_snapshots = true;
+    ConfigStore_SetOptions(&sto, &options);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    constexpr ConfigStoreKey AnyKey = 7;
+    constexpr uint32_t Commits = 200;
+
+    // Published on open: empty.
+    ConfigStoreSnapshot *first = ConfigStore_Snapshot(&sto);
+    ASSERT_NE(first, nullptr);
+    ASSERT_EQ(ConfigStore_SnapshotBeginKvp(first), ConfigStore_SnapshotEndKvp(first));
+
+    std::atomic<bool> done{false};
+    std::atomic<uint32_t> bad{0};
+    std::thread reader([&] {
+        uint32_t last_seen = 0;
+        while (!done) {
+            ConfigStoreSnapshot *s = ConfigStore_Snapshot(&sto);
+            const ConfigStoreKvpHeader *kvp = ConfigStore_SnapshotTryGetKey(s, AnyKey);
+            if (kvp != nullptr) {
+                uint32_t seen = *(const uint32_t *)(kvp + 1);
+                // Values only go up, and a snapshot never changes under the reader.
+                if ((seen < last_seen) || (seen != *(const uint32_t *)(kvp + 1))) {
+                    ++bad;
+                }
+                last_seen = seen;
+            }
+            ConfigStore_SnapshotRelease(s);
+        }
+    });
+
+    for (uint32_t i = 1; i <= Commits; ++i) {
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, AnyKey, (const uint8_t *)&i, sizeof(i)), nullptr);
+        ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    }
+
+    // Uncommitted changes aren't visible.
+    uint32_t uncommitted = Commits + 1;
+    ConfigStore_PutUniqueKey(&sto, AnyKey, (const uint8_t *)&uncommitted, sizeof(uncommitted));
+
+    done = true;
+    reader.join();
+    ASSERT_EQ(bad, 0u);
+
+    ConfigStoreSnapshot *last = ConfigStore_Snapshot(&sto);
+    ASSERT_EQ(*(const uint32_t *)(ConfigStore_SnapshotTryGetKey(last, AnyKey) + 1), Commits);
+    ASSERT_EQ(ConfigStore_SnapshotBeginKvp(first), ConfigStore_SnapshotEndKvp(first));
+
+    // Snapshots outlive the store.
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(ConfigStore_Snapshot(&sto), nullptr);
+    ASSERT_EQ(*(const uint32_t *)(ConfigStore_SnapshotTryGetKey(last, AnyKey) + 1), Commits);
+    ConfigStore_SnapshotRelease(last);
+    ConfigStore_SnapshotRelease(first);
+}
+
+TEST_F(ConfigStoreTests, WatchReportsOnlyRealCommits)
+{
+    auto file_name = GetCurrentTestName();
+    auto path = std::string(TempTestDir) + "/" + file_name;
+
+    ConfigStoreWatch watch;
+    ConfigStore_WatchInit(&watch);
+    ASSERT_EQ(ConfigStore_WatchOpen(&watch, path.c_str()), 0) << errno;
+
+    pollfd pfd = {ConfigStore_WatchGetFd(&watch), POLLIN, 0};
+    ASSERT_EQ(poll(&pfd, 1, 0), 0);
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    // Swap commits close the store.
+    constexpr uint8_t AnyData[] = {1, 2, 3};
+    ASSERT_EQ(ConfigStore_Open(&sto, path.c_str(), AnyMaxSize, O_RDWR | O_CREAT,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    ASSERT_EQ(poll(&pfd, 1, 0), 1);
+    ASSERT_EQ(ConfigStore_WatchConsume(&watch), 1);
+    ASSERT_EQ(poll(&pfd, 1, 0), 0);
+
+    // Same content: notified, but not a change.
+    ASSERT_EQ(ConfigStore_Open(&sto, path.c_str(), AnyMaxSize, O_RDWR, ConfigStoreReplica_Swap), 0)
+        << errno;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(ConfigStore_WatchConsume(&watch), 0);
+
+    // In-place commits are reported while the writer keeps the file open.
+    ASSERT_EQ(ConfigStore_Open(&sto, path.c_str(), AnyMaxSize, O_RDWR, ConfigStoreReplica_None), 0)
+        << errno;
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 1, 2, 1), 0);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(poll(&pfd, 1, 0), 1);
+    ASSERT_EQ(ConfigStore_WatchConsume(&watch), 1);
+
+    // A header written ahead of its content isn't a change until the content matches it.
+    ConfigStoreFileHeader header;
+    int fd = open(path.c_str(), O_RDWR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(pread(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+    header.crc = ~header.crc;
+    ASSERT_EQ(pwrite(fd, &header, sizeof(header), 0), (ssize_t)sizeof(header));
+    close(fd);
+    ASSERT_EQ(ConfigStore_WatchConsume(&watch), 0);
+
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(ConfigStore_WatchConsume(&watch), 1);
+    ConfigStore_Close(&sto);
+
+    ConfigStore_WatchClose(&watch);
+}
+
+TEST_F(ConfigStoreTests, SharedViewFollowsCommits)
+{
+    auto file_name = GetCurrentTestName();
+    auto shm_name = "/azscfgsto-" + file_name + "-" + std::to_string(getpid());
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ConfigStoreOptions options = {};
+    options.shared_view_name = shm_name.c_str();
+    ConfigStore_SetOptions(&sto, &options);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    ConfigStoreSharedView view;
+    ConfigStore_SharedViewInit(&view);
+    ASSERT_EQ(ConfigStore_SharedViewOpen(&view, shm_name.c_str()), 0) << errno;
+
+    const ConfigStoreKvpHeader *first;
+    const ConfigStoreKvpHeader *last;
+    uint32_t seq;
+    ASSERT_EQ(ConfigStore_SharedViewBegin(&view, &seq, &first, &last), 0) << errno;
+    ASSERT_EQ(first, last);
+    ASSERT_FALSE(ConfigStore_SharedViewRetry(&view, seq));
+
+    constexpr uint8_t AnyData[] = {0x94, 0xa9, 0xbe};
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 42, AnyData, sizeof(AnyData)), nullptr);
+
+    // Not published until committed.
+    ASSERT_FALSE(ConfigStore_SharedViewRetry(&view, seq));
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_TRUE(ConfigStore_SharedViewRetry(&view, seq));
+
+    ASSERT_EQ(ConfigStore_SharedViewBegin(&view, &seq, &first, &last), 0) << errno;
+    ASSERT_NE(first, last);
+    ASSERT_EQ(first->key, 42);
+    ASSERT_EQ(memcmp(first + 1, AnyData, sizeof(AnyData)), 0);
+    ASSERT_EQ(ConfigStore_GetNextKvp(first, last), last);
+    ASSERT_FALSE(ConfigStore_SharedViewRetry(&view, seq));
+
+    // The view outlives the writer.
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(ConfigStore_SharedViewBegin(&view, &seq, &first, &last), 0) << errno;
+    ASSERT_EQ(first->key, 42);
+
+    // The object is private to the user.
+    struct stat st;
+    int fd = shm_open(shm_name.c_str(), O_RDWR, 0);
+    ASSERT_GE(fd, 0) << errno;
+    ASSERT_EQ(fstat(fd, &st), 0);
+    ASSERT_EQ(st.st_mode & 0777, 0600u);
+
+    // A writer that died mid-publication doesn't hang readers.
+    auto *image_seq = static_cast<uint32_t *>(
+        mmap(nullptr, sizeof(uint32_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    ASSERT_NE(image_seq, MAP_FAILED);
+    *image_seq = seq + 1;
+    ASSERT_EQ(ConfigStore_SharedViewBegin(&view, &seq, &first, &last), -1);
+    ASSERT_EQ(errno, ETIMEDOUT);
+    munmap(image_seq, sizeof(uint32_t));
+
+    // Nor is an object that others can access reused.
+    ASSERT_EQ(fchmod(fd, 0644), 0);
+    close(fd);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              -1);
+    ASSERT_EQ(errno, EPERM);
+    ConfigStore_Close(&sto);
+
+    ConfigStore_SharedViewClose(&view);
+    shm_unlink(shm_name.c_str());
+}
+
+TEST_F(ConfigStoreTests, StatsCountOperations)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ConfigStoreStats stats;
+
+#ifndef CONFIG_STORE_ENABLE_STATS
+    ASSERT_EQ(ConfigStore_GetStats(&sto, &stats), -1);
+    ASSERT_EQ(errno, ENOTSUP);
+#else
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+
+    constexpr uint8_t AnyData[] = {0x94, 0xa9, 0xbe, 0xb0};
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 2, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    // Stats survive the close done by the swap commit, and the next open.
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDONLY,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    ASSERT_NE(ConfigStore_TryGetKey(&sto, 2), nullptr);
+
+    constexpr uint64_t FileSize =
+        sizeof(ConfigStoreFileHeader) + 2 * (sizeof(ConfigStoreKvpHeader) + sizeof(AnyData));
+
+    ASSERT_EQ(ConfigStore_GetStats(&sto, &stats), 0);
+    ASSERT_EQ(stats.opens, 2u);
+    ASSERT_EQ(stats.commits, 1u);
+    ASSERT_EQ(stats.bytes_written, FileSize);
+    ASSERT_EQ(stats.bytes_read, FileSize);
+    ASSERT_EQ(stats.fsyncs, 1u);
+    ASSERT_EQ(stats.crc_bytes, 2 * (FileSize - sizeof(ConfigStoreFileHeader)));
+    ASSERT_GE(stats.lookup_hops, 2u);
+
+    uint64_t opens = 0;
+    uint64_t commits = 0;
+    for (size_t i = 0; i < CONFIG_STORE_LATENCY_BUCKETS; ++i) {
+        opens += stats.open_latency[i];
+        commits += stats.commit_latency[i];
+    }
+    ASSERT_EQ(opens, 2u);
+    ASSERT_EQ(commits, 1u);
+
+    ConfigStore_Close(&sto);
+#endif
+}
+
+TEST_F(ConfigStoreTests, TracerSeesIoPhases)
+{
+    auto file_name = GetCurrentTestName();
+
+    struct Event {
+        ConfigStoreTraceEvent event;
+        size_t size;
+    };
+    std::vector<Event> events;
+    ConfigStore_SetTracer(
+        [](void *context, ConfigStoreTraceEvent event, size_t size, uint64_t) {
+            static_cast<std::vector<Event> *>(context)->push_back({event, size});
+        },
+        &events);
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDONLY,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    ConfigStore_Close(&sto);
+
+    ConfigStore_SetTracer(nullptr, nullptr);
+
+    std::vector<ConfigStoreTraceEvent> sequence;
+    for (const auto &e : events) {
+        sequence.push_back(e.event);
+        if (e.event != ConfigStoreTrace_CommitCrc) {
+            ASSERT_GE(e.size, sizeof(ConfigStoreFileHeader));
+        }
+    }
+
+    std::vector<ConfigStoreTraceEvent> expected = {
+        ConfigStoreTrace_Realloc,  ConfigStoreTrace_CommitCrc, ConfigStoreTrace_Write,
+        ConfigStoreTrace_Truncate, ConfigStoreTrace_Fsync,     ConfigStoreTrace_Rename,
+        ConfigStoreTrace_Realloc,  ConfigStoreTrace_OpenRead,  ConfigStoreTrace_Validate,
+    };
+    ASSERT_EQ(sequence, expected);
+}
+
+TEST_F(ConfigStoreTests, WearThrottleDefersAndCoalescesCommits)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ConfigStoreOptions options = {};
+    options.max_commits_per_hour = 2;
+    ConfigStore_SetOptions(&sto, &options);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    struct stat st;
+    for (uint8_t i = 0; i < 4; ++i) {
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, i, &i, sizeof(i)), nullptr);
+        ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    }
+
+    // The last two were deferred: the file only has the first two KVPs.
+    constexpr size_t KvpSize = sizeof(ConfigStoreKvpHeader) + 1;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, sizeof(ConfigStoreFileHeader) + 2 * KvpSize);
+
+    ConfigStoreWearInfo info;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 2u);
+    ASSERT_EQ(info.deferred_commits, 2u);
+    ASSERT_EQ(info.commits_last_hour, 2u);
+    ASSERT_EQ(info.logical_bytes_written, 2 * sizeof(ConfigStoreFileHeader) + 3 * KvpSize);
+    ASSERT_EQ(info.physical_blocks_written, 2u);
+
+    // Flushing writes both deferred commits at once.
+    ASSERT_EQ(ConfigStore_Flush(&sto), 0) << errno;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, sizeof(ConfigStoreFileHeader) + 4 * KvpSize);
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 3u);
+
+    // Closing never writes: a deferred commit is discarded with the uncommitted changes.
+    uint8_t value = 4;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 4, &value, sizeof(value)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    value = 5;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 5, &value, sizeof(value)), nullptr);
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, sizeof(ConfigStoreFileHeader) + 4 * KvpSize);
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 3u);
+
+    // A budget callback can defer too; flushing bypasses it. It's given the size that a commit
+    // writes, which leaves out the padding of erased KVPs.
+    size_t budget_size = 0;
+    options.max_commits_per_hour = 0;
+    options.wear_budget = [](void *context, const ConfigStoreWearInfo *, size_t commit_size) {
+        *(size_t *)context = commit_size;
+        return false;
+    };
+    options.wear_budget_context = &budget_size;
+    ConfigStore_SetOptions(&sto, &options);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 0, 3, 1), 0);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, sizeof(ConfigStoreFileHeader) + 4 * KvpSize);
+    ASSERT_EQ(budget_size, sizeof(ConfigStoreFileHeader) + KvpSize);
+    ConfigStore_GetWearInfo(&sto, &info);
+    uint64_t logical_bytes_written = info.logical_bytes_written;
+    ASSERT_EQ(ConfigStore_Flush(&sto), 0) << errno;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, sizeof(ConfigStoreFileHeader) + KvpSize);
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.logical_bytes_written - logical_bytes_written, budget_size);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, CommitWithoutChangesSkipsIo)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    // A new store must be written even if empty.
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    constexpr uint8_t AnyData[] = {1, 2, 3, 4};
+    constexpr uint8_t OtherData[] = {5, 6, 7, 8};
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    // Same value rewritten, and a change that's reverted.
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, OtherData, sizeof(OtherData)), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    ConfigStoreWearInfo info;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 2u);
+
+    // A real change is written.
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, OtherData, sizeof(OtherData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 3u);
+
+    // After a failed write, the file may be torn: the committed content is written again.
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, AnyData, sizeof(AnyData)), nullptr);
+    int saved_fd = dup(sto._fd);
+    int read_only_fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    ASSERT_GE(read_only_fd, 0);
+    ASSERT_GE(dup2(read_only_fd, sto._fd), 0);
+    ASSERT_EQ(ConfigStore_Commit(&sto), -1);
+    ASSERT_GE(dup2(saved_fd, sto._fd), 0);
+    close(read_only_fd);
+    close(saved_fd);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, OtherData, sizeof(OtherData)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 4u);
+    ConfigStore_Close(&sto);
+
+    // Right after opening, the content is the committed one.
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR,
+                               ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, 4u);
+
+#ifdef CONFIG_STORE_ENABLE_STATS
+    ConfigStoreStats stats;
+    ASSERT_EQ(ConfigStore_GetStats(&sto, &stats), 0);
+    ASSERT_EQ(stats.commits_skipped, 3u);
+    ASSERT_EQ(stats.bytes_write_avoided,
+              3 * (sizeof(ConfigStoreFileHeader) + sizeof(ConfigStoreKvpHeader) + sizeof(AnyData)));
+#endif
+}
+
+TEST_F(ConfigStoreTests, PutUniqueKeyReusesKvpInPlace)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    constexpr uint8_t Large[16] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16};
+    constexpr uint8_t Tail[4] = {0xAA, 0xBB, 0xCC, 0xDD};
+
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, Large, sizeof(Large)), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 2, Tail, sizeof(Tail)), nullptr);
+    auto first = ConfigStore_TryGetKey(&sto, 1);
+    size_t used = ConfigStore_EndKvp(&sto) - ConfigStore_BeginKvp(&sto);
+
+    // Same size: same KVP, order kept.
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, sizeof(Large)), first);
+
+    // Shrinking by at least a header leaves padding, which iteration skips.
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, 4), first);
+    ASSERT_EQ(first->size, sizeof(ConfigStoreKvpHeader) + 4);
+    auto next = ConfigStore_GetNextKvp(first, ConfigStore_EndKvp(&sto));
+    ASSERT_EQ(next->key, 2);
+    ASSERT_EQ(memcmp(next + 1, Tail, sizeof(Tail)), 0);
+
+    // Shrinking by less than a header merges into the padding; growing takes it back.
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, 2), first);
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, 10), first);
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, sizeof(Large)), first);
+    ASSERT_EQ(memcmp(first + 1, Large, sizeof(Large)), 0);
+    ASSERT_EQ(ConfigStore_GetNextKvp(first, ConfigStore_EndKvp(&sto)), next);
+    ASSERT_EQ((size_t)(ConfigStore_EndKvp(&sto) - ConfigStore_BeginKvp(&sto)), used);
+
+    // Growing beyond the slack moves the KVP to the end.
+    auto moved = ConfigStore_PutUniqueKey(&sto, 1, Large, sizeof(Large) + 1);
+    ASSERT_NE(moved, nullptr);
+    ASSERT_EQ(ConfigStore_BeginKvp(&sto)->key, 2);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 1), moved);
+
+    // The last KVP grows into free capacity.
+    ASSERT_EQ(ConfigStore_PutUniqueKey(&sto, 1, Large, sizeof(Large) + 5), moved);
+
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, ErasedKvpsBecomePaddingUntilCompaction)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    constexpr size_t ValueSize = 96;
+    std::vector<uint8_t> value(ValueSize, 0x5A);
+    for (ConfigStoreKey key = 0; key < 16; ++key) {
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, key, value.data(), ValueSize), nullptr);
+    }
+    auto end = ConfigStore_EndKvp(&sto);
+    auto last = ConfigStore_TryGetKey(&sto, 15);
+
+    // Erasing in the middle moves nothing.
+    auto next = ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 4));
+    ASSERT_EQ(next, ConfigStore_TryGetKey(&sto, 5));
+    ASSERT_EQ(ConfigStore_EndKvp(&sto), end);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 15), last);
+
+    // A new key that fits takes over the hole.
+    auto filled = ConfigStore_PutUniqueKey(&sto, 100, value.data(), ValueSize);
+    ASSERT_EQ(ConfigStore_EndKvp(&sto), end);
+    ASSERT_EQ(ConfigStore_GetNextKvp(filled, end), ConfigStore_TryGetKey(&sto, 5));
+
+    // So does an insert right after a hole, leaving the rest of it as padding.
+    ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 7));
+    auto inserted = ConfigStore_InsertKvp(&sto, ConfigStore_TryGetKey(&sto, 8), 101, 40);
+    ASSERT_EQ(ConfigStore_EndKvp(&sto), end);
+    ASSERT_EQ(ConfigStore_GetNextKvp(ConfigStore_TryGetKey(&sto, 6), end), inserted);
+    ASSERT_EQ(ConfigStore_GetNextKvp(inserted, end), ConfigStore_TryGetKey(&sto, 8));
+
+    // Erases compact the buffer once there's enough padding.
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 0, 4, 1), 0);
+    ASSERT_EQ(ConfigStore_EndKvp(&sto), end);
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 8, 14, 1), 0);
+    ASSERT_LT(ConfigStore_EndKvp(&sto), end);
+
+    // Commits leave whatever is left out of the file, without moving KVPs.
+    ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 5));
+    end = ConfigStore_EndKvp(&sto);
+    last = ConfigStore_TryGetKey(&sto, 15);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(ConfigStore_EndKvp(&sto), end);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 15), last);
+
+    const std::vector<ConfigStoreKey> expected = {100, 6, 101, 14, 15};
+    size_t expected_size = sizeof(ConfigStoreFileHeader) + 4 * (ValueSize + 4) + (40 + 4);
+
+    struct stat st;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ((size_t)st.st_size, expected_size);
+
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    std::vector<ConfigStoreKey> keys;
+    auto it_end = ConfigStore_EndKvp(&sto);
+    for (auto it = ConfigStore_BeginKvp(&sto); it != it_end; it = ConfigStore_GetNextKvp(it, it_end)) {
+        keys.push_back(it->key);
+    }
+    ASSERT_EQ(keys, expected);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, ChunkedValuesSpanContinuationKvps)
+{
+    auto file_name = GetCurrentTestName();
+    constexpr size_t LargeMaxSize = 256 * 1024;
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), LargeMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    // A single KVP can't hold it.
+    constexpr size_t ValueSize = 150000;
+    ASSERT_EQ(ConfigStore_InsertKvp(&sto, ConfigStore_EndKvp(&sto), 1, ValueSize), nullptr);
+    ASSERT_EQ(errno, E2BIG);
+
+    std::vector<uint8_t> value(ValueSize);
+    for (size_t i = 0; i < ValueSize; ++i) {
+        value[i] = (uint8_t)(i * 7);
+    }
+
+    constexpr uint8_t Small[4] = {1, 2, 3, 4};
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 2, Small, sizeof(Small)), nullptr);
+    auto kvp = ConfigStore_PutUniqueChunkedKey(&sto, 1, value.data(), ValueSize);
+    ASSERT_NE(kvp, nullptr) << errno;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 3, Small, sizeof(Small)), nullptr);
+
+    // Iteration only sees the first chunk.
+    std::vector<ConfigStoreKey> keys;
+    auto it_end = ConfigStore_EndKvp(&sto);
+    for (auto it = ConfigStore_BeginKvp(&sto); it != it_end; it = ConfigStore_GetNextKvp(it, it_end)) {
+        keys.push_back(it->key);
+    }
+    ASSERT_EQ(keys, (std::vector<ConfigStoreKey>{2, 1, 3}));
+
+    // Reads and writes across chunk boundaries.
+    kvp = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_EQ(ConfigStore_GetChunkedValueSize(&sto, kvp), ValueSize);
+    std::vector<uint8_t> part(2000);
+    ASSERT_EQ(ConfigStore_ReadChunkedValue(&sto, kvp, 65000, part.data(), part.size()), 0);
+    ASSERT_TRUE(std::equal(part.begin(), part.end(), value.begin() + 65000));
+
+    std::fill(part.begin(), part.end(), 0xEE);
+    ASSERT_EQ(ConfigStore_WriteChunkedValue(&sto, kvp, 130000, part.data(), part.size()), 0);
+    std::copy(part.begin(), part.end(), value.begin() + 130000);
+
+    ASSERT_EQ(ConfigStore_ReadChunkedValue(&sto, kvp, ValueSize - 1, part.data(), 2), -1);
+    ASSERT_EQ(errno, E2BIG);
+
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), LargeMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    kvp = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_NE(kvp, nullptr);
+    std::vector<uint8_t> read(ValueSize);
+    ASSERT_EQ(ConfigStore_GetChunkedValueSize(&sto, kvp), ValueSize);
+    ASSERT_EQ(ConfigStore_ReadChunkedValue(&sto, kvp, 0, read.data(), ValueSize), 0);
+    ASSERT_EQ(read, value);
+
+    // Erasing the value erases all of its chunks.
+    ConfigStore_EraseKvp(&sto, kvp);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 3)->key, 3);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    struct stat st;
+    ASSERT_EQ(::stat(file_name.c_str(), &st), 0);
+    ASSERT_EQ((size_t)st.st_size, sizeof(ConfigStoreFileHeader) + 2 * (sizeof(Small) + 4));
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, ValueCursorsAccessPartsOfValues)
+{
+    auto file_name = GetCurrentTestName();
+    constexpr size_t LargeMaxSize = 256 * 1024;
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), LargeMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    // WriteValue at an offset zeroes the rest of its own value only.
+    constexpr uint8_t Small[4] = {1, 2, 3, 4};
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, Small, sizeof(Small)), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 2, Small, sizeof(Small)), nullptr);
+    auto first = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_EQ(ConfigStore_WriteValue(first, 1, Small, 2), 0);
+    ASSERT_EQ(memcmp(first + 1, "\x01\x01\x02\x00", 4), 0);
+    ASSERT_EQ(ConfigStore_GetNextKvp(first, ConfigStore_EndKvp(&sto))->key, 2);
+
+    // Fill a chunked value in pieces that straddle chunks; earlier pieces are kept.
+    constexpr size_t ValueSize = 100000;
+    auto kvp = ConfigStore_PutUniqueChunkedKey(&sto, 3, nullptr, ValueSize);
+    ASSERT_NE(kvp, nullptr) << errno;
+
+    std::vector<uint8_t> value(ValueSize);
+    for (size_t i = 0; i < ValueSize; ++i) {
+        value[i] = (uint8_t)(i * 13);
+    }
+
+    ConfigStoreValueWriter w;
+    ConfigStore_ValueWriterInit(&w, &sto, kvp);
+    for (size_t offset = 0; offset < ValueSize; offset += 3001) {
+        size_t size = std::min<size_t>(3001, ValueSize - offset);
+        ASSERT_EQ(ConfigStore_ValueWriterWrite(&w, &value[offset], size), size);
+    }
+    ASSERT_EQ(ConfigStore_ValueWriterWrite(&w, Small, sizeof(Small)), 0u);
+
+    // Writes in place, as a receive loop would.
+    ASSERT_EQ(ConfigStore_ValueWriterSeek(&w, 70000), 0);
+    uint8_t *span;
+    size_t span_size = ConfigStore_ValueWriterPeek(&w, &span);
+    ASSERT_GT(span_size, 0u);
+    span[0] = 0xEE;
+    value[70000] = 0xEE;
+    ASSERT_EQ(ConfigStore_ValueWriterAdvance(&w, 1), 1u);
+    ASSERT_EQ(ConfigStore_ValueWriterSeek(&w, ValueSize + 1), -1);
+    ASSERT_EQ(errno, E2BIG);
+
+    // Read it back through the spans of the chunks, without copying.
+    ConfigStoreValueReader r;
+    ConfigStore_ValueReaderInit(&r, &sto, kvp);
+    std::vector<uint8_t> read;
+    const uint8_t *data;
+    while ((span_size = ConfigStore_ValueReaderPeek(&r, &data)) > 0) {
+        read.insert(read.end(), data, data + span_size);
+        ConfigStore_ValueReaderAdvance(&r, span_size);
+    }
+    ASSERT_EQ(read, value);
+
+    // And at an offset.
+    uint8_t part[8];
+    ASSERT_EQ(ConfigStore_ValueReaderSeek(&r, ValueSize - 4), 0);
+    ASSERT_EQ(ConfigStore_ValueReaderRead(&r, part, sizeof(part)), 4u);
+    ASSERT_EQ(memcmp(part, &value[ValueSize - 4], 4), 0);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, CompressedValuesReadBackAsPut)
+{
+    auto file_name = GetCurrentTestName();
+    constexpr size_t LargeMaxSize = 256 * 1024;
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+
+    ConfigStoreOptions options = {};
+    options.compress_threshold = 256;
+    ConfigStore_SetOptions(&sto, &options);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), LargeMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    // Text compresses well, even when it takes several chunks.
+    std::string text;
+    for (int i = 0; text.size() < 200000; ++i) {
+        text += "-----BEGIN CERTIFICATE----- MIIDdzCCAl+gAwIBAgIE" + std::to_string(i) + "\n";
+    }
+    std::vector<uint8_t> compressible(text.begin(), text.end());
+
+    // Random bytes don't, so they're kept as they are.
+    std::vector<uint8_t> random(1000);
+    uint32_t seed = 1;
+    for (auto &byte : random) {
+        seed = seed * 1103515245 + 12345;
+        byte = (uint8_t)(seed >> 16);
+    }
+
+    constexpr uint8_t Small[4] = {1, 2, 3, 4};
+    ASSERT_NE(ConfigStore_PutValue(&sto, 1, compressible.data(), compressible.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutValue(&sto, 2, random.data(), random.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutValue(&sto, 3, Small, sizeof(Small)), nullptr);
+
+    auto kvp = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_EQ(ConfigStore_GetValueSize(&sto, kvp), compressible.size());
+    ASSERT_LT(ConfigStore_GetChunkedValueSize(&sto, kvp), compressible.size() / 4);
+    ASSERT_FALSE(ConfigStore_IsPlainValue(&sto, kvp));
+    kvp = ConfigStore_TryGetKey(&sto, 2);
+    ASSERT_EQ(ConfigStore_GetChunkedValueSize(&sto, kvp), random.size());
+    ASSERT_TRUE(ConfigStore_IsPlainValue(&sto, kvp));
+
+    std::vector<ConfigStoreKey> keys;
+    auto it_end = ConfigStore_EndKvp(&sto);
+    for (auto it = ConfigStore_BeginKvp(&sto); it != it_end; it = ConfigStore_GetNextKvp(it, it_end)) {
+        keys.push_back(it->key);
+    }
+    ASSERT_EQ(keys, (std::vector<ConfigStoreKey>{1, 2, 3}));
+
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), LargeMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    std::vector<uint8_t> read(compressible.size());
+    kvp = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_EQ(ConfigStore_ReadValue(&sto, kvp, read.data(), read.size() - 1), -1);
+    ASSERT_EQ(errno, E2BIG);
+    ASSERT_EQ(ConfigStore_ReadValue(&sto, kvp, read.data(), read.size()), 0);
+    ASSERT_EQ(read, compressible);
+
+    read.resize(random.size());
+    ASSERT_EQ(ConfigStore_ReadValue(&sto, ConfigStore_TryGetKey(&sto, 2), read.data(), read.size()),
+              0);
+    ASSERT_EQ(read, random);
+
+    // Replacing a compressed value replaces its attributes too.
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 1, Small, sizeof(Small)), nullptr);
+    kvp = ConfigStore_TryGetKey(&sto, 1);
+    ASSERT_EQ(ConfigStore_GetValueSize(&sto, kvp), sizeof(Small));
+    ASSERT_EQ(ConfigStore_GetNextKvp(kvp, ConfigStore_EndKvp(&sto)), ConfigStore_EndKvp(&sto));
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, CppStoreWrapsCApi)
+{
+    auto file_name = GetCurrentTestName();
+
+    struct Profile {
+        uint32_t id;
+        uint16_t flags;
+    };
+
+    Store sto;
+    ASSERT_EQ(sto.open(file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                       ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    ASSERT_NE(sto.put(1, Profile{7, 3}), nullptr);
+    ASSERT_NE(sto.put<uint32_t>(2, 42), nullptr);
+    ASSERT_NE(sto.put<uint32_t>(4, 44), nullptr);
+
+    auto profile = sto.get<Profile>(1);
+    ASSERT_TRUE(profile.has_value());
+    ASSERT_EQ(profile->id, 7u);
+    ASSERT_EQ(profile->flags, 3);
+    ASSERT_EQ(sto.get<uint32_t>(2), 42u);
+    // Missing keys and values of another size are not found.
+    ASSERT_FALSE(sto.get<uint32_t>(3).has_value());
+    ASSERT_FALSE(sto.get<uint64_t>(2).has_value());
+
+    std::vector<ConfigStoreKey> keys;
+    for (auto &kvp : sto) {
+        keys.push_back(kvp.key);
+    }
+    ASSERT_EQ(keys, (std::vector<ConfigStoreKey>{1, 2, 4}));
+
+    keys.clear();
+    for (auto &kvp : sto.range(2, 8, 2)) {
+        keys.push_back(kvp.key);
+    }
+    ASSERT_EQ(keys, (std::vector<ConfigStoreKey>{2, 4}));
+
+    auto value = sto.find(4).value();
+    ASSERT_EQ(value.size(), sizeof(uint32_t));
+    ASSERT_EQ(value[0], std::byte{44});
+
+    // Moving transfers the open store; the moved-from one is empty.
+    Store moved(std::move(sto));
+    ASSERT_EQ(sto.begin(), sto.end());
+    ASSERT_EQ(moved.erase(moved.find(1))->key, 2);
+    ASSERT_EQ(moved.commit(), 0) << errno;
+    moved.close();
+
+    Store reopened;
+    ASSERT_EQ(reopened.open(file_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                            ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_FALSE(reopened.contains(1));
+    ASSERT_EQ(reopened.get<uint32_t>(4), 44u);
+}
+
+// Profiles of 16 keys from 0x100: the id of each profile is the first key, its flags the third.
+using ProfileIds = KeyRange<0x100, 0x200, 16, uint32_t>;
+using ProfileFlags = KeyRange<0x102, 0x200, 16, uint16_t>;
+using Settings = KeyRange<0x200, 0x210>;
+using ProfileSchema = Schema<ProfileIds, ProfileFlags, Settings>;
+
+static_assert(ProfileIds::count == 16);
+static_assert(ProfileFlags::key(2) == 0x122);
+static_assert(ProfileSchema::contains(0x132) && !ProfileSchema::contains(0x131));
+static_assert(!RangesOverlap<ProfileIds, ProfileFlags>());
+static_assert(RangesOverlap<ProfileIds, KeyRange<0x1F0, 0x1F1>>());
+static_assert(!RangesOverlap<KeyRange<0, 100, 4>, KeyRange<2, 100, 8>>());
+static_assert(RangesOverlap<KeyRange<0, 100, 4>, KeyRange<2, 100, 10>>());
+static_assert(!RangesOverlap<KeyRange<0, 8, 4>, KeyRange<8, 16>>());
+
+TEST_F(ConfigStoreTests, KeyRangesAccessProfiles)
+{
+    auto file_name = GetCurrentTestName();
+
+    Store sto;
+    ASSERT_EQ(sto.open(file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                       ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    for (size_t i = 0; i < 4; ++i) {
+        ASSERT_NE(sto.put_at<ProfileIds>(i, 100 + i), nullptr);
+        ASSERT_NE(sto.put_at<ProfileFlags>(i, static_cast<uint16_t>(i)), nullptr);
+    }
+    ASSERT_NE(sto.put<uint8_t>(Settings::key(0), 1), nullptr);
+
+    ASSERT_EQ(sto.get_at<ProfileIds>(3), 103u);
+    ASSERT_EQ(sto.get_at<ProfileFlags>(2), 2);
+    ASSERT_FALSE(sto.get_at<ProfileIds>(4).has_value());
+
+    // Indexes past the range don't reach the keys that follow it.
+    ASSERT_NE(sto.put<uint32_t>(ProfileIds::last, 7), nullptr);
+    ASSERT_FALSE(sto.get_at<ProfileIds>(ProfileIds::count).has_value());
+    errno = 0;
+    ASSERT_EQ(sto.put_at<ProfileIds>(ProfileIds::count, 1), nullptr);
+    ASSERT_EQ(errno, ERANGE);
+    ASSERT_EQ(sto.get<uint32_t>(ProfileIds::last), 7u);
+
+    std::vector<size_t> indexes;
+    for (auto it = sto.range<ProfileFlags>().begin(); it != sto.range<ProfileFlags>().end(); ++it) {
+        indexes.push_back(it.index());
+    }
+    ASSERT_EQ(indexes, (std::vector<size_t>{0, 1, 2, 3}));
+
+    // Allocation takes the first free key of the range.
+    ConfigStoreKvpHeader *kvp = sto.alloc<ProfileIds>();
+    ASSERT_NE(kvp, nullptr) << errno;
+    ASSERT_EQ(kvp->key, ProfileIds::key(4));
+
+    ASSERT_EQ(sto.erase_range<ProfileIds>(), 0) << errno;
+    ASSERT_EQ(sto.range<ProfileIds>().begin(), sto.range<ProfileIds>().end());
+    ASSERT_EQ(sto.get_at<ProfileFlags>(3), 3);
+    ASSERT_TRUE(sto.contains(Settings::key(0)));
+}
+
+TEST_F(ConfigStoreTests, CompactFileVersionMigratesOnCommit)
+{
+    auto file_name = GetCurrentTestName();
+
+    auto read_file = [&]() {
+        std::vector<uint8_t> file(64 * 1024);
+        int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t size = read(fd, file.data(), file.size());
+        close(fd);
+        file.resize(std::max<ssize_t>(size, 0));
+        return file;
+    };
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_GetFileVersion(&sto), ConfigStoreFileVersion);
+
+    // Small values, a value with a two-byte size and keys with three-byte encodings.
+    for (uint16_t i = 0; i < 64; ++i) {
+        uint8_t value = i;
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, i, &value, sizeof(value)), nullptr);
+    }
+    std::vector<uint8_t> large(300, 0x5A);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 0x8000, large.data(), large.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, ConfigStoreMaxKey, nullptr, 0), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    size_t fixed_size = read_file().size();
+
+    ASSERT_EQ(ConfigStore_SetFileVersion(&sto, 7), -1);
+    ASSERT_EQ(errno, EINVAL);
+    ASSERT_EQ(ConfigStore_SetFileVersion(&sto, ConfigStoreFileVersionCompact), 0) << errno;
+
+    // The migration writes even though the content didn't change.
+    ConfigStoreWearInfo info;
+    ConfigStore_GetWearInfo(&sto, &info);
+    uint64_t commits = info.commits;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, commits + 1);
+
+    auto file = read_file();
+    ASSERT_EQ(ConfigStore_ValidateFormat(file.data(), file.size()), file.size());
+    ASSERT_EQ(((const ConfigStoreFileHeader *)file.data())->version, ConfigStoreFileVersionCompact);
+    // Small KVPs take one byte of key and one of size instead of four. The large one takes three
+    // bytes of key and two of size, and the empty one three and one.
+    ASSERT_EQ(file.size(), fixed_size - 64 * 2 + 1);
+
+    // Unchanged content is still skipped.
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, commits + 1);
+    ConfigStore_Close(&sto);
+
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_GetFileVersion(&sto), ConfigStoreFileVersionCompact);
+    ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, 63);
+    ASSERT_NE(kvp, nullptr);
+    ASSERT_EQ(kvp->size, sizeof(*kvp) + 1);
+    ASSERT_EQ(*(uint8_t *)(kvp + 1), 63);
+    kvp = ConfigStore_TryGetKey(&sto, 0x8000);
+    ASSERT_NE(kvp, nullptr);
+    ASSERT_EQ(memcmp(kvp + 1, large.data(), large.size()), 0);
+    ASSERT_NE(ConfigStore_TryGetKey(&sto, ConfigStoreMaxKey), nullptr);
+
+    // Opening doesn't rewrite the file; changing it back does.
+    ConfigStore_GetWearInfo(&sto, &info);
+    commits = info.commits;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_GetWearInfo(&sto, &info);
+    ASSERT_EQ(info.commits, commits);
+    ASSERT_EQ(read_file(), file);
+    ASSERT_EQ(ConfigStore_SetFileVersion(&sto, ConfigStoreFileVersion), 0) << errno;
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(read_file().size(), fixed_size);
+
+    // A compact file with a good CRC but a value past its end is invalid.
+    ConfigStoreFileHeader header = {{ConfigStoreFileHeaderKey, sizeof(header)},
+                                    ConfigStoreFileSignature,
+                                    ConfigStoreFileVersionCompact,
+                                    sizeof(header) + 3,
+                                    0};
+    const uint8_t body[] = {1, 5, 0};
+    header.crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, body, sizeof(body));
+    std::vector<uint8_t> bad((uint8_t *)&header, (uint8_t *)(&header + 1));
+    bad.insert(bad.end(), body, body + sizeof(body));
+    ASSERT_EQ(ConfigStore_ValidateFormat(bad.data(), bad.size()), 0u);
+}
+
+TEST_F(ConfigStoreTests, SharedValuesAreStoredOnce)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    auto read_value = [&](ConfigStoreKey key) {
+        ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, key);
+        EXPECT_NE(kvp, nullptr) << key;
+        std::vector<uint8_t> value(kvp ? ConfigStore_GetValueSize(&sto, kvp) : 0);
+        if (kvp != nullptr) {
+            EXPECT_EQ(ConfigStore_ReadValue(&sto, kvp, value.data(), value.size()), 0) << errno;
+        }
+        return value;
+    };
+
+    std::vector<uint8_t> cert(1000);
+    for (size_t i = 0; i < cert.size(); ++i) {
+        cert[i] = i * 7;
+    }
+    const uint8_t identity[] = "user@example.com";
+    std::vector<uint8_t> identity_value(identity, identity + sizeof(identity));
+
+    size_t empty_size = sto._end - sto._begin;
+    for (ConfigStoreKey key = 1; key <= 5; ++key) {
+        ASSERT_NE(ConfigStore_PutSharedValue(&sto, key, cert.data(), cert.size()), nullptr) << errno;
+    }
+    ASSERT_NE(ConfigStore_PutSharedValue(&sto, 6, identity, sizeof(identity)), nullptr) << errno;
+    ASSERT_LT((size_t)(sto._end - sto._begin), empty_size + cert.size() + 200);
+
+    // Shared values are hidden from iteration.
+    std::vector<ConfigStoreKey> keys;
+    ConfigStoreKvpHeader *it_end = ConfigStore_EndKvp(&sto);
+    for (ConfigStoreKvpHeader *it = ConfigStore_BeginKvp(&sto); it != it_end;
+         it = ConfigStore_GetNextKvp(it, it_end)) {
+        keys.push_back(it->key);
+    }
+    ASSERT_EQ(keys, (std::vector<ConfigStoreKey>{1, 2, 3, 4, 5, 6}));
+    ASSERT_EQ(read_value(3), cert);
+    ASSERT_EQ(read_value(6), identity_value);
+
+    // Erasing or replacing some references keeps the value for the others.
+    ASSERT_NE(ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 1)), nullptr);
+    uint8_t flag = 1;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 2, &flag, sizeof(flag)), nullptr);
+    ASSERT_NE(ConfigStore_PutSharedValue(&sto, 3, cert.data(), cert.size()), nullptr);
+    ASSERT_NE(ConfigStore_InsertKvp(&sto, ConfigStore_BeginKvp(&sto), 7, 0), nullptr);
+    ASSERT_EQ(read_value(3), cert);
+    ASSERT_EQ(read_value(5), cert);
+    ASSERT_EQ(read_value(2), std::vector<uint8_t>{1});
+
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(read_value(4), cert);
+    ASSERT_EQ(read_value(6), identity_value);
+
+    // Dropping the last references frees the values, without moving the other KVPs.
+    auto content_size = [&]() { return (size_t)(sto._end - sto._begin) - sto._padding_size; };
+    size_t size = content_size();
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 3, 6, 1), 0) << errno;
+    ASSERT_LE(content_size(), size - cert.size());
+    ASSERT_EQ(read_value(6), identity_value);
+    ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, 2);
+    ASSERT_NE(ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 6)), nullptr);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 2), kvp);
+    ASSERT_EQ(read_value(2), std::vector<uint8_t>{1});
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 0, 10, 1), 0) << errno;
+    ASSERT_EQ((size_t)(sto._end - sto._begin), empty_size);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, StoreSetLoadsNamespacesLazily)
+{
+    auto base_name = GetCurrentTestName();
+    auto networks_path = base_name + ".networks";
+    auto global_path = base_name + ".global";
+    struct stat st;
+
+    ConfigStoreSet set;
+    ConfigStore_StoreSetInit(&set);
+    ASSERT_EQ(ConfigStore_StoreSetOpen(&set, base_name.c_str(), AnyMaxSize,
+                                       O_RDWR | O_CREAT | O_CLOEXEC, ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(::stat(networks_path.c_str(), &st), -1);
+
+    ASSERT_EQ(ConfigStore_StoreSetGet(&set, ""), nullptr);
+    ASSERT_EQ(errno, EINVAL);
+    ASSERT_EQ(ConfigStore_StoreSetGet(&set, "../escape"), nullptr);
+    ASSERT_EQ(errno, EINVAL);
+
+    ConfigStore *networks = ConfigStore_StoreSetGet(&set, "networks");
+    ASSERT_NE(networks, nullptr) << errno;
+    ASSERT_EQ(ConfigStore_StoreSetGet(&set, "networks"), networks);
+    ConfigStore *global = ConfigStore_StoreSetGet(&set, "global");
+    ASSERT_NE(global, nullptr) << errno;
+
+    uint8_t value = 1;
+    ASSERT_NE(ConfigStore_PutUniqueKey(networks, 1, &value, sizeof(value)), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(global, 1, &value, sizeof(value)), nullptr);
+    ASSERT_EQ(ConfigStore_StoreSetCommit(&set), 0) << errno;
+    ASSERT_EQ(::stat(networks_path.c_str(), &st), 0);
+    ASSERT_EQ(::stat(global_path.c_str(), &st), 0);
+
+    // Only the namespace that changed is written.
+    ConfigStoreWearInfo info;
+    ConfigStore_GetWearInfo(global, &info);
+    uint64_t global_commits = info.commits;
+    value = 2;
+    ASSERT_NE(ConfigStore_PutUniqueKey(networks, 2, &value, sizeof(value)), nullptr);
+    ASSERT_EQ(ConfigStore_StoreSetCommit(&set), 0) << errno;
+    ConfigStore_GetWearInfo(global, &info);
+    ASSERT_EQ(info.commits, global_commits);
+    ConfigStore_StoreSetClose(&set);
+
+    // Each namespace has its own lock.
+    ConfigStore other;
+    ConfigStore_Init(&other);
+    ASSERT_EQ(ConfigStore_Open(&other, global_path.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    ConfigStore_StoreSetInit(&set);
+    ASSERT_EQ(ConfigStore_StoreSetOpen(&set, base_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                                       ConfigStoreReplica_Swap),
+              0)
+        << errno;
+    networks = ConfigStore_StoreSetGet(&set, "networks");
+    ASSERT_NE(networks, nullptr) << errno;
+    ASSERT_FALSE(ConfigStore_StoreSetIsLoaded(&set, "global"));
+    ASSERT_NE(ConfigStore_TryGetKey(networks, 2), nullptr);
+    ASSERT_EQ(ConfigStore_StoreSetGet(&set, "global"), nullptr);
+    ConfigStore_Close(&other);
+
+    // A swap commit closes the store, which the next access reopens.
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(networks, 2, 3, 1), 0) << errno;
+    ASSERT_EQ(ConfigStore_StoreSetCommit(&set), 0) << errno;
+    ASSERT_FALSE(ConfigStore_StoreSetIsLoaded(&set, "networks"));
+    networks = ConfigStore_StoreSetGet(&set, "networks");
+    ASSERT_NE(networks, nullptr) << errno;
+    ASSERT_EQ(ConfigStore_TryGetKey(networks, 2), nullptr);
+    ASSERT_NE(ConfigStore_TryGetKey(networks, 1), nullptr);
+    ConfigStore_StoreSetClose(&set);
+
+    // Read-only sets don't create namespaces.
+    ConfigStore_StoreSetInit(&set);
+    ASSERT_EQ(ConfigStore_StoreSetOpen(&set, base_name.c_str(), AnyMaxSize, O_RDONLY | O_CLOEXEC,
+                                       ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_EQ(ConfigStore_StoreSetGet(&set, "credentials"), nullptr);
+    ASSERT_EQ(errno, ENOENT);
+    ConfigStore_StoreSetClose(&set);
+
+    // Each namespace publishes its image under its own name.
+    auto shm_name = "/azscfgsto-" + base_name + "-" + std::to_string(getpid());
+    ConfigStoreOptions options = {};
+    options.shared_view_name = shm_name.c_str();
+    ConfigStore_StoreSetInit(&set);
+    ConfigStore_StoreSetSetOptions(&set, &options);
+    ASSERT_EQ(ConfigStore_StoreSetOpen(&set, base_name.c_str(), AnyMaxSize, O_RDWR | O_CLOEXEC,
+                                       ConfigStoreReplica_None),
+              0)
+        << errno;
+    networks = ConfigStore_StoreSetGet(&set, "networks");
+    ASSERT_NE(networks, nullptr) << errno;
+    ASSERT_NE(ConfigStore_PutUniqueKey(networks, 3, &value, sizeof(value)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(networks), 0) << errno;
+    ASSERT_NE(ConfigStore_StoreSetGet(&set, "global"), nullptr) << errno;
+
+    for (const char *name : {"networks", "global"}) {
+        auto view_name = shm_name + "." + name;
+        ConfigStoreSharedView view;
+        ConfigStore_SharedViewInit(&view);
+        ASSERT_EQ(ConfigStore_SharedViewOpen(&view, view_name.c_str()), 0) << errno;
+
+        const ConfigStoreKvpHeader *first;
+        const ConfigStoreKvpHeader *last;
+        uint32_t seq;
+        ASSERT_EQ(ConfigStore_SharedViewBegin(&view, &seq, &first, &last), 0) << errno;
+        bool has_key = false;
+        for (auto it = first; it != last; it = ConfigStore_GetNextKvp(it, last)) {
+            has_key |= (it->key == 3);
+        }
+        ASSERT_FALSE(ConfigStore_SharedViewRetry(&view, seq));
+        ASSERT_EQ(has_key, strcmp(name, "networks") == 0) << name;
+
+        ConfigStore_SharedViewClose(&view);
+        shm_unlink(view_name.c_str());
+    }
+    ConfigStore_StoreSetClose(&set);
+}
+
+TEST_F(ConfigStoreTests, TransactionCommitsStoresTogether)
+{
+    auto name = GetCurrentTestName();
+    auto a_path = name + ".a";
+    auto b_path = name + ".b";
+    auto journal_path = name + ".journal";
+    struct stat st;
+
+    auto open_store = [&](ConfigStore *sto, const std::string &path) {
+        ConfigStore_Init(sto);
+        ASSERT_EQ(ConfigStore_Open(sto, path.c_str(), AnyMaxSize, O_RDWR | O_CREAT | O_CLOEXEC,
+                                   ConfigStoreReplica_None),
+                  0)
+            << errno;
+    };
+    auto value_of = [](ConfigStore *sto, ConfigStoreKey key) {
+        ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(sto, key);
+        return (kvp && (kvp->size == sizeof(*kvp) + 1)) ? *(uint8_t *)(kvp + 1) : 0;
+    };
+
+    ConfigStore a;
+    ConfigStore b;
+    open_store(&a, a_path);
+    open_store(&b, b_path);
+
+    uint8_t value = 1;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&a, 1, &value, sizeof(value)), nullptr);
+    value = 2;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&b, 1, &value, sizeof(value)), nullptr);
+
+    ConfigStoreTransaction t;
+    ConfigStore_TransactionInit(&t);
+    ASSERT_EQ(ConfigStore_TransactionAdd(&t, &a), -1);
+    ASSERT_EQ(ConfigStore_TransactionBegin(&t, journal_path.c_str()), 0) << errno;
+    ASSERT_EQ(ConfigStore_TransactionAdd(&t, &a), 0) << errno;
+    ASSERT_EQ(ConfigStore_TransactionAdd(&t, &b), 0) << errno;
+    ASSERT_EQ(ConfigStore_TransactionCommit(&t), 0) << errno;
+    ConfigStore_TransactionClose(&t);
+    ASSERT_EQ(::stat(journal_path.c_str(), &st), -1);
+    ConfigStore_Close(&a);
+    ConfigStore_Close(&b);
+    open_store(&a, a_path);
+    ASSERT_EQ(value_of(&a, 1), 1);
+
+    // A single store written in place is journaled too: without a journal, it isn't written.
+    auto missing_journal = name + ".missing/journal";
+    value = 3;
+    ASSERT_NE(ConfigStore_PutUniqueKey(&a, 1, &value, sizeof(value)), nullptr);
+    ConfigStore_TransactionInit(&t);
+    ASSERT_EQ(ConfigStore_TransactionBegin(&t, missing_journal.c_str()), 0) << errno;
+    ASSERT_EQ(ConfigStore_TransactionAdd(&t, &a), 0) << errno;
+    ASSERT_EQ(ConfigStore_TransactionCommit(&t), -1);
+    ConfigStore_TransactionClose(&t);
+    ConfigStore_Close(&a);
+    open_store(&a, a_path);
+    ASSERT_EQ(value_of(&a, 1), 1);
+    ConfigStore_Close(&a);
+
+    // A journal left by a crash is replayed: here, the image of b over a.
+    std::vector<uint8_t> image(1024);
+    int fd = open(b_path.c_str(), O_RDONLY | O_CLOEXEC);
+    image.resize(read(fd, image.data(), image.size()));
+    close(fd);
+
+    ConfigStore journal;
+    open_store(&journal, journal_path);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&journal, 0, (const uint8_t *)a_path.data(), a_path.size()),
+              nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueChunkedKey(&journal, 1, image.data(), image.size()), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&journal), 0) << errno;
+    ConfigStore_Close(&journal);
+
+    ASSERT_EQ(ConfigStore_TransactionRecover(journal_path.c_str()), 0) << errno;
+    ASSERT_EQ(::stat(journal_path.c_str(), &st), -1);
+    ASSERT_EQ(ConfigStore_TransactionRecover(journal_path.c_str()), 0) << errno;
+    open_store(&a, a_path);
+    ASSERT_EQ(value_of(&a, 1), 2);
+    ConfigStore_Close(&a);
+
+    // A torn journal means the transaction didn't commit.
+    fd = open(journal_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    ASSERT_EQ(write(fd, image.data(), image.size() / 2), (ssize_t)(image.size() / 2));
+    close(fd);
+    ASSERT_EQ(ConfigStore_TransactionRecover(journal_path.c_str()), 0) << errno;
+    ASSERT_EQ(::stat(journal_path.c_str(), &st), -1);
+    open_store(&a, a_path);
+    ASSERT_EQ(value_of(&a, 1), 2);
+    ConfigStore_Close(&a);
+}
+
+TEST_F(ConfigStoreTests, SavepointsRollBackChanges)
+{
+    auto file_name = GetCurrentTestName();
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), 256 * 1024, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    auto image = [&]() { return std::vector<uint8_t>(sto._begin, sto._end); };
+    auto indexed = [&]() {
+        const ConfigStoreKey *keys;
+        std::vector<std::pair<ConfigStoreKey, ptrdiff_t>> entries;
+        for (size_t i = 0, count = ConfigStore_GetIndexedKeys(&sto, &keys); i < count; ++i) {
+            entries.emplace_back(keys[i], (uint8_t *)ConfigStore_GetIndexedKvp(&sto, i) - sto._begin);
+        }
+        return entries;
+    };
+    auto value_of = [&](ConfigStoreKey key) {
+        ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(&sto, key);
+        std::vector<uint8_t> value(kvp ? ConfigStore_GetValueSize(&sto, kvp) : 0);
+        if (kvp != nullptr) {
+            EXPECT_EQ(ConfigStore_ReadValue(&sto, kvp, value.data(), value.size()), 0) << errno;
+        }
+        return value;
+    };
+
+    std::vector<uint8_t> value(40);
+    for (ConfigStoreKey key = 1; key <= 100; ++key) {
+        std::fill(value.begin(), value.end(), (uint8_t)key);
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, key, value.data(), value.size()), nullptr);
+    }
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    auto committed = image();
+
+    // Invalid savepoints.
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, 1), -1);
+    ASSERT_EQ(errno, EINVAL);
+
+    int outer = ConfigStore_Savepoint(&sto);
+    ASSERT_EQ(outer, 1) << errno;
+
+    // Enough erases to compact, and every kind of change.
+    for (ConfigStoreKey key = 2; key <= 60; key += 2) {
+        ASSERT_NE(ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, key)), nullptr);
+    }
+    std::vector<uint8_t> large(ConfigStoreMaxKvpValueSize + 100, 0x5a);
+    ASSERT_NE(ConfigStore_InsertKvp(&sto, ConfigStore_BeginKvp(&sto), 200, 8), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 3, large.data(), 100), nullptr);
+    ASSERT_NE(ConfigStore_PutUniqueChunkedKey(&sto, 201, large.data(), large.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutSharedValue(&sto, 202, value.data(), value.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutSharedValue(&sto, 5, value.data(), value.size()), nullptr);
+    ASSERT_EQ(ConfigStore_SetFileVersion(&sto, ConfigStoreFileVersionCompact), 0);
+    auto changed = image();
+    auto changed_index = indexed();
+
+    int inner = ConfigStore_Savepoint(&sto);
+    ASSERT_EQ(inner, 2) << errno;
+    ConfigStoreValueWriter w;
+    ConfigStore_ValueWriterInit(&w, &sto, ConfigStore_TryGetKey(&sto, 201));
+    ASSERT_EQ(ConfigStore_ValueWriterSeek(&w, ConfigStoreMaxKvpValueSize - 2), 0);
+    ASSERT_EQ(ConfigStore_ValueWriterWrite(&w, value.data(), 4), 4u);
+    ASSERT_EQ(ConfigStore_EraseKeysInRange(&sto, 0, 1000, 1), 0) << errno;
+    ASSERT_EQ(ConfigStore_BeginKvp(&sto), ConfigStore_EndKvp(&sto));
+
+    // Rolling back the inner savepoint keeps the changes of the outer one.
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, inner), 0) << errno;
+    ASSERT_EQ(image(), changed);
+    ASSERT_EQ(indexed(), changed_index);
+    ASSERT_EQ(value_of(201), large);
+    ASSERT_EQ(value_of(202), value);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 2), nullptr);
+
+    // The inner savepoint stays open and can be rolled back again.
+    ASSERT_NE(ConfigStore_PutUniqueKey(&sto, 201, value.data(), 1), nullptr);
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, inner), 0) << errno;
+    ASSERT_EQ(image(), changed);
+    ASSERT_EQ(indexed(), changed_index);
+
+    // Appending restores no page, and only the appended KVPs leave the index.
+    ASSERT_NE(ConfigStore_InsertKvp(&sto, ConfigStore_EndKvp(&sto), 300, 8), nullptr);
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, inner), 0) << errno;
+    ASSERT_EQ(image(), changed);
+    ASSERT_EQ(indexed(), changed_index);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 300), nullptr);
+
+    // Released changes are undone along with the enclosing savepoint.
+    ASSERT_NE(ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 201)), nullptr);
+    ASSERT_EQ(ConfigStore_Release(&sto, inner), 0);
+    ASSERT_EQ(ConfigStore_Release(&sto, inner), -1);
+    ASSERT_EQ(errno, EINVAL);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 201), nullptr);
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, outer), 0) << errno;
+    ASSERT_EQ(image(), committed);
+    ASSERT_EQ(ConfigStore_GetFileVersion(&sto), ConfigStoreFileVersion);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 200), nullptr);
+    std::fill(value.begin(), value.end(), 2);
+    ASSERT_EQ(value_of(2), value);
+
+    // Nothing changed, so there's nothing to write.
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    // A commit releases the savepoints.
+    ASSERT_EQ(ConfigStore_Savepoint(&sto), 1);
+    ASSERT_NE(ConfigStore_EraseKvp(&sto, ConfigStore_TryGetKey(&sto, 2)), nullptr);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ASSERT_EQ(ConfigStore_RollbackTo(&sto, 1), -1);
+    ASSERT_EQ(errno, EINVAL);
+    ASSERT_EQ(ConfigStore_TryGetKey(&sto, 2), nullptr);
+
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, ParallelValidationMatchesSerial)
+{
+    auto file_name = GetCurrentTestName();
+    const size_t max_size = 512 * 1024;
+
+    ConfigStoreOptions options = {};
+    options.parallel_validation_threshold = 64 * 1024;
+    options.validation_threads = 3;
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ConfigStore_SetOptions(&sto, &options);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), max_size, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+
+    std::vector<uint8_t> value(1000);
+    for (ConfigStoreKey key = 0; key < 300; ++key) {
+        for (size_t i = 0; i < value.size(); ++i) {
+            value[i] = key * 31 + i;
+        }
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, key, value.data(), value.size()), nullptr);
+    }
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    ConfigStore_Close(&sto);
+
+    std::vector<uint8_t> file(max_size);
+    int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    file.resize(std::max<ssize_t>(read(fd, file.data(), file.size()), 0));
+    close(fd);
+    ASSERT_GT(file.size(), 300000u);
+
+    // The chunks merge to the serial CRC however the content is split.
+    for (unsigned threads : {0u, 1u, 2u, 3u, 7u, 16u}) {
+        ASSERT_EQ(ConfigStore_ValidateFormatParallel(file.data(), file.size(), threads),
+                  file.size())
+            << threads;
+    }
+
+    // Corruption is caught in any chunk, and in the chain even if the CRC matched.
+    for (size_t offset : {sizeof(ConfigStoreFileHeader) + 10, file.size() / 2, file.size() - 1}) {
+        std::vector<uint8_t> bad = file;
+        bad[offset] ^= 1;
+        ASSERT_EQ(ConfigStore_ValidateFormatParallel(bad.data(), bad.size(), 4), 0u) << offset;
+    }
+    std::vector<uint8_t> bad = file;
+    ((ConfigStoreKvpHeader *)&bad[sizeof(ConfigStoreFileHeader)])->key = ConfigStoreFileHeaderKey;
+    ConfigStoreFileHeader *header = (ConfigStoreFileHeader *)bad.data();
+    header->crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, &bad[sizeof(*header)],
+                                     bad.size() - sizeof(*header));
+    ASSERT_EQ(ConfigStore_ValidateFormat(bad.data(), bad.size()), 0u);
+    ASSERT_EQ(ConfigStore_ValidateFormatParallel(bad.data(), bad.size(), 4), 0u);
+
+    // Opens above the threshold validate in parallel.
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), max_size, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    ASSERT_NE(ConfigStore_TryGetKey(&sto, 299), nullptr);
+    ConfigStore_Close(&sto);
+}
+
+TEST_F(ConfigStoreTests, StreamingValidatorRejectsEarly)
+{
+    auto file_name = GetCurrentTestName();
+    const size_t max_size = 256 * 1024;
+
+    ConfigStore sto;
+    ConfigStore_Init(&sto);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), max_size, O_RDWR | O_CREAT | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              0)
+        << errno;
+    std::vector<uint8_t> value(300);
+    for (ConfigStoreKey key = 0; key < 200; ++key) {
+        std::fill(value.begin(), value.end(), (uint8_t)key);
+        ASSERT_NE(ConfigStore_PutUniqueKey(&sto, key, value.data(), key), nullptr);
+    }
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+
+    auto read_file = [&]() {
+        std::vector<uint8_t> file(max_size);
+        int fd = open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+        file.resize(std::max<ssize_t>(read(fd, file.data(), file.size()), 0));
+        close(fd);
+        return file;
+    };
+    auto validate = [](const std::vector<uint8_t> &file, size_t piece) {
+        ConfigStoreValidator v;
+        ConfigStore_ValidatorInit(&v);
+        for (size_t offset = 0; offset < file.size(); offset += piece) {
+            if (ConfigStore_ValidatorUpdate(&v, &file[offset],
+                                            std::min(piece, file.size() - offset))) {
+                EXPECT_EQ(errno, EINVAL);
+                return (size_t)0;
+            }
+        }
+        return ConfigStore_ValidatorFinish(&v);
+    };
+
+    // Any split of the file validates the same, in both versions.
+    auto file = read_file();
+    ASSERT_GT(file.size(), 16u * 1024);
+    ASSERT_EQ(ConfigStore_SetFileVersion(&sto, ConfigStoreFileVersionCompact), 0);
+    ASSERT_EQ(ConfigStore_Commit(&sto), 0) << errno;
+    auto compact = read_file();
+    ConfigStore_Close(&sto);
+    for (size_t piece : {1, 3, 1000, 1 << 20}) {
+        ASSERT_EQ(validate(file, piece), file.size()) << piece;
+        ASSERT_EQ(validate(compact, piece), compact.size()) << piece;
+    }
+
+    // Bytes past the content are ignored; missing ones aren't.
+    std::vector<uint8_t> longer = file;
+    longer.resize(file.size() + 100, 0xEE);
+    ASSERT_EQ(validate(longer, 1000), file.size());
+    ASSERT_EQ(validate(std::vector<uint8_t>(file.begin(), file.end() - 1), 1000), 0u);
+    ASSERT_EQ(validate(std::vector<uint8_t>(compact.begin(), compact.end() - 1), 1000), 0u);
+
+    // A longer header is skipped as a whole, even when its extra bytes look like a KVP.
+    std::vector<uint8_t> extended = file;
+    const uint8_t Extra[] = {0xFB, 0xFF, 0x00, 0x00};
+    extended.insert(extended.begin() + sizeof(ConfigStoreFileHeader), Extra, Extra + sizeof(Extra));
+    auto *extended_header = (ConfigStoreFileHeader *)extended.data();
+    extended_header->header.size += sizeof(Extra);
+    extended_header->file_size += sizeof(Extra);
+    extended_header->crc =
+        ConfigStore_AddCrc(ConfigStoreCrcInitValue, &extended[sizeof(ConfigStoreFileHeader)],
+                           extended.size() - sizeof(ConfigStoreFileHeader));
+    ASSERT_EQ(ConfigStore_ValidateFormat(extended.data(), extended.size()), extended.size());
+    for (size_t piece : {1, 3, 1000}) {
+        ASSERT_EQ(validate(extended, piece), extended.size()) << piece;
+    }
+
+    // A bad header is rejected by its first bytes.
+    std::vector<uint8_t> bad = file;
+    ((ConfigStoreFileHeader *)bad.data())->signature ^= 1;
+    ConfigStoreValidator v;
+    ConfigStore_ValidatorInit(&v);
+    ASSERT_EQ(ConfigStore_ValidatorUpdate(&v, bad.data(), sizeof(ConfigStoreFileHeader)), -1);
+    ASSERT_EQ(errno, EINVAL);
+
+    // A bad chain is rejected by the piece it's in, whatever the CRC.
+    bad = file;
+    ((ConfigStoreKvpHeader *)&bad[sizeof(ConfigStoreFileHeader)])->key = ConfigStoreFileHeaderKey;
+    ConfigStore_ValidatorInit(&v);
+    ASSERT_EQ(ConfigStore_ValidatorUpdate(&v, bad.data(), 100), -1);
+    bad = compact;
+    bad[sizeof(ConfigStoreFileHeader) + 1] = 0xFF; // Size of the first KVP, now past the end.
+    ASSERT_EQ(validate(bad, 1000), 0u);
+
+    // Opening reads no further than the chunk that made the file invalid.
+    bad = file;
+    ((ConfigStoreFileHeader *)bad.data())->version = 7;
+    int fd = open(file_name.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+    ASSERT_EQ(write(fd, bad.data(), bad.size()), (ssize_t)bad.size());
+    close(fd);
+
+    size_t bytes_read = 0;
+    ConfigStore_SetTracer(
+        [](void *context, ConfigStoreTraceEvent event, size_t size, uint64_t) {
+            if (event == ConfigStoreTrace_OpenRead) {
+                *static_cast<size_t *>(context) += size;
+            }
+        },
+        &bytes_read);
+    ASSERT_EQ(ConfigStore_Open(&sto, file_name.c_str(), max_size, O_RDWR | O_CLOEXEC,
+                               ConfigStoreReplica_None),
+              -1);
+    ASSERT_EQ(errno, EINVAL);
+    ConfigStore_SetTracer(nullptr, nullptr);
+    ConfigStore_Close(&sto);
+    ASSERT_GT(bytes_read, 0u);
+    ASSERT_LT(bytes_read, bad.size());
+}
+
+TEST_F(ConfigStoreTests, ImportRebuildsExportedStore)
+{
+    auto file_name = GetCurrentTestName();
+    auto copy_name = file_name + ".copy";
+    const size_t max_size = 256 * 1024;
+
+    auto open_store = [&](ConfigStore *sto, const std::string &path) {
+        ConfigStore_Init(sto);
+        ASSERT_EQ(ConfigStore_Open(sto, path.c_str(), max_size, O_RDWR | O_CREAT | O_CLOEXEC,
+                                   ConfigStoreReplica_None),
+                  0)
+            << errno;
+    };
+    auto export_store = [](const ConfigStore *sto) {
+        std::vector<uint8_t> stream;
+        ConfigStoreExporter ex;
+        EXPECT_EQ(ConfigStore_ExportBegin(&ex, sto), 0) << errno;
+        const uint8_t *data;
+        for (size_t size; (size = ConfigStore_ExportNext(&ex, &data)) != 0;) {
+            stream.insert(stream.end(), data, data + size);
+        }
+        ConfigStore_ExportEnd(&ex);
+        return stream;
+    };
+    auto value_of = [](const ConfigStore *sto, ConfigStoreKey key) {
+        const ConfigStoreKvpHeader *kvp = ConfigStore_TryGetKey(sto, key);
+        std::vector<uint8_t> value(kvp ? ConfigStore_GetValueSize(sto, kvp) : 0);
+        if (kvp != nullptr) {
+            EXPECT_EQ(ConfigStore_ReadValue(sto, kvp, value.data(), value.size()), 0) << errno;
+        }
+        return value;
+    };
+
+    // Keys out of order, padding, a chunked value, shared values and a duplicate key.
+    ConfigStore src;
+    open_store(&src, file_name);
+    std::vector<uint8_t> value(ConfigStoreMaxKvpValueSize + 10);
+    for (size_t i = 0; i < value.size(); ++i) {
+        value[i] = i * 13;
+    }
+    for (ConfigStoreKey key = 100; key > 0; --key) {
+        ASSERT_NE(ConfigStore_PutUniqueKey(&src, key, value.data(), key), nullptr);
+    }
+    for (ConfigStoreKey key = 10; key < 20; ++key) {
+        ASSERT_NE(ConfigStore_EraseKvp(&src, ConfigStore_TryGetKey(&src, key)), nullptr);
+    }
+    ASSERT_NE(ConfigStore_PutUniqueChunkedKey(&src, 15, value.data(), value.size()), nullptr);
+    ASSERT_NE(ConfigStore_PutSharedValue(&src, 200, value.data(), 50), nullptr);
+    ASSERT_NE(ConfigStore_PutSharedValue(&src, 5, value.data(), 50), nullptr);
+    ASSERT_NE(ConfigStore_InsertKvp(&src, ConfigStore_BeginKvp(&src), 50, 0), nullptr);
+
+    auto stream = export_store(&src);
+    ASSERT_EQ(ConfigStore_ValidateFormat(stream.data(), stream.size()), stream.size());
+
+    ConfigStore dst;
+    open_store(&dst, copy_name);
+    ConfigStoreImporter im;
+    ASSERT_EQ(ConfigStore_ImportBegin(&im, &dst), 0) << errno;
+    for (size_t offset = 0; offset < stream.size(); offset += 1000) {
+        ASSERT_EQ(ConfigStore_ImportUpdate(&im, &stream[offset],
+                                           std::min<size_t>(1000, stream.size() - offset)),
+                  0)
+            << errno;
+    }
+    ASSERT_EQ(ConfigStore_ImportEnd(&im), 0) << errno;
+
+    // Keys come out sorted, and the import reproduces the stream.
+    const ConfigStoreKey *keys;
+    size_t src_count = ConfigStore_GetIndexedKeys(&src, &keys);
+    size_t count = ConfigStore_GetIndexedKeys(&dst, &keys);
+    ASSERT_EQ(count, src_count);
+    ASSERT_TRUE(std::is_sorted(keys, keys + count));
+    for (ConfigStoreKey key : {1, 5, 15, 20, 50, 100, 200}) {
+        ASSERT_EQ(value_of(&dst, key), value_of(&src, key)) << key;
+    }
+    ASSERT_EQ(export_store(&dst), stream);
+
+    ASSERT_EQ(ConfigStore_Commit(&dst), 0) << errno;
+    ConfigStore_Close(&dst);
+    open_store(&dst, copy_name);
+    ASSERT_EQ(value_of(&dst, 15), value);
+
+    // Only into empty stores.
+    ASSERT_EQ(ConfigStore_ImportBegin(&im, &dst), -1);
+    ASSERT_EQ(errno, ENOTEMPTY);
+    ConfigStore_Close(&dst);
+    ConfigStore_Close(&src);
+
+    // Invalid and unsorted streams leave the store empty.
+    auto import_fails = [&](const std::vector<uint8_t> &bad) {
+        unlink(copy_name.c_str());
+        open_store(&dst, copy_name);
+        ASSERT_EQ(ConfigStore_ImportBegin(&im, &dst), 0) << errno;
+        if (ConfigStore_ImportUpdate(&im, bad.data(), bad.size()) == 0) {
+            ASSERT_EQ(ConfigStore_ImportEnd(&im), -1);
+        }
+        ASSERT_EQ(errno, EINVAL);
+        ASSERT_EQ(ConfigStore_BeginKvp(&dst), ConfigStore_EndKvp(&dst));
+        ConfigStore_Close(&dst);
+    };
+    std::vector<uint8_t> bad = stream;
+    bad.back() ^= 1;
+    import_fails(bad);
+    import_fails(std::vector<uint8_t>(stream.begin(), stream.end() - 1));
+
+    const uint8_t records[] = {2, 0, 5, 0, 0xAA, 1, 0, 4, 0};
+    ConfigStoreFileHeader header = {{ConfigStoreFileHeaderKey, sizeof(header)},
+                                    ConfigStoreFileSignature,
+                                    ConfigStoreFileVersion,
+                                    sizeof(header) + sizeof(records),
+                                    0};
+    header.crc = ConfigStore_AddCrc(ConfigStoreCrcInitValue, records, sizeof(records));
+    bad.assign((const uint8_t *)&header, (const uint8_t *)(&header + 1));
+    bad.insert(bad.end(), records, records + sizeof(records));
+    import_fails(bad);
+    ((ConfigStoreFileHeader *)bad.data())->version = ConfigStoreFileVersionCompact;
+    import_fails(bad);
+}
+
 } // namespace config